@@ -0,0 +1,40 @@
+#ifndef CIDRTRIE_H
+#define CIDRTRIE_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+using namespace std;
+
+struct CIDRTrieNode {
+  int32_t child[2];
+  bool    terminal;
+};
+
+/*
+ Binary trie of IPv4 and IPv6 network prefixes.
+ IPv4 networks are stored as IPv4-mapped IPv6 addresses so both share one trie.
+*/
+class CIDRTrie {
+  public:
+    CIDRTrie();
+    bool Insert(const string& cidr);
+    void Insert(const unsigned char* addr, int prefixLen);
+    bool Match(const struct in_addr& addr) const;
+    bool Match(const struct in6_addr& addr) const;
+    bool Match(const struct sockaddr* sa) const;
+    bool Empty() const;
+    size_t Size() const;
+
+  private:
+    vector<CIDRTrieNode> _nodes;
+    size_t _size;
+
+    int32_t AddNode();
+    bool Match(const unsigned char* addr) const;
+};
+
+#endif
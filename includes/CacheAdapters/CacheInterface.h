@@ -4,6 +4,8 @@
 #include <deque>
 #include <string>
 #include <map>
+#include <stdint.h>
+#include <sys/time.h>
 #include <boost/shared_ptr.hpp>
 #include "SSEConfig.h"
 
@@ -15,8 +17,47 @@ class CacheInterface {
   public:
     virtual void CacheEvent(SSEEvent& event)=0;
     virtual deque<string> GetEventsSinceId(string lastId)=0;
+    virtual deque<string> GetEventsAfterSeq(uint64_t seq)=0;
     virtual deque<string> GetAllEvents()=0;
     virtual size_t GetSizeOfCachedEvents()=0;
+    virtual size_t GetSizeOfCachedBytes()=0;
     ChannelConfig _config;
+
+  protected:
+    static int64_t GetTimestamp();
+    static bool IsExpired(const ChannelConfig& config, int64_t timestamp, int64_t now);
+    static bool ExceedsRetention(const ChannelConfig& config, size_t numBytes, int64_t oldest, int64_t now);
 };
+
+/**
+ Returns the current time in microseconds.
+**/
+inline int64_t CacheInterface::GetTimestamp() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/**
+ Check if a event cached at timestamp is older than cacheMaxAge.
+ @param config Channel configuration.
+ @param timestamp Time the event was cached in microseconds.
+ @param now Current time in microseconds.
+**/
+inline bool CacheInterface::IsExpired(const ChannelConfig& config, int64_t timestamp, int64_t now) {
+  return (config.cacheMaxAge > 0) && (timestamp + (int64_t)config.cacheMaxAge * 1000000 < now);
+}
+
+/**
+ Check if the oldest cached event must be evicted to stay within cacheMaxBytes and cacheMaxAge.
+ cacheLength is handled by each adapter.
+ @param config Channel configuration.
+ @param numBytes Total size of cached events.
+ @param oldest Time the oldest event was cached in microseconds.
+ @param now Current time in microseconds.
+**/
+inline bool CacheInterface::ExceedsRetention(const ChannelConfig& config, size_t numBytes, int64_t oldest, int64_t now) {
+  if (config.cacheMaxBytes > 0 && numBytes > config.cacheMaxBytes) return true;
+  return IsExpired(config, oldest, now);
+}
 #endif
@@ -1,24 +1,67 @@
 #ifndef LevelDB_H
 #define LevelDB_H
 
+#include <stdint.h>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
 #include "leveldb/c.h"
 #include "CacheInterface.h"
 
+// Number of events we allow the database to grow past cacheLength before trimming.
+#define LEVELDB_TRIM_BATCH 64
+
+/*
+ A LevelDB database shared by all channels in the process.
+*/
+class LevelDBStore {
+  public:
+    static boost::shared_ptr<LevelDBStore> Get(SSEConfig* config);
+    ~LevelDBStore();
+    leveldb_t* GetDB();
+    leveldb_readoptions_t* GetReadOptions();
+    leveldb_writeoptions_t* GetWriteOptions();
+
+  private:
+    LevelDBStore(SSEConfig* config);
+    leveldb_t* _db;
+    leveldb_cache_t* _cache;
+    leveldb_options_t* _options;
+    leveldb_writeoptions_t* _woptions;
+    leveldb_readoptions_t* _roptions;
+};
+
 class LevelDB : public CacheInterface {
   public:
     LevelDB(const ChannelConfig& config);
     ~LevelDB();
-    void InitDB(const string& dbfile); 
     void CacheEvent(SSEEvent& event);
     deque<string> GetEventsSinceId(string lastId);
+    deque<string> GetEventsAfterSeq(uint64_t seq);
     deque<string> GetAllEvents();
     size_t GetSizeOfCachedEvents();
+    size_t GetSizeOfCachedBytes();
     const ChannelConfig& _config;
 
   private:
+    boost::shared_ptr<LevelDBStore> _store;
     leveldb_t* _db;
-    leveldb_options_t* _options; 
-    leveldb_writeoptions_t* _woptions;
-    leveldb_readoptions_t* _roptions;
+    string _prefix;
+    boost::mutex _lock;
+    uint64_t _head;
+    uint64_t _next;
+    uint64_t _bytes;
+    int64_t _head_timestamp;
+
+    string MetaKey();
+    string EventKey(uint64_t seq);
+    string IndexKey(const string& id);
+    bool IsEventKey(const char* key, size_t klen);
+    void LoadMeta();
+    uint64_t GetFirstVisibleSeq();
+    bool LookupId(const string& id, uint64_t& seq);
+    bool ReadRecord(uint64_t seq, string& value);
+    size_t GetEventDataLength(uint64_t seq);
+    void Trim(leveldb_writebatch_t* batch, int64_t now);
+    deque<string> GetEventsFromSeq(uint64_t seq, const leveldb_snapshot_t* snapshot);
 };
 #endif
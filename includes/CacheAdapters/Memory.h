@@ -1,19 +1,32 @@
 #ifndef MEMORY_H
 #define MEMORY_H
 
+#include <boost/thread.hpp>
 #include "CacheInterface.h"
 
+struct MemoryCacheEntry {
+  string  data;
+  int64_t timestamp;
+};
+
 class Memory : public CacheInterface {
   public:
     Memory(const ChannelConfig& config);
     void CacheEvent(SSEEvent& event);
     deque<string> GetEventsSinceId(string lastId);
+    deque<string> GetEventsAfterSeq(uint64_t seq);
     deque<string> GetAllEvents();
     size_t GetSizeOfCachedEvents();
+    size_t GetSizeOfCachedBytes();
     const ChannelConfig& _config;
 
   private:
     deque<string> _cache_keys;
-    map<string, string> _cache_data;
+    deque<uint64_t> _cache_seqs;
+    map<string, MemoryCacheEntry> _cache_data;
+    size_t _cache_bytes;
+    boost::mutex _lock;
+
+    void Evict(int64_t now);
 };
 #endif
@@ -0,0 +1,81 @@
+#ifndef MMAPLOG_H
+#define MMAPLOG_H
+
+#include <stdint.h>
+#include <utility>
+#include <vector>
+#include <boost/thread.hpp>
+#include "CacheInterface.h"
+
+#define MMAPLOG_MAGIC "SSEHLOG1"
+#define MMAPLOG_ALIGN 8
+// Add a entry to the sparse seq index every n records.
+#define MMAPLOG_INDEX_INTERVAL 64
+// Max records in the log per cacheLength, including those superseded by a update.
+#define MMAPLOG_MAX_RECORDS_FACTOR 4
+
+struct MmapLogSegmentHeader {
+  char     magic[8];
+  uint64_t base_seq;
+  uint64_t size;
+  uint64_t used;
+  uint64_t count;
+  char     reserved[24];
+};
+
+struct MmapLogRecordHeader {
+  uint32_t length;
+  uint32_t id_len;
+  uint32_t data_len;
+  uint32_t reserved;
+  uint64_t seq;
+  int64_t  timestamp;
+  uint64_t event_seq;
+};
+
+struct MmapLogSegment {
+  string path;
+  char*  map;
+  size_t size;
+  uint64_t base_seq;
+  vector<pair<uint64_t, size_t> > index;
+};
+
+/*
+ Append-only event log per channel stored in memory mapped segment files.
+*/
+class MmapLog : public CacheInterface {
+  public:
+    MmapLog(const ChannelConfig& config);
+    ~MmapLog();
+    void CacheEvent(SSEEvent& event);
+    deque<string> GetEventsSinceId(string lastId);
+    deque<string> GetEventsAfterSeq(uint64_t seq);
+    deque<string> GetAllEvents();
+    size_t GetSizeOfCachedEvents();
+    size_t GetSizeOfCachedBytes();
+    const ChannelConfig& _config;
+
+  private:
+    string _dir;
+    string _spare;
+    size_t _segment_size;
+    deque<MmapLogSegment> _segments;
+    map<string, uint64_t> _ids;
+    uint64_t _head;
+    size_t _head_offset;
+    uint64_t _next;
+    size_t _bytes;
+    boost::mutex _lock;
+
+    void Recover();
+    bool MapSegment(const string& path, MmapLogSegment& segment);
+    bool AddSegment(size_t recordSize);
+    void RecycleSegment(MmapLogSegment& segment);
+    void IndexSegment(MmapLogSegment& segment);
+    void Evict(int64_t now);
+    bool Locate(uint64_t seq, size_t& segmentIdx, size_t& offset);
+    void LocateAfterEventSeq(uint64_t eventSeq, size_t& segmentIdx, size_t& offset);
+    deque<string> ReadFrom(size_t segmentIdx, size_t offset);
+};
+#endif
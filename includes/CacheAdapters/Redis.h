@@ -2,6 +2,7 @@
 #define REDIS_H
 
 #include "CacheInterface.h"
+#include <boost/thread/mutex.hpp>
 #include <redisclient/redissyncclient.h>
 
 using namespace std;
@@ -12,16 +13,26 @@ class Redis : public CacheInterface {
     Redis(const string key, const ChannelConfig& config);
     void CacheEvent(SSEEvent& event);
     deque<string> GetEventsSinceId(string lastId);
+    deque<string> GetEventsAfterSeq(uint64_t seq);
     deque<string> GetAllEvents();
     size_t GetSizeOfCachedEvents();
+    size_t GetSizeOfCachedBytes();
     const ChannelConfig& _config;
 
   private:
     void Expire(int ttl);
     bool InitClient(RedisSyncClient& client);
     string Lookup(string hostname);
+    deque<string> GetEvents(const string& lastId, int64_t afterScore);
+    RedisValue EvalScript(RedisSyncClient& client, const char* script, string& sha, const list<string>& args);
+    bool LoadScript(RedisSyncClient& client, const char* script, string& sha);
     string _key;
+    string _order_key;
+    string _bytes_key;
     string _host;
     unsigned short _port;
+    string _cache_sha;
+    string _read_sha;
+    boost::mutex _sha_lock;
 };
 #endif
@@ -21,6 +21,11 @@ class ConcurrentQueue {
       return _queue.empty();
     }
 
+    size_t Size() const {
+      boost::mutex::scoped_lock lock(_mutex);
+      return _queue.size();
+    }
+
     bool TryPop(Data& popped_value) {
       boost::mutex::scoped_lock lock(_mutex);
       if(_queue.empty()) {
@@ -32,7 +37,7 @@ class ConcurrentQueue {
       return true;
     }
 
-    void WaitPop(Data& popped_value) {
+    size_t WaitPop(Data& popped_value) {
       boost::mutex::scoped_lock lock(_mutex);
       while(_queue.empty()) {
         _cond.wait(lock);
@@ -40,5 +45,6 @@ class ConcurrentQueue {
 
       popped_value=_queue.front();
       _queue.pop();
+      return _queue.size();
     }
 };
@@ -0,0 +1,42 @@
+#ifndef EVENTCAPTURE_H
+#define EVENTCAPTURE_H
+
+#include <stdint.h>
+#include <string>
+
+using namespace std;
+
+// Start of every capture file.
+#define CAPTURE_MAGIC "SSECAP1\n"
+#define CAPTURE_MAGIC_LEN 8
+// Length of the fixed record header following the record length.
+#define CAPTURE_RECORD_HEADER_LEN 10
+// Records larger than this are taken as corruption.
+#define CAPTURE_MAX_RECORD 67108864
+
+enum CaptureReadStatus {
+  CAPTURE_RECORD,
+  CAPTURE_INCOMPLETE,
+  CAPTURE_INVALID
+};
+
+struct CaptureRecord {
+  uint64_t timestamp;
+  string channel;
+  string event;
+};
+
+/*
+ Binary capture format for recorded events, all integers in network byte order:
+
+ u32 length     Length of the rest of the record.
+ u64 timestamp  Time the event was received in microseconds.
+ u16 channel_len
+     channel, then the compiled event in the SSE wire format.
+*/
+size_t CaptureRecordSize(const string& channel, const string& event);
+char* WriteCaptureRecord(char* p, uint64_t timestamp, const string& channel, const string& event);
+void AppendCaptureRecord(string& buf, uint64_t timestamp, const string& channel, const string& event);
+CaptureReadStatus ReadCaptureRecord(const char* buf, size_t len, size_t& used, CaptureRecord& record);
+
+#endif
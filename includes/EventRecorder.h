@@ -0,0 +1,56 @@
+#ifndef EVENTRECORDER_H
+#define EVENTRECORDER_H
+
+#include <stdint.h>
+#include <string>
+#include <boost/thread.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include "Common.h"
+
+using namespace std;
+
+// Forward declarations.
+class SSEEvent;
+
+// Length marking the rest of the buffer as unused, the next slot starts at offset 0.
+#define RECORDER_WRAP 0xFFFFFFFF
+// Size of the slot header holding the record length, zero until the record is complete.
+#define RECORDER_SLOT_HEADER 8
+// Bytes collected before they are written to the file.
+#define RECORDER_WRITE_SIZE 262144
+// Milliseconds the writer sleeps when there is nothing to write.
+#define RECORDER_FLUSH_INTERVAL 10
+
+/*
+ Records every ingested event to a capture file which the file input source can replay.
+ Threads publishing events reserve space in a buffer with a compare and swap and never
+ wait, if the writer thread falls behind events are dropped from the capture instead.
+*/
+class EventRecorder {
+  public:
+    EventRecorder();
+    ~EventRecorder();
+    bool Start(const string& path, size_t capacity);
+    void Stop();
+    void Record(const string& channel, SSEEvent& event);
+    void GetStats(boost::property_tree::ptree& pt);
+
+  private:
+    string _path;
+    int _fd;
+    char* _buf;
+    uint64_t _capacity;
+    volatile uint64_t _head;
+    volatile uint64_t _tail;
+    volatile bool _stopping;
+    boost::thread _writer;
+    ulong _recorded;
+    ulong _dropped;
+    uint64_t _bytes;
+
+    void WriterMain();
+    void Drain(string& out);
+    void Write(const string& out);
+};
+
+#endif
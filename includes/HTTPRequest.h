@@ -2,12 +2,15 @@
 #define HTTPREQUEST_H
 
 #include <string>
-#include <map>
 #include "../lib/picohttpparser/picohttpparser.h"
+#include "StringRef.h"
 
 #define HTTPREQ_BUFSIZ 8192
 #define HTTP_POST_MAX 8192000
 #define HTTP_REQUEST_MAX_HEADERS 100
+#define HTTP_REQUEST_MAX_PARAMS 32
+// Number of unused request buffers to keep for reuse.
+#define HTTPREQ_POOL_MAX 256
 
 using namespace std;
 
@@ -23,45 +26,62 @@ enum HttpReqStatus {
   HTTP_REQ_OK
 };
 
+struct HTTPQueryParam {
+  StringRef name;
+  StringRef value;
+};
+
+/*
+ Raw request data and parser output, pooled and reused between requests.
+*/
+struct HTTPRequestBuffer {
+  char data[HTTPREQ_BUFSIZ + 1];
+  struct phr_header headers[HTTP_REQUEST_MAX_HEADERS];
+  HTTPQueryParam params[HTTP_REQUEST_MAX_PARAMS];
+};
+
 class HTTPRequest {
   public:
     HTTPRequest();
     ~HTTPRequest();
     HttpReqStatus Parse(const char *data, int len);
     bool Success();
-    const string& GetPath();
-    const string& GetMethod();
-    const map<string, string>& GetHeaders();
-    const string GetHeader(string header);
-    const string GetQueryString(string param);
+    StringRef GetPath();
+    StringRef GetMethod();
+    StringRef GetHeader(const StringRef& header);
+    StringRef GetQueryString(const StringRef& param);
     size_t NumQueryString();
+    bool IsKeepAlive();
+    size_t GetPipelinedData(char* dst, size_t len);
+    bool IsReadingPostData();
+    char* GetPostDataBuffer(size_t& avail);
+    HttpReqStatus PostDataRead(size_t len);
     const string& GetPostData();
     const string& GetErrorMessage();
 
   private:
     int http_minor_version;
     bool b_success;
-    std::string httpReq_buf;
+    HTTPRequestBuffer* httpReq_buf;
     int httpReq_bytesRead;
     int httpReq_bytesReadPrev;
     int httpReq_post_expected_size;
     int httpReq_post_bytesRead;
+    int httpReq_pipelined_offset;
     bool httpReq_isComplete;
     bool httpReq_isPost;
 
     const char *phr_method, *phr_path;
-    struct phr_header phr_headers[HTTP_REQUEST_MAX_HEADERS];
     size_t phr_num_headers, phr_method_len, phr_path_len;
     int phr_minor_version;
 
-    string path;
-    string method;
+    StringRef path;
+    StringRef method;
+    size_t num_headers;
+    size_t num_query_parameters;
     string post_data;
     string error_message;
-    map<string, string> headers;
-    map<string, string> query_parameters;
-    map<string, string> qsmap;
-    size_t ParseQueryString(const std::string& buf);
+    size_t ParseQueryString(const StringRef& buf);
 };
 
 #endif
@@ -1,14 +1,49 @@
 #include <string>
+#include <vector>
+#include <map>
 #include <glog/logging.h>
 #include <amqp_tcp_socket.h>
 #include <amqp.h>
 #include <amqp_framing.h>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
 #include "SSEInputSource.h"
+#include "ConcurrentQueue.h"
+
+// Forward declarations.
+class SSEEvent;
+class SharedEventRing;
+
+// Seconds to wait for a message before checking for shutdown.
+#define AMQP_CONSUME_TIMEOUT 1
+// Microseconds to wait for a message while messages are waiting to be acknowledged.
+#define AMQP_ACK_INTERVAL 10000
+// Highest prefetch count basic.qos accepts.
+#define AMQP_MAX_PREFETCH 65535
+// Max number of message buffers kept for reuse.
+#define AMQP_BUFFER_POOL_SIZE 1024
+// Weight of each new sample in the stage latency averages.
+#define AMQP_LATENCY_WEIGHT 0.01
+
+// A message on its way from the consumer through the decoders to the dispatcher.
+struct AmqpMessage {
+  uint64_t seq;
+  uint64_t deliveryTag;
+  std::string* body;
+  boost::shared_ptr<SSEEvent> event;
+  uint64_t received;
+  uint64_t decodeStart;
+  uint64_t decoded;
+};
+
+typedef boost::shared_ptr<AmqpMessage> AmqpMessagePtr;
 
 class AmqpInputSource : public SSEInputSource {
   public:
+    AmqpInputSource();
     ~AmqpInputSource();
     void Start();
+    void GetStats(boost::property_tree::ptree& pt);
 
   private:
     std::string host;
@@ -16,13 +51,48 @@ class AmqpInputSource : public SSEInputSource {
     std::string password;
     std::string exchange;
     std::string routingkey;
+    std::string queue;
+    bool rawFormat;
     int port;
+    int prefetch;
+    int batchSize;
     amqp_socket_t *amqpSocket;
     amqp_connection_state_t amqpConn;
     amqp_bytes_t amqpQueueName;
+    SharedEventRing* _ring;
+
+    // Pipeline state.
+    ConcurrentQueue<AmqpMessagePtr> _decodequeue;
+    boost::thread_group _decoders;
+    boost::thread _dispatcher;
+    std::vector<std::string*> _bufferpool;
+    boost::mutex _bufferpool_lock;
+    std::map<uint64_t, AmqpMessagePtr> _decoded;
+    boost::mutex _dispatch_lock;
+    boost::condition_variable _decoded_cond;
+    boost::condition_variable _dispatched_cond;
+    bool _stopping;
+    uint64_t _nextSeq;
+    uint64_t _nextDispatch;
+    uint64_t _dispatchedTag;
+    uint64_t _ackedTag;
+    ulong _invalid;
+    double _queueWaitAvg;
+    double _decodeAvg;
+    double _dispatchWaitAvg;
 
     bool Connect();
     void Disconnect();
-    void Reconnect(int delay);
+    bool Reconnect(int delay);
     void Consume();
+    bool ConsumeBatch();
+    bool Ack();
+    SSEEvent* ParseRaw(const amqp_envelope_t& envelope);
+    void StartPipeline();
+    void StopPipeline();
+    void WaitForPipeline();
+    void DecodeMain();
+    void DispatchMain();
+    std::string* GetBuffer();
+    void ReleaseBuffer(std::string* buf);
 };
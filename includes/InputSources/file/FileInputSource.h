@@ -0,0 +1,55 @@
+#ifndef FILEINPUTSOURCE_H
+#define FILEINPUTSOURCE_H
+
+#include <stdint.h>
+#include <string>
+#include "Common.h"
+#include "SSEInputSource.h"
+
+#define FILE_READ_SIZE 65536
+// Milliseconds to wait for more data at the end of the file.
+#define FILE_POLL_INTERVAL 200
+// Microseconds a event may be ahead of its pacing schedule before we sleep.
+#define FILE_PACE_SLACK 1000
+// Longest line accepted in JSON format.
+#define FILE_MAX_LINE 8192000
+
+/*
+ Reads events from a file or FIFO, either one JSON event per line or the binary capture format.
+ Replay can be limited to a number of events per second or paced by the recorded timestamps.
+*/
+class FileInputSource : public SSEInputSource {
+  public:
+    FileInputSource();
+    ~FileInputSource();
+    void Start();
+    void GetStats(boost::property_tree::ptree& pt);
+
+  private:
+    std::string _path;
+    int _fd;
+    bool _capture;
+    bool _follow;
+    bool _fifo;
+    bool _magicRead;
+    double _rate;
+    double _speed;
+    size_t _batchSize;
+    std::string _rbuf;
+    SSEEventBatch _batch;
+    uint64_t _readTime;
+    uint64_t _paceStart;
+    uint64_t _firstTimestamp;
+    ulong _paced;
+    uint64_t _bytesRead;
+
+    bool Open();
+    bool Read(bool& eof);
+    bool ProcessBuffer();
+    bool ProcessLines(size_t& pos);
+    bool ProcessRecords(size_t& pos);
+    void Add(SSEEvent* event, uint64_t timestamp);
+    void Flush();
+};
+
+#endif
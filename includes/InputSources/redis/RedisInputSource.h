@@ -0,0 +1,51 @@
+#ifndef REDISINPUTSOURCE_H
+#define REDISINPUTSOURCE_H
+
+#include <string>
+#include <vector>
+#include <boost/scoped_ptr.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/deadline_timer.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <redisclient/redisasyncclient.h>
+#include "Common.h"
+#include "SSEInputSource.h"
+
+// Seconds to wait before reconnecting after the connection to redis was lost.
+#define REDIS_RECONNECT_DELAY 1
+
+/*
+ Subscribes to channel patterns on redis and broadcasts the published messages.
+ The redis channel name minus channelPrefix names the ssehub channel.
+*/
+class RedisInputSource : public SSEInputSource {
+  public:
+    RedisInputSource();
+    ~RedisInputSource();
+    void Start();
+    void GetStats(boost::property_tree::ptree& pt);
+
+  private:
+    boost::asio::io_service _io;
+    boost::scoped_ptr<RedisAsyncClient> _client;
+    boost::scoped_ptr<boost::asio::deadline_timer> _reconnecttimer;
+    boost::scoped_ptr<boost::asio::posix::stream_descriptor> _shutdownfd;
+    std::string _host;
+    unsigned short _port;
+    std::vector<std::string> _patterns;
+    std::string _prefix;
+    bool _connected;
+    ulong _received;
+    ulong _invalid;
+    ulong _reconnects;
+
+    void Connect();
+    void OnConnect(bool ok, const std::string& errmsg);
+    void OnError(const std::string& errmsg);
+    void OnMessage(const std::string& channel, const std::vector<char>& msg);
+    void OnShutdown(const boost::system::error_code& ec);
+    void ScheduleReconnect();
+    void Reconnect(const boost::system::error_code& ec);
+};
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef SHAREDRINGINPUTSOURCE_H
+#define SHAREDRINGINPUTSOURCE_H
+
+#include "Common.h"
+#include "SSEInputSource.h"
+
+// Forward declarations.
+class SharedEventRing;
+
+// Milliseconds to wait for a event before checking for shutdown.
+#define SHAREDRING_WAIT_TIMEOUT 1000
+
+/*
+ Broadcasts events another worker has consumed and published to the shared event ring.
+*/
+class SharedRingInputSource : public SSEInputSource {
+  public:
+    SharedRingInputSource(SharedEventRing* ring);
+    ~SharedRingInputSource();
+    void Start();
+    void GetStats(boost::property_tree::ptree& pt);
+
+  private:
+    SharedEventRing* _ring;
+    ulong _received;
+    ulong _overruns;
+};
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef UNIXSOCKETINPUTSOURCE_H
+#define UNIXSOCKETINPUTSOURCE_H
+
+#include <stdint.h>
+#include <string>
+#include <map>
+#include "SSEInputSource.h"
+
+#define UNIXSOCKET_READ_SIZE 65536
+// Bytes read from one connection per wakeup, epoll reports the rest again.
+#define UNIXSOCKET_MAX_READ 1048576
+#define UNIXSOCKET_MAX_FRAME 8192000
+#define UNIXSOCKET_MAX_EVENTS 128
+
+// Length of the fixed event header following the frame length.
+#define UNIXSOCKET_EVENT_HEADER_LEN 16
+
+#define UNIXSOCKET_FRAME_EVENT 1
+#define UNIXSOCKET_FRAME_ACK   2
+
+#define UNIXSOCKET_STATUS_OK         0
+#define UNIXSOCKET_STATUS_INVALID    1
+#define UNIXSOCKET_STATUS_REJECTED   2
+
+struct UnixSocketConnection {
+  int fd;
+  std::string rbuf;
+  std::string wbuf;
+  size_t wpos;
+  bool writing;
+};
+
+/*
+ Accepts events in a binary length-prefixed frame format on a local unix socket.
+*/
+class UnixSocketInputSource : public SSEInputSource {
+  public:
+    UnixSocketInputSource();
+    ~UnixSocketInputSource();
+    void Start();
+
+  private:
+    std::string _path;
+    int _listensocket;
+    int _efd;
+    std::map<int, UnixSocketConnection*> _connections;
+
+    bool Listen();
+    void Accept();
+    void HandleRead(UnixSocketConnection* conn);
+    bool HandleWrite(UnixSocketConnection* conn);
+    bool ProcessFrames(UnixSocketConnection* conn);
+    SSEEvent* DecodeEvent(const char* frame, size_t len);
+    void CloseConnection(UnixSocketConnection* conn);
+};
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef ORIGINMATCHER_H
+#define ORIGINMATCHER_H
+
+#include <string>
+#include <vector>
+#include <boost/unordered_map.hpp>
+#include "StringRef.h"
+
+using namespace std;
+
+#define ORIGIN_NO_MATCH -1
+
+struct OriginMatcherNode {
+  boost::unordered_map<string, size_t> children;
+  int value;
+};
+
+/*
+ Matches Origin headers against a compiled set of allowed origins.
+ Plain rules like "https://some.host" must match exactly, wildcard rules like "*.some.host" match
+ any subdomain and can be limited to a scheme by prefixing it.
+ Wildcard rules are stored in a trie of host labels per scheme.
+*/
+class OriginMatcher {
+  public:
+    OriginMatcher();
+    void Add(const string& rule, int value);
+    int Match(const StringRef& origin) const;
+    bool IsWildcard(const string& rule) const;
+
+  private:
+    boost::unordered_map<string, int> _exact;
+    boost::unordered_map<string, size_t> _schemes;
+    vector<OriginMatcherNode> _nodes;
+
+    size_t AddNode();
+    int MatchHost(size_t root, const StringRef& host) const;
+};
+
+#endif
@@ -14,9 +14,11 @@
 #include <boost/thread.hpp>
 #include "Common.h"
 #include "SSEConfig.h"
+#include "OriginMatcher.h"
 #include "CacheAdapters/Memory.h"
 #include "CacheAdapters/Redis.h"
 #include "CacheAdapters/LevelDB.h"
+#include "CacheAdapters/MmapLog.h"
 
 using namespace std;
 
@@ -26,18 +28,47 @@ class SSEClient;
 class SSEClientHandler;
 class HTTPRequest;
 class HTTPResponse;
+class SSEHandoff;
 
 typedef boost::shared_ptr<SSEClientHandler> ClientHandlerPtr;
 typedef vector<ClientHandlerPtr> ClientHandlerList;
+typedef boost::shared_ptr<SSEEvent> SSEEventPtr;
+
+// Max number of origins matched by wildcard rules to keep prerendered responses for.
+#define CORS_MAX_CACHED_ORIGINS 1024
+#define CORS_WILDCARD_MATCH -2
+// Max number of events the dispatcher takes from the ingest queue at a time.
+#define INGEST_DISPATCH_BATCH 64
+
+// Prerendered responses for one Access-Control-Allow-Origin value, empty origin sends none.
+struct CorsResponses {
+  string origin;
+  string options;
+  string handshake;
+  string handshake_preamble;
+};
+
+typedef boost::shared_ptr<const CorsResponses> CorsResponsesPtr;
+
+enum SequenceIdMode {
+  SEQUENCE_IDS_NONE,
+  SEQUENCE_IDS_ID,
+  SEQUENCE_IDS_SUFFIX
+};
 
 struct SSEChannelStats {
   ulong num_clients;
   uint  num_cached_events;
+  size_t cache_bytes;
   ulong num_broadcasted_events;
   ulong num_errors;
   ulong num_connects;
   ulong num_disconnects;
   uint  cache_size;
+  size_t ingest_queued;
+  ulong ingest_blocked;
+  ulong ingest_shed;
+  ulong fanout_stalls;
 };
 
 class SSEChannel {
@@ -46,14 +77,17 @@ class SSEChannel {
     ~SSEChannel();
     string GetId();
     void Broadcast(const string& data);
-    void BroadcastEvent(SSEEvent& event);
+    bool BroadcastEvent(SSEEvent& event, bool wait=true);
     void CacheEvent(SSEEvent& event);
-    void SendEventsSince(SSEClient* client, string lastId);
-    void SendCache(SSEClient* client);
+    deque<string> GetEventsSince(const string& lastId);
     const SSEChannelStats& GetStats();
     void AddClient(SSEClient* client, HTTPRequest* req);
+    bool AdoptClient(SSEClient* client);
+    void RestoreEvent(const string& text);
     ulong GetNumClients();
     const ChannelConfig& GetConfig();
+    void Shutdown(uint64_t deadline);
+    bool Handoff(SSEHandoff& handoff, bool clients);
 
   private:
     int _efd;
@@ -62,17 +96,42 @@ class SSEChannel {
     SSEChannelStats _stats;
     boost::thread _cleanupthread;
     boost::thread _pingthread;
+    boost::thread _dispatchthread;
     ClientHandlerList _clientpool;
     CacheInterface* _cache_adapter;
     bool _allow_all_origins;
-    char _evs_preamble_data[2052];
+    OriginMatcher _origin_matcher;
+    vector<CorsResponsesPtr> _cors_responses;
+    boost::unordered_map<string, CorsResponsesPtr> _wildcard_cors_responses;
+    boost::mutex _cors_lock;
+    string _evs_preamble;
+    SequenceIdMode _seq_mode;
+    uint64_t _seq;
+    deque<SSEEventPtr> _ingest_queue;
+    boost::mutex _ingest_lock;
+    boost::condition_variable _ingest_ready;
+    boost::condition_variable _ingest_space;
+    bool _ingest_shed;
+    bool _ingest_stopping;
+    boost::mutex _fanout_lock;
+    boost::condition_variable _fanout_space;
 
     void InitializeCache();
     void InitializeThreads();
+    void InitializeResponses();
     void CleanupMain();
     void CleanupThreads();
+    void DispatchMain();
+    void StopDispatch();
+    void WaitForFanout();
+    void FanoutDrained();
+    size_t GetFanoutDepth();
     void Ping();
-    void SetCorsHeaders(HTTPRequest* req, HTTPResponse& res);
+    CorsResponsesPtr RenderCorsResponses(const string& origin);
+    CorsResponsesPtr GetCorsResponses(HTTPRequest* req);
+    void SetCorsHeaders(const string& origin, HTTPResponse& res);
+    uint64_t NextSeq();
+    bool ParseSeq(const string& lastId, uint64_t& seq);
 };
 
 typedef boost::shared_ptr<SSEChannel> SSEChannelPtr;
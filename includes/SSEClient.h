@@ -4,7 +4,9 @@
 #include <string>
 #include <deque>
 #include <sys/epoll.h>
+#include <sys/socket.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <stdint.h>
 #include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
@@ -27,26 +29,32 @@ using namespace std;
 
 class SSEClient {
   public:
-    SSEClient(int, struct sockaddr_in* csin);
+    SSEClient(int, const struct sockaddr* csin, socklen_t csinLen);
     ~SSEClient();
     int Send(const string &data, bool flush=true);
-    size_t Read(void* buf, int len);
+    int SendBatch(const string& head, const deque<string>& events);
+    ssize_t Read(void* buf, size_t len);
     int Getfd();
     HTTPRequest* GetHttpReq();
-    const string GetIP();
-    uint32_t GetSockAddr();
+    const char* GetIP();
+    const struct sockaddr* GetSockAddr();
     void MarkAsDead();
     bool IsDead();
     void Destroy();
     void DeleteHttpReq();
+    void ResetHttpReq();
     bool isSubscribed(const string key, SubscriptionType type);
     void Subscribe(const string key, SubscriptionType type);
     bool isFilterAcceptable(const string& data);
     int Flush();
+    size_t GetSendBufferSize();
+    void GetState(string& buf);
+    bool RestoreState(const string& buf);
 
    private:
     int _fd;
-    struct sockaddr_in _csin;
+    struct sockaddr_storage _csin;
+    char _ip[INET6_ADDRSTRLEN];
     bool _dead;
     bool _isEventFiltered;
     bool _isIdFiltered;
@@ -6,31 +6,41 @@
 #include <list>
 #include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
+#include <boost/function.hpp>
 #include "ConcurrentQueue.h"
 
 using namespace std;
 
 // Forward declarations.
 class SSEClient;
+class SSEHandoff;
 
 typedef boost::shared_ptr<SSEClient> SSEClientPtr;
 typedef list<SSEClientPtr> SSEClientPtrList;
 
 class SSEClientHandler {
   public:
-    SSEClientHandler(int);
+    SSEClientHandler(int, size_t queueLimit=0, boost::function<void()> onDrained=boost::function<void()>());
     ~SSEClientHandler();
     void AddClient(SSEClient* client);
     void Broadcast(const string msg);
+    size_t GetQueueSize();
     size_t GetNumClients();
+    void Stop();
+    void SendRetry(int retryMs, int jitterMs);
+    size_t Flush();
+    bool Handoff(SSEHandoff& handoff);
 
   private:
     int _id;
+    bool _stopping;
     size_t _connected_clients;
     SSEClientPtrList _clientlist;
     boost::mutex _clientlist_lock;
     boost::thread _processorthread;
     ConcurrentQueue<std::string> _msgqueue;
+    size_t _queue_limit;
+    boost::function<void()> _on_drained;
 
     void ProcessQueue();
 };
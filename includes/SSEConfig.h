@@ -4,22 +4,25 @@
 #include <string>
 #include <stdint.h>
 #include <boost/property_tree/ptree.hpp>
+#include <boost/shared_ptr.hpp>
 #include "SSEClient.h"
+#include "CIDRTrie.h"
 
 using namespace std;
 
-typedef struct {
-  uint32_t range;
-  uint32_t mask;
-} iprange_t;
-
 struct ChannelConfig {
   string                 id;
   class SSEConfig*       server;
   std::vector<string>    allowedOrigins;
-  std::vector<iprange_t> allowedPublishers;
+  boost::shared_ptr<CIDRTrie> allowedPublishers;
   string                 cacheAdapter;
   size_t                 cacheLength;
+  size_t                 cacheMaxBytes;
+  int                    cacheMaxAge;
+  string                 sequenceIds;
+  size_t                 ingestQueueSize;
+  string                 ingestOverflow;
+  size_t                 fanoutQueueSize;
 };
 
 typedef std::map<const std::string, std::string> ConfigMap_t;
@@ -30,7 +33,9 @@ class SSEConfig {
     bool load(const char*);
     SSEConfig();
     const string &GetValue(const string& key);
+    void SetValue(const string& key, const string& value);
     int GetValueInt(const string& key);
+    size_t GetValueSize(const string& key);
     bool GetValueBool(const string& key);
     ChannelMap_t& GetChannels();
     ChannelConfig& GetDefaultChannelConfig();
@@ -4,6 +4,7 @@
 #include <string>
 #include <sstream>
 #include <vector>
+#include <stdint.h>
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
 #include <glog/logging.h>
@@ -12,21 +13,39 @@ using namespace std;
 
 class SSEEvent {
   public:
+    SSEEvent();
     SSEEvent(const string& jsonData);
+    SSEEvent(const char* jsonData, size_t len);
+    SSEEvent(const SSEEvent& other);
     ~SSEEvent();
     bool  compile();
+    bool  parse(const string& text);
     const string get();
     const string getpath();
     const string getid();
+    const string getevent();
+    int   getretry();
+    const string getdata();
     void  setpath(const string path);
+    void  setid(const string& id);
+    void  setevent(const string& event);
+    void  setretry(int retry);
+    void  setdata(const char* data, size_t len);
+    void  setseq(uint64_t seq, bool suffix);
+    uint64_t getseq();
+    const string getpubid();
 
   private:
     stringstream _json_ss;
+    const char* _json_data;
+    size_t _json_len;
     string _event;
     string _path;
     vector<string> _data;
     string _id;
+    string _pubid;
     int _retry;
+    uint64_t _seq;
 };
 
 #endif
@@ -0,0 +1,77 @@
+#ifndef SSEHANDOFF_H
+#define SSEHANDOFF_H
+
+#include <stdint.h>
+#include <string>
+#include <deque>
+#include <vector>
+
+using namespace std;
+
+// Forward declarations.
+class SSEConfig;
+
+// Milliseconds a running worker waits for the handoff request after accepting a connection.
+#define HANDOFF_REQUEST_TIMEOUT 1000
+
+enum HandoffMessageType {
+  HANDOFF_LISTENER = 1,
+  HANDOFF_CHANNEL,
+  HANDOFF_EVENT,
+  HANDOFF_CLIENT,
+  HANDOFF_DONE,
+  HANDOFF_REQUEST
+};
+
+struct HandoffMessage {
+  uint32_t type;
+  string   payload;
+  int      fd;
+};
+
+// State of a channel received from the worker we are replacing.
+struct HandoffChannel {
+  string id;
+  deque<string> events;
+  vector<pair<int, string> > clients;
+};
+
+/*
+ Connection between a running worker and the worker replacing it during a hot upgrade.
+ Messages are a type and length header followed by the payload, a file descriptor
+ can be attached to the header with SCM_RIGHTS.
+*/
+class SSEHandoff {
+  public:
+    SSEHandoff(int fd);
+    ~SSEHandoff();
+    static string GetDir(SSEConfig* config);
+    static string GetPath(SSEConfig* config);
+    static int Listen(SSEConfig* config);
+    static SSEHandoff* Accept(int listenfd);
+    static SSEHandoff* Connect(SSEConfig* config);
+    bool Send(uint32_t type, const string& payload, int fd=-1);
+    bool Receive(HandoffMessage& msg);
+
+  private:
+    int _fd;
+};
+
+/*
+ Helpers to build and parse message payloads.
+*/
+void HandoffAppend(string& buf, uint32_t value);
+void HandoffAppend(string& buf, const string& value);
+
+class HandoffReader {
+  public:
+    HandoffReader(const string& buf);
+    bool Read(uint32_t& value);
+    bool Read(string& value);
+
+  private:
+    const string& _buf;
+    size_t _pos;
+};
+
+#endif
@@ -1,27 +1,61 @@
 #ifndef SSEDATASOURCE_H
 #define SSEDATASOURCE_H
 
+#include <stdint.h>
 #include <string>
+#include <vector>
 #include <boost/function.hpp>
 #include <boost/thread.hpp>
+#include <boost/property_tree/ptree.hpp>
 
 // Forward declarations.
 class SSEServer;
 class SSEConfig;
+class SSEEvent;
+
+typedef std::vector<SSEEvent*> SSEEventBatch;
+
+// Weight of each new sample in the ingest lag average.
+#define INPUTSOURCE_LAG_WEIGHT 0.01
+// Seconds the ingest rate is averaged over.
+#define INPUTSOURCE_RATE_WINDOW 10
+
+// Counters kept for every input source, shown under inputs.<name> in the stats.
+struct SSEInputSourceStats {
+  unsigned long events;
+  unsigned long rejected;
+  unsigned long errors;
+  unsigned long batches;
+  double lagAvg;
+  double rate;
+  uint64_t windowEvents;
+  uint64_t windowStart;
+};
 
 class SSEInputSource {
   public:
     SSEInputSource();
     virtual ~SSEInputSource();
-    void Init(SSEServer* server);
+    void Init(SSEServer* server, const std::string& name);
     void Run();
     virtual void Start() {};
-    void KillThread();
+    virtual void GetStats(boost::property_tree::ptree& pt) {};
+    void GetIngestStats(boost::property_tree::ptree& pt);
+    const std::string& GetName();
+    void StopThread();
 
   protected:
     SSEServer* _server;
     SSEConfig* _config;
     boost::thread _thread;
+
+    bool Publish(SSEEvent& event, uint64_t received=0);
+    size_t PublishBatch(const SSEEventBatch& events, uint64_t received=0, std::vector<bool>* delivered=NULL);
+    void CountError();
+
+  private:
+    std::string _name;
+    SSEInputSourceStats _ingest;
 };
 
 #endif
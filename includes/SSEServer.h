@@ -16,17 +16,27 @@
 #include <boost/thread.hpp>
 #include <boost/shared_ptr.hpp>
 #include "SSEEvent.h"
+#include "HTTPRequest.h"
 #include "SSEStatsHandler.h"
-
-extern int stop;
+#include "SSEHandoff.h"
+#include "SSEInputSource.h"
 
 // Forward declarations.
+class SSEServer;
 class SSEConfig;
 class SSEChannel;
-class SSEInputSource;
-class HTTPRequest;
+class SharedEventRing;
+class EventRecorder;
 
 typedef std::vector<boost::shared_ptr<SSEChannel> > SSEChannelList;
+typedef std::vector<boost::shared_ptr<SSEInputSource> > SSEInputSourceList;
+
+// A kind of input source, started when enableKey is true in the config.
+struct SSEInputSourceType {
+  const char* name;
+  const char* enableKey;
+  SSEInputSource* (*create)(SSEServer* server);
+};
 
 class SSEServer {
   public:
@@ -34,25 +44,44 @@ class SSEServer {
     ~SSEServer();
 
     void Run();
-    const SSEChannelList& GetChannelList();
+    SSEChannelList GetChannelList();
+    const SSEInputSourceList& GetInputSources();
+    const boost::shared_ptr<EventRecorder>& GetRecorder();
     SSEConfig* GetConfig();
+    void SetEventRing(SharedEventRing* ring);
+    SharedEventRing* GetEventRing();
     bool IsAllowedToPublish(SSEClient* client, const struct ChannelConfig& chConf);
     bool Broadcast(SSEEvent& event);
+    size_t Broadcast(const SSEEventBatch& events, std::vector<bool>* delivered=NULL);
 
   private:
     SSEConfig *_config;
     SSEChannelList _channels;
-    boost::shared_ptr<SSEInputSource> _datasource;
+    boost::mutex _channels_lock;
+    SSEInputSourceList _inputsources;
     SSEStatsHandler stats;
     boost::thread _routerthread;
-    int _serversocket;
+    std::vector<int> _serversockets;
     int _efd;
-    struct sockaddr_in _sin;
+    int _handoffsocket;
+    boost::shared_ptr<SSEHandoff> _handoff;
+    SharedEventRing* _eventring;
+    boost::shared_ptr<EventRecorder> _recorder;
 
     void InitSocket();
+    void Shutdown();
+    int Listen(const std::string& address, bool v6only);
+    void InitRecorder();
+    void InitInputSources();
+    void ReceiveHandoff(std::vector<HandoffChannel>& channels);
+    void RestoreHandoff(std::vector<HandoffChannel>& channels);
+    bool StartHandoff();
     void AcceptLoop();
     void ClientRouterLoop();
+    bool ProcessRequest(SSEClient* client, HTTPRequest* req, HttpReqStatus reqRet);
+    int Publish(SSEClient* client, SSEEvent& event, bool validEvent);
     void PostHandler(SSEClient* client, HTTPRequest* req);
+    void BatchHandler(SSEClient* client, HTTPRequest* req);
     void InitChannels();
     void RemoveClient(SSEClient* client);
     SSEChannel* GetChannel(const std::string id, bool create=false);
@@ -4,8 +4,6 @@
 #include <string>
 #include "Common.h"
 
-extern int stop;
-
 // Forward declarations.
 class SSEConfig;
 class SSEServer;
@@ -17,6 +15,8 @@ class SSEStatsHandler {
     ulong router_read_errors;
     ulong invalid_http_req;
     ulong oversized_http_req;
+    ulong publish_allowed;
+    ulong publish_denied;
 
     SSEStatsHandler();
     ~SSEStatsHandler();
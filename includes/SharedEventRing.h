@@ -0,0 +1,54 @@
+#ifndef SHAREDEVENTRING_H
+#define SHAREDEVENTRING_H
+
+#include <stdint.h>
+#include <string>
+
+using namespace std;
+
+// Forward declarations.
+class SSEEvent;
+
+// Length marking the rest of the ring as unused, the next record starts at offset 0.
+#define RING_WRAP 0xFFFFFFFF
+// Size of the record header holding the payload length.
+#define RING_RECORD_HEADER 8
+
+enum RingReadStatus {
+  RING_EMPTY,
+  RING_EVENT,
+  RING_OVERRUN
+};
+
+// Lives at the start of the shared mapping, positions count bytes written since creation.
+struct SharedEventRingHeader {
+  volatile uint64_t head;
+  volatile uint64_t reserve;
+  uint64_t capacity;
+  char pad[40];
+  volatile int32_t futex;
+  volatile int32_t waiters;
+};
+
+/*
+ Broadcast ring buffer in shared memory, created before fork() so one process can
+ hand compiled events to all workers. There is a single writer which never waits
+ for readers, readers falling more than the capacity behind skip ahead and lose events.
+*/
+class SharedEventRing {
+  public:
+    static SharedEventRing* Create(size_t capacity);
+    ~SharedEventRing();
+    bool Publish(SSEEvent& event);
+    uint64_t GetHead();
+    RingReadStatus Read(uint64_t& tail, SSEEvent& event);
+    void Wait(uint64_t tail, int timeoutMs);
+
+  private:
+    SharedEventRing(void* mapping, size_t size);
+    SharedEventRingHeader* _hdr;
+    char* _data;
+    size_t _size;
+};
+
+#endif
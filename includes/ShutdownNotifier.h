@@ -0,0 +1,28 @@
+#ifndef SHUTDOWNNOTIFIER_H
+#define SHUTDOWNNOTIFIER_H
+
+#include <signal.h>
+
+/*
+ Tells threads that the process is shutting down.
+ Notify() is async signal safe, threads blocking in epoll or poll add GetFd() to their
+ set to be woken up, which stays readable once notified.
+*/
+class ShutdownNotifier {
+  public:
+    ShutdownNotifier();
+    ~ShutdownNotifier();
+    void Init();
+    void Notify();
+    bool IsStopping() const;
+    int GetFd() const;
+    bool Wait(int timeoutMs) const;
+
+  private:
+    int _fd;
+    volatile sig_atomic_t _stopping;
+};
+
+extern ShutdownNotifier serverShutdown;
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef STRINGREF_H
+#define STRINGREF_H
+
+#include <string.h>
+#include <strings.h>
+#include <string>
+#include <ostream>
+
+using namespace std;
+
+/*
+ Non-owning reference to a range of characters.
+ The referenced memory must outlive the StringRef.
+*/
+class StringRef {
+  public:
+    static const size_t npos = static_cast<size_t>(-1);
+
+    StringRef() : _data(""), _len(0) {}
+    StringRef(const char* data, size_t len) : _data(data), _len(len) {}
+    StringRef(const char* str) : _data(str), _len(strlen(str)) {}
+    StringRef(const string& str) : _data(str.data()), _len(str.size()) {}
+
+    const char* data() const { return _data; }
+    size_t size() const { return _len; }
+    bool empty() const { return _len == 0; }
+    char operator[](size_t pos) const { return _data[pos]; }
+    string str() const { return string(_data, _len); }
+
+    StringRef substr(size_t pos, size_t len = npos) const {
+      if (pos > _len) pos = _len;
+      if (len > _len - pos) len = _len - pos;
+      return StringRef(_data + pos, len);
+    }
+
+    size_t find(char c, size_t pos = 0) const {
+      if (pos >= _len) return npos;
+      const void* p = memchr(_data + pos, c, _len - pos);
+      return p ? static_cast<const char*>(p) - _data : npos;
+    }
+
+    bool startswith(const StringRef& prefix) const {
+      return _len >= prefix._len && memcmp(_data, prefix._data, prefix._len) == 0;
+    }
+
+    bool iequals(const StringRef& other) const {
+      return _len == other._len && strncasecmp(_data, other._data, _len) == 0;
+    }
+
+    bool operator==(const StringRef& other) const {
+      return _len == other._len && memcmp(_data, other._data, _len) == 0;
+    }
+
+    bool operator!=(const StringRef& other) const {
+      return !(*this == other);
+    }
+
+  private:
+    const char* _data;
+    size_t _len;
+};
+
+inline ostream& operator<<(ostream& os, const StringRef& ref) {
+  return os.write(ref.data(), ref.size());
+}
+
+#endif
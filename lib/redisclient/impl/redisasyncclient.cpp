@@ -299,6 +299,38 @@ void RedisAsyncClient::unsubscribe(const Handle &handle)
 #endif
 }
 
+void RedisAsyncClient::psubscribe(
+        const std::string &pattern,
+        const boost::function<void(const std::string &channel, const std::vector<char> &msg)> &msgHandler,
+        const boost::function<void(const RedisValue &)> &handler)
+{
+    assert( pimpl->state == RedisClientImpl::Connected ||
+            pimpl->state == RedisClientImpl::Subscribed);
+
+    static const std::string psubscribeStr = "PSUBSCRIBE";
+
+    if( pimpl->state == RedisClientImpl::Connected || pimpl->state == RedisClientImpl::Subscribed )
+    {
+        std::vector<RedisBuffer> items(2);
+        items[0] = psubscribeStr;
+        items[1] = pattern;
+
+        pimpl->post(boost::bind(&RedisClientImpl::doAsyncCommand, pimpl,
+                    pimpl->makeCommand(items), handler));
+        pimpl->patternMsgHandlers.insert(std::make_pair(pattern, msgHandler));
+        pimpl->state = RedisClientImpl::Subscribed;
+    }
+    else
+    {
+        std::stringstream ss;
+
+        ss << "RedisAsyncClient::command called with invalid state "
+           << pimpl->state;
+
+        pimpl->errorHandler(ss.str());
+    }
+}
+
 void RedisAsyncClient::singleShotSubscribe(const std::string &channel,
                                       const boost::function<void(const std::vector<char> &msg)> &msgHandler,
                                       const boost::function<void(const RedisValue &)> &handler)
@@ -77,7 +77,7 @@ void RedisClientImpl::doProcessMessage(const RedisValue &v)
                     strand.post(boost::bind(handlerIt->second.second, value.toByteArray()));
                 }
             }
-            else if( cmd == "subscribe" && handlers.empty() == false )
+            else if( (cmd == "subscribe" || cmd == "psubscribe") && handlers.empty() == false )
             {
                 handlers.front()(v);
                 handlers.pop();
@@ -98,6 +98,20 @@ void RedisClientImpl::doProcessMessage(const RedisValue &v)
                 return;
             }
         }
+        else if( result.size() == 4 && result[0].toString() == "pmessage" )
+        {
+            const RedisValue &pattern = result[1];
+            const RedisValue &channel = result[2];
+            const RedisValue &value = result[3];
+
+            std::pair<PatternHandlersMap::iterator, PatternHandlersMap::iterator> pair =
+                    patternMsgHandlers.equal_range(pattern.toString());
+            for(PatternHandlersMap::iterator handlerIt = pair.first;
+                handlerIt != pair.second; ++handlerIt)
+            {
+                strand.post(boost::bind(handlerIt->second, channel.toString(), value.toByteArray()));
+            }
+        }
         else
         {
             errorHandler("[RedisClient] Protocol error");
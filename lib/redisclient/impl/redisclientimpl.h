@@ -79,10 +79,13 @@ public:
 
     typedef std::multimap<std::string, MsgHandlerType> MsgHandlersMap;
     typedef std::multimap<std::string, SingleShotHandlerType> SingleShotHandlersMap;
+    typedef boost::function<void(const std::string &channel, const std::vector<char> &buf)> PatternHandlerType;
+    typedef std::multimap<std::string, PatternHandlerType> PatternHandlersMap;
 
     std::queue<boost::function<void(const RedisValue &v)> > handlers;
     MsgHandlersMap msgHandlers;
     SingleShotHandlersMap singleShotMsgHandlers;
+    PatternHandlersMap patternMsgHandlers;
 
     struct QueueItem {
         boost::function<void(const RedisValue &)> handler;
@@ -139,6 +139,14 @@ public:
             const boost::function<void(const std::vector<char> &msg)> &msgHandler,
             const boost::function<void(const RedisValue &)> &handler = &dummyHandler);
 
+    // Subscribe to all channels matching pattern. Handler msgHandler will
+    // be called with the channel name when someone publish message on a
+    // matching channel.
+    REDIS_CLIENT_DECL void psubscribe(
+            const std::string &pattern,
+            const boost::function<void(const std::string &channel, const std::vector<char> &msg)> &msgHandler,
+            const boost::function<void(const RedisValue &)> &handler = &dummyHandler);
+
     // Publish message on channel.
     REDIS_CLIENT_DECL void publish(
             const std::string &channel, const RedisBuffer &msg,
@@ -0,0 +1,142 @@
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "CIDRTrie.h"
+
+/*
+ Map a IPv4 address into the ::ffff:0:0/96 IPv6 range.
+*/
+static void MapIPv4(const struct in_addr& in, unsigned char* addr) {
+  memset(addr, 0, 10);
+  addr[10] = 0xff;
+  addr[11] = 0xff;
+  memcpy(addr + 12, &in.s_addr, 4);
+}
+
+CIDRTrie::CIDRTrie() {
+  _size = 0;
+  AddNode();
+}
+
+int32_t CIDRTrie::AddNode() {
+  CIDRTrieNode node;
+  node.child[0] = -1;
+  node.child[1] = -1;
+  node.terminal = false;
+  _nodes.push_back(node);
+
+  return _nodes.size() - 1;
+}
+
+/**
+ Add a network in CIDR notation, like 10.0.0.0/8 or fd00::/8.
+ A address without prefix length is added as a single host.
+ @param cidr Network to add.
+ @return false if cidr could not be parsed.
+*/
+bool CIDRTrie::Insert(const string& cidr) {
+  unsigned char addr[16];
+  struct in_addr in;
+  size_t slash = cidr.find('/');
+  const string ip = cidr.substr(0, slash);
+  int maxLen;
+  int prefixLen;
+
+  if (inet_pton(AF_INET, ip.c_str(), &in) == 1) {
+    MapIPv4(in, addr);
+    maxLen = 32;
+  } else if (inet_pton(AF_INET6, ip.c_str(), addr) == 1) {
+    maxLen = 128;
+  } else {
+    return false;
+  }
+
+  prefixLen = maxLen;
+  if (slash != string::npos) {
+    const string len = cidr.substr(slash + 1);
+    char* end;
+
+    prefixLen = strtol(len.c_str(), &end, 10);
+    if (len.empty() || *end != '\0' || prefixLen < 0 || prefixLen > maxLen) return false;
+  }
+
+  // IPv4 prefixes start after the 96 bit mapped prefix.
+  Insert(addr, prefixLen + (128 - maxLen));
+
+  return true;
+}
+
+/**
+ Add a network.
+ @param addr 16 byte IPv6 address in network byte order.
+ @param prefixLen Number of leading bits of addr that make up the network.
+*/
+void CIDRTrie::Insert(const unsigned char* addr, int prefixLen) {
+  int32_t node = 0;
+
+  for (int i = 0; i < prefixLen; i++) {
+    int bit = (addr[i / 8] >> (7 - (i % 8))) & 1;
+
+    if (_nodes[node].child[bit] == -1) {
+      int32_t next = AddNode();
+      _nodes[node].child[bit] = next;
+    }
+
+    node = _nodes[node].child[bit];
+  }
+
+  if (!_nodes[node].terminal) {
+    _nodes[node].terminal = true;
+    _size++;
+  }
+}
+
+/**
+ Check if a address is inside any of the networks.
+ @param addr 16 byte IPv6 address in network byte order.
+*/
+bool CIDRTrie::Match(const unsigned char* addr) const {
+  int32_t node = 0;
+
+  for (int i = 0; i <= 128; i++) {
+    if (_nodes[node].terminal) return true;
+    if (i == 128) break;
+
+    node = _nodes[node].child[(addr[i / 8] >> (7 - (i % 8))) & 1];
+    if (node == -1) break;
+  }
+
+  return false;
+}
+
+bool CIDRTrie::Match(const struct in_addr& in) const {
+  unsigned char addr[16];
+  MapIPv4(in, addr);
+
+  return Match(addr);
+}
+
+bool CIDRTrie::Match(const struct in6_addr& in6) const {
+  return Match(in6.s6_addr);
+}
+
+/**
+ Check if the address of a socket is inside any of the networks.
+ @param sa AF_INET or AF_INET6 socket address.
+*/
+bool CIDRTrie::Match(const struct sockaddr* sa) const {
+  switch (sa->sa_family) {
+    case AF_INET:  return Match(reinterpret_cast<const struct sockaddr_in*>(sa)->sin_addr);
+    case AF_INET6: return Match(reinterpret_cast<const struct sockaddr_in6*>(sa)->sin6_addr);
+  }
+
+  return false;
+}
+
+bool CIDRTrie::Empty() const {
+  return _size == 0;
+}
+
+size_t CIDRTrie::Size() const {
+  return _size;
+}
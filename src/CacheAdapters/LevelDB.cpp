@@ -1,3 +1,5 @@
+#include <string.h>
+#include <algorithm>
 #include "Common.h"
 #include "CacheAdapters/LevelDB.h"
 #include "SSEConfig.h"
@@ -5,45 +7,309 @@
 
 using namespace std;
 
+/*
+ Database layout, all keys prefixed with "<channel id>\0":
+   m            -> <head seq><next seq><bytes>            Persisted counters.
+   e<seq>       -> <timestamp><event seq><id length><id><event>
+                                                         Events ordered by insertion.
+   i<id>        -> <seq>                     Secondary index from event id to seq.
+
+ All integers are stored big-endian so event keys sort in insertion order.
+*/
+#define LEVELDB_KEY_META  'm'
+#define LEVELDB_KEY_EVENT 'e'
+#define LEVELDB_KEY_INDEX 'i'
+#define LEVELDB_EVENT_KEY_LEN 9
+#define LEVELDB_RECORD_HEADER_LEN 20
+
+static boost::mutex store_lock;
+static boost::weak_ptr<LevelDBStore> store_instance;
+
+static void PutUint32(string& dst, uint32_t val) {
+  for (int i = 3; i >= 0; i--) dst.push_back((char)((val >> (i * 8)) & 0xff));
+}
+
+static void PutUint64(string& dst, uint64_t val) {
+  for (int i = 7; i >= 0; i--) dst.push_back((char)((val >> (i * 8)) & 0xff));
+}
+
+static uint32_t GetUint32(const char* src) {
+  uint32_t val = 0;
+  for (int i = 0; i < 4; i++) val = (val << 8) | (unsigned char)src[i];
+  return val;
+}
+
+static uint64_t GetUint64(const char* src) {
+  uint64_t val = 0;
+  for (int i = 0; i < 8; i++) val = (val << 8) | (unsigned char)src[i];
+  return val;
+}
+
+/*
+ Extract the time in microseconds an event record was cached.
+*/
+static int64_t GetRecordTimestamp(const char* val, size_t vlen) {
+  if (vlen < LEVELDB_RECORD_HEADER_LEN) return 0;
+  return (int64_t)GetUint64(val);
+}
+
+/*
+ Extract the sequence number assigned to the event by the channel.
+*/
+static uint64_t GetRecordEventSeq(const char* val, size_t vlen) {
+  if (vlen < LEVELDB_RECORD_HEADER_LEN) return 0;
+  return GetUint64(val + 8);
+}
+
+/*
+ Extract the id stored in front of an event record.
+*/
+static string GetRecordId(const char* val, size_t vlen) {
+  if (vlen < LEVELDB_RECORD_HEADER_LEN) return "";
+  uint32_t idlen = GetUint32(val + 16);
+  if (idlen > vlen - LEVELDB_RECORD_HEADER_LEN) return "";
+  return string(val + LEVELDB_RECORD_HEADER_LEN, idlen);
+}
+
+/*
+ Returns the length of the event data stored in an event record.
+*/
+static size_t GetRecordDataLength(const char* val, size_t vlen) {
+  if (vlen < LEVELDB_RECORD_HEADER_LEN) return 0;
+  uint32_t idlen = GetUint32(val + 16);
+  if (idlen > vlen - LEVELDB_RECORD_HEADER_LEN) return 0;
+  return vlen - LEVELDB_RECORD_HEADER_LEN - idlen;
+}
+
+/*
+ Extract the event data stored in an event record.
+*/
+static string GetRecordData(const char* val, size_t vlen) {
+  size_t datalen = GetRecordDataLength(val, vlen);
+  return string(val + vlen - datalen, datalen);
+}
+
+/**
+  Returns the LevelDBStore for this process, opening it if needed.
+  @param config Pointer to SSEConfig.
+**/
+boost::shared_ptr<LevelDBStore> LevelDBStore::Get(SSEConfig* config) {
+  boost::mutex::scoped_lock lock(store_lock);
+  boost::shared_ptr<LevelDBStore> store = store_instance.lock();
+
+  if (!store) {
+    store = boost::shared_ptr<LevelDBStore>(new LevelDBStore(config));
+    store_instance = store;
+  }
+
+  return store;
+}
+
 /**
   Constructor.
-  @param config SSEChannelConfig.
+  Each worker process opens its own database since LevelDB only allows one owner.
+  @param config Pointer to SSEConfig.
 **/
-LevelDB::LevelDB(const ChannelConfig& config) : _config(config) {
-  const string cachefile = _config.server->GetValue("leveldb.storageDir") + "/" + config.id + ".db";
-  LOG(INFO) << "LevelDB storage file: " << cachefile;
-  InitDB(cachefile);
+LevelDBStore::LevelDBStore(SSEConfig* config) {
+  char* err = NULL;
+  const string dbfile = config->GetValue("leveldb.storageDir") + "/ssehub-" +
+    config->GetValue("server.workerId") + ".db";
+
+  LOG(INFO) << "LevelDB storage file: " << dbfile;
+
+  _cache = leveldb_cache_create_lru(config->GetValueInt("leveldb.blockCacheSize"));
+  _options = leveldb_options_create();
+  _roptions = leveldb_readoptions_create();
+  _woptions = leveldb_writeoptions_create();
+  leveldb_options_set_create_if_missing(_options, 1);
+  leveldb_options_set_cache(_options, _cache);
+  leveldb_options_set_write_buffer_size(_options, config->GetValueInt("leveldb.writeBufferSize"));
+  leveldb_options_set_max_open_files(_options, config->GetValueInt("leveldb.maxOpenFiles"));
+
+  _db = leveldb_open(_options, dbfile.c_str(), &err);
+
+  if (err != NULL) {
+    LOG(FATAL) << "Failed to open leveldb storage file: " << err;
+    leveldb_free(err);
+    err = NULL;
+  }
 }
 
 /**
  Destructor.
 */
-LevelDB::~LevelDB() {
+LevelDBStore::~LevelDBStore() {
+  leveldb_close(_db);
   leveldb_options_destroy(_options);
   leveldb_writeoptions_destroy(_woptions);
   leveldb_readoptions_destroy(_roptions);
-  leveldb_close(_db);
+  leveldb_cache_destroy(_cache);
+}
+
+leveldb_t* LevelDBStore::GetDB() {
+  return _db;
+}
+
+leveldb_readoptions_t* LevelDBStore::GetReadOptions() {
+  return _roptions;
+}
+
+leveldb_writeoptions_t* LevelDBStore::GetWriteOptions() {
+  return _woptions;
+}
+
+/**
+  Constructor.
+  @param config SSEChannelConfig.
+**/
+LevelDB::LevelDB(const ChannelConfig& config) : _config(config) {
+  _store = LevelDBStore::Get(_config.server);
+  _db = _store->GetDB();
+  _prefix = _config.id + '\0';
+  _head = 0;
+  _next = 0;
+  _bytes = 0;
+  _head_timestamp = 0;
+
+  LoadMeta();
+
+  LOG(INFO) << "LevelDB cache initialized for " << _config.id;
+}
+
+/**
+ Destructor.
+*/
+LevelDB::~LevelDB() {
+}
+
+string LevelDB::MetaKey() {
+  return _prefix + LEVELDB_KEY_META;
+}
+
+string LevelDB::EventKey(uint64_t seq) {
+  string key = _prefix + LEVELDB_KEY_EVENT;
+  PutUint64(key, seq);
+  return key;
+}
+
+string LevelDB::IndexKey(const string& id) {
+  return _prefix + LEVELDB_KEY_INDEX + id;
 }
 
 /**
- @param dbfile Path where we should create or load the database.
+ Check if key is a event key belonging to this channel.
 **/
-void LevelDB::InitDB(const string& dbfile) {
+bool LevelDB::IsEventKey(const char* key, size_t klen) {
+  return (klen == _prefix.size() + LEVELDB_EVENT_KEY_LEN) &&
+    (memcmp(key, _prefix.data(), _prefix.size()) == 0) &&
+    (key[_prefix.size()] == LEVELDB_KEY_EVENT);
+}
+
+/**
+ Load the persisted sequence counters.
+**/
+void LevelDB::LoadMeta() {
   char* err = NULL;
+  size_t vlen;
+  const string key = MetaKey();
+  char* val = leveldb_get(_db, _store->GetReadOptions(), key.data(), key.size(), &vlen, &err);
 
-  _options = leveldb_options_create();
-  _roptions = leveldb_readoptions_create();
-  _woptions = leveldb_writeoptions_create();
-  leveldb_options_set_create_if_missing(_options, 1);
-  _db = leveldb_open(_options, dbfile.c_str(), &err);
+  if (err != NULL) {
+    LOG(ERROR) << "Failed to read leveldb meta for " << _config.id << ": " << err;
+    leveldb_free(err);
+    return;
+  }
+
+  if (val != NULL) {
+    if (vlen == 24) {
+      _head = GetUint64(val);
+      _next = GetUint64(val + 8);
+      _bytes = GetUint64(val + 16);
+    }
+
+    leveldb_free(val);
+    DLOG(INFO) << "LevelDB " << _config.id << ": head " << _head << " next " << _next << " bytes " << _bytes;
+  }
+}
+
+/**
+ Returns the first sequence number that is within cacheLength.
+ Events before this may still be stored until the next trim.
+**/
+uint64_t LevelDB::GetFirstVisibleSeq() {
+  if (_next - _head > _config.cacheLength) return _next - _config.cacheLength;
+  return _head;
+}
+
+/**
+ Look up the sequence number for a event id.
+ @param id Event id.
+ @param seq Set to the sequence number if found.
+**/
+bool LevelDB::LookupId(const string& id, uint64_t& seq) {
+  char* err = NULL;
+  size_t vlen;
+  const string key = IndexKey(id);
+  char* val = leveldb_get(_db, _store->GetReadOptions(), key.data(), key.size(), &vlen, &err);
 
   if (err != NULL) {
-    LOG(FATAL) << "Failed to open leveldb storage file: " << err;
+    LOG(ERROR) << "Failed to look up event id " << id << ": " << err;
     leveldb_free(err);
-    err = NULL;
+    return false;
   }
 
-  LOG(INFO) << "LevelDB::InitDB finished for " << _config.id;
+  if (val == NULL) return false;
+
+  bool found = (vlen == 8);
+  if (found) seq = GetUint64(val);
+  leveldb_free(val);
+
+  return found;
+}
+
+/**
+ Add delete operations for all events outside cacheLength, cacheMaxBytes or cacheMaxAge to batch.
+ @param batch Write batch to add the operations to.
+ @param now Current time in microseconds.
+**/
+void LevelDB::Trim(leveldb_writebatch_t* batch, int64_t now) {
+  uint64_t target = GetFirstVisibleSeq();
+  uint64_t prev_head = _head;
+  const string first = EventKey(_head);
+  leveldb_iterator_t* it = leveldb_create_iterator(_db, _store->GetReadOptions());
+
+  for (leveldb_iter_seek(it, first.data(), first.size()); leveldb_iter_valid(it); leveldb_iter_next(it)) {
+    size_t klen, vlen;
+    uint64_t seq, idxseq;
+    const char* key = leveldb_iter_key(it, &klen);
+
+    if (!IsEventKey(key, klen)) break;
+    seq = GetUint64(key + _prefix.size() + 1);
+
+    const char* val = leveldb_iter_value(it, &vlen);
+    int64_t timestamp = GetRecordTimestamp(val, vlen);
+    if (seq >= target && !ExceedsRetention(_config, _bytes, timestamp, now)) {
+      _head_timestamp = timestamp;
+      break;
+    }
+
+    // Only drop the index entry if it still points to this event.
+    const string id = GetRecordId(val, vlen);
+    if (LookupId(id, idxseq) && idxseq == seq) {
+      const string idxkey = IndexKey(id);
+      leveldb_writebatch_delete(batch, idxkey.data(), idxkey.size());
+    }
+
+    leveldb_writebatch_delete(batch, key, klen);
+    _bytes -= min((uint64_t)GetRecordDataLength(val, vlen), _bytes);
+    _head = seq + 1;
+  }
+
+  leveldb_iter_destroy(it);
+
+  if (_head < target) _head = target;
+
+  DLOG(INFO) << "LevelDB " << _config.id << ": Trimmed " << (_head - prev_head) << " events.";
 }
 
 /**
@@ -51,116 +317,227 @@ void LevelDB::InitDB(const string& dbfile) {
  @patam event Pointer to SSEEvent to cache.
 **/
 void LevelDB::CacheEvent(SSEEvent& event) {
+  boost::mutex::scoped_lock lock(_lock);
+  const string id = event.getid();
+  const string data = event.get();
+  const int64_t now = GetTimestamp();
+  uint64_t seq, prev_head = _head, prev_next = _next, prev_bytes = _bytes, old_bytes = 0;
+  int64_t prev_head_timestamp = _head_timestamp;
+  bool isUpdate;
   char* err = NULL;
+  string meta, value;
+
+  // If we have the event id cached already keep the position and only update the data.
+  isUpdate = LookupId(id, seq) && (seq >= GetFirstVisibleSeq());
+  if (isUpdate) old_bytes = GetEventDataLength(seq);
 
-  leveldb_put(_db, _woptions, event.getid().c_str(), event.getid().length()+1,
-      event.get().c_str(), event.get().length()+1, &err);
+  _bytes += data.size();
+
+  leveldb_writebatch_t* batch = leveldb_writebatch_create();
+
+  // Trim first so the writes below take precedence in the batch.
+  if ((_next - _head >= _config.cacheLength + LEVELDB_TRIM_BATCH) ||
+      ExceedsRetention(_config, _bytes, _head_timestamp, now)) {
+    Trim(batch, now);
+  }
+
+  // The event we are updating may have been trimmed, Trim then already took its length off _bytes.
+  if (isUpdate && seq < _head) isUpdate = false;
+  if (isUpdate) _bytes -= min(old_bytes, _bytes);
+
+  if (!isUpdate) {
+    seq = _next++;
+    if (_head == seq) _head_timestamp = now;
+  }
+
+  const string key = EventKey(seq);
+  PutUint64(value, now);
+  PutUint64(value, event.getseq());
+  PutUint32(value, id.length());
+  value.append(id);
+  value.append(data);
+  leveldb_writebatch_put(batch, key.data(), key.size(), value.data(), value.size());
+
+  if (!isUpdate) {
+    const string idxkey = IndexKey(id);
+    string idxval;
+    PutUint64(idxval, seq);
+    leveldb_writebatch_put(batch, idxkey.data(), idxkey.size(), idxval.data(), idxval.size());
+  }
+
+  const string metakey = MetaKey();
+  PutUint64(meta, _head);
+  PutUint64(meta, _next);
+  PutUint64(meta, _bytes);
+  leveldb_writebatch_put(batch, metakey.data(), metakey.size(), meta.data(), meta.size());
+
+  leveldb_write(_db, _store->GetWriteOptions(), batch, &err);
+  leveldb_writebatch_destroy(batch);
 
   if (err != NULL) {
-    LOG(ERROR) << "Failed to cache event with id " << event.getid() << ": " << err;
+    LOG(ERROR) << "Failed to cache event with id " << id << ": " << err;
     leveldb_free(err);
-    return;
+    _head = prev_head;
+    _next = prev_next;
+    _bytes = prev_bytes;
+    _head_timestamp = prev_head_timestamp;
+  }
+}
+
+/**
+ Read the event record stored at a sequence number.
+ @param seq Sequence number of event.
+ @param value Set to the record if found.
+**/
+bool LevelDB::ReadRecord(uint64_t seq, string& value) {
+  char* err = NULL;
+  size_t vlen;
+  const string key = EventKey(seq);
+  char* val = leveldb_get(_db, _store->GetReadOptions(), key.data(), key.size(), &vlen, &err);
+
+  if (err != NULL) {
+    LOG(ERROR) << "Failed to read event " << seq << ": " << err;
+    leveldb_free(err);
+    return false;
   }
 
-  if (GetSizeOfCachedEvents() > _config.cacheLength) {
-    size_t klen;
-    char *err = NULL;
-    leveldb_iterator_t* it = leveldb_create_iterator(_db, _roptions);
+  if (val == NULL) return false;
 
-    leveldb_iter_seek_to_first(it);
-    const string key = leveldb_iter_key(it, &klen);
+  value.assign(val, vlen);
+  leveldb_free(val);
 
-    leveldb_delete(_db, _woptions, key.c_str(), klen, &err);
+  return true;
+}
 
-    if (err != NULL) {
-      LOG(ERROR) << "Failed to delete key " << key << ": " << err;
-      leveldb_free(err);
-    } else {
-      DLOG(INFO) << "Deleted key " << key;
-    }
+/**
+ Returns the length of the event data stored at a sequence number.
+ @param seq Sequence number of event.
+**/
+size_t LevelDB::GetEventDataLength(uint64_t seq) {
+  string value;
 
-    leveldb_iter_destroy(it);
-  }
+  if (!ReadRecord(seq, value)) return 0;
+  return GetRecordDataLength(value.data(), value.size());
 }
 
 /**
- Get a list of all events since a givend ID.
- @param lastId ID of first event.
+ Get a list of all events starting at a given sequence number.
+ Events older than cacheMaxAge that have not been trimmed yet are skipped.
+ @param seq Sequence number of first event.
+ @param snapshot Snapshot to read from, released when done.
 **/
-deque<string> LevelDB::GetEventsSinceId(string lastId) {
+deque<string> LevelDB::GetEventsFromSeq(uint64_t seq, const leveldb_snapshot_t* snapshot) {
+  const int64_t now = GetTimestamp();
   deque<string> events;
   leveldb_iterator_t* it;
   leveldb_readoptions_t* readopts;
-  const leveldb_snapshot_t* snapshot;
+  const string first = EventKey(seq);
 
-  snapshot = leveldb_create_snapshot(_db);
   readopts = leveldb_readoptions_create();
-  leveldb_readoptions_set_snapshot(readopts, snapshot); 
+  leveldb_readoptions_set_snapshot(readopts, snapshot);
 
   it = leveldb_create_iterator(_db, readopts);
 
-  for (leveldb_iter_seek(it, lastId.c_str(), lastId.length()); 
-      leveldb_iter_valid(it); leveldb_iter_next(it)) {
-    size_t vlen;
+  for (leveldb_iter_seek(it, first.data(), first.size()); leveldb_iter_valid(it); leveldb_iter_next(it)) {
+    size_t klen, vlen;
+    const char* key = leveldb_iter_key(it, &klen);
+    if (!IsEventKey(key, klen)) break;
+
     const char* val = leveldb_iter_value(it, &vlen);
-    events.push_back(val);
+    if (IsExpired(_config, GetRecordTimestamp(val, vlen), now)) continue;
+    events.push_back(GetRecordData(val, vlen));
   }
 
   leveldb_iter_destroy(it);
   leveldb_release_snapshot(_db, snapshot);
   leveldb_readoptions_destroy(readopts);
+
   return events;
 }
 
 /**
- Get a list of all events stored in the cache.
+ Get a list of all events since a givend ID.
+ @param lastId ID of first event.
 **/
-deque<string> LevelDB::GetAllEvents() {
-  deque<string> events;
-  leveldb_iterator_t* it;
-  leveldb_readoptions_t* readopts;
+deque<string> LevelDB::GetEventsSinceId(string lastId) {
   const leveldb_snapshot_t* snapshot;
+  uint64_t seq;
 
-  snapshot = leveldb_create_snapshot(_db);
-  readopts = leveldb_readoptions_create();
-  leveldb_readoptions_set_snapshot(readopts, snapshot); 
+  {
+    boost::mutex::scoped_lock lock(_lock);
 
-  it = leveldb_create_iterator(_db, readopts);
-  
-  for (leveldb_iter_seek_to_first(it); leveldb_iter_valid(it); leveldb_iter_next(it)) {
-    size_t vlen;
-    const char* val = leveldb_iter_value(it, &vlen);
-    events.push_back(val);
+    if (!LookupId(lastId, seq) || seq < GetFirstVisibleSeq()) {
+      return deque<string>();
+    }
+
+    snapshot = leveldb_create_snapshot(_db);
   }
 
-  leveldb_iter_destroy(it);
-  leveldb_release_snapshot(_db, snapshot);
-  leveldb_readoptions_destroy(readopts);
+  return GetEventsFromSeq(seq, snapshot);
+}
 
-  return events;
+/**
+ Get a list of all events with a channel sequence number higher than seq.
+ Events are stored in channel sequence order so we can binary search the stored range.
+ @param seq Sequence number of the last event seen by the client.
+**/
+deque<string> LevelDB::GetEventsAfterSeq(uint64_t seq) {
+  const leveldb_snapshot_t* snapshot;
+  uint64_t lo, hi;
+  string value;
+
+  {
+    boost::mutex::scoped_lock lock(_lock);
+    lo = GetFirstVisibleSeq();
+    hi = _next;
+
+    while (lo < hi) {
+      uint64_t mid = lo + (hi - lo) / 2;
+
+      if (ReadRecord(mid, value) && GetRecordEventSeq(value.data(), value.size()) > seq) {
+        hi = mid;
+      } else {
+        lo = mid + 1;
+      }
+    }
+
+    if (lo == _next) return deque<string>();
+
+    snapshot = leveldb_create_snapshot(_db);
+  }
+
+  return GetEventsFromSeq(lo, snapshot);
 }
 
 /**
- Get number of events currently stored in the cache.
+ Get a list of all events stored in the cache.
 **/
-size_t LevelDB::GetSizeOfCachedEvents() {
-  leveldb_iterator_t* it;
-  leveldb_readoptions_t* readopts;
+deque<string> LevelDB::GetAllEvents() {
   const leveldb_snapshot_t* snapshot;
-  size_t n_keys;
+  uint64_t seq;
 
-  snapshot = leveldb_create_snapshot(_db);
-  readopts = leveldb_readoptions_create();
-  it = leveldb_create_iterator(_db, readopts);
- 
-  leveldb_iter_seek_to_first(it);
-  for(n_keys = 0; leveldb_iter_valid(it); leveldb_iter_next(it)) {
-    n_keys++;
+  {
+    boost::mutex::scoped_lock lock(_lock);
+    seq = GetFirstVisibleSeq();
+    snapshot = leveldb_create_snapshot(_db);
   }
 
-  leveldb_iter_destroy(it);
-  leveldb_release_snapshot(_db, snapshot);
-  leveldb_readoptions_destroy(readopts);
+  return GetEventsFromSeq(seq, snapshot);
+}
 
-  return n_keys;
+/**
+ Get number of events currently stored in the cache.
+**/
+size_t LevelDB::GetSizeOfCachedEvents() {
+  boost::mutex::scoped_lock lock(_lock);
+  return _next - GetFirstVisibleSeq();
+}
+
+/**
+ Get the total size of the events currently stored in the cache.
+ This includes events past cacheLength that have not been trimmed yet.
+**/
+size_t LevelDB::GetSizeOfCachedBytes() {
+  boost::mutex::scoped_lock lock(_lock);
+  return _bytes;
 }
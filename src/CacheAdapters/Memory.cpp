@@ -2,53 +2,119 @@
 #include "CacheAdapters/Memory.h"
 #include "SSEConfig.h"
 #include "SSEEvent.h"
+#include <algorithm>
 #include <boost/foreach.hpp>
 
 using namespace std;
 
-Memory::Memory(const ChannelConfig& config) : _config(config) {}
+Memory::Memory(const ChannelConfig& config) : _config(config), _cache_bytes(0) {}
+
+/**
+ Delete the oldest events until we are within cacheLength, cacheMaxBytes and cacheMaxAge.
+ @param now Current time in microseconds.
+**/
+void Memory::Evict(int64_t now) {
+  while (!_cache_keys.empty()) {
+    map<string, MemoryCacheEntry>::iterator it = _cache_data.find(_cache_keys.front());
+
+    if (_cache_keys.size() <= _config.cacheLength &&
+        !ExceedsRetention(_config, _cache_bytes, it->second.timestamp, now)) {
+      break;
+    }
+
+    _cache_bytes -= it->second.data.size();
+    _cache_data.erase(it);
+    _cache_keys.pop_front();
+    _cache_seqs.pop_front();
+  }
+}
 
 void Memory::CacheEvent(SSEEvent& event) {
-  // If we have the event id in our vector already don't remove it.
+  boost::mutex::scoped_lock lock(_lock);
+  const int64_t now = GetTimestamp();
+  const string data = event.get();
+  map<string, MemoryCacheEntry>::iterator it = _cache_data.find(event.getid());
+
+  // If we have the event id cached already don't move it.
   // We want to keep the order even if we get an update on the event.
-  if (std::find(_cache_keys.begin(), _cache_keys.end(), event.getid()) == _cache_keys.end()) {
+  if (it == _cache_data.end()) {
     _cache_keys.push_back(event.getid());
+    _cache_seqs.push_back(event.getseq());
+    MemoryCacheEntry& entry = _cache_data[event.getid()];
+    entry.data = data;
+    entry.timestamp = now;
+  } else {
+    _cache_bytes -= it->second.data.size();
+    it->second.data = data;
   }
 
-  _cache_data[event.getid()] = event.get();
+  _cache_bytes += data.size();
 
-  // Delete the oldest cache object if we hit the historyLength limit.
-  if (_cache_keys.size() > _config.cacheLength) {
-    string &firstElementId = *(_cache_keys.begin());
-    _cache_data.erase(firstElementId);
-    _cache_keys.erase(_cache_keys.begin());
-  }
+  Evict(now);
 }
 
 deque<string> Memory::GetEventsSinceId(string lastId) {
+  boost::mutex::scoped_lock lock(_lock);
   deque<string>::const_iterator it;
   deque<string> events;
 
+  Evict(GetTimestamp());
+
+  if (_cache_data.find(lastId) == _cache_data.end()) {
+    return events;
+  }
+
   it = std::find(_cache_keys.begin(), _cache_keys.end(), lastId);
 
   while (it != _cache_keys.end()) {
-    events.push_back(_cache_data[*it]);
+    events.push_back(_cache_data[*it].data);
     it++;
   }
 
   return events;
 }
 
+/**
+ Get a list of all events with a sequence number higher than seq.
+ @param seq Sequence number of the last event seen by the client.
+**/
+deque<string> Memory::GetEventsAfterSeq(uint64_t seq) {
+  boost::mutex::scoped_lock lock(_lock);
+  deque<string> events;
+
+  Evict(GetTimestamp());
+
+  size_t idx = upper_bound(_cache_seqs.begin(), _cache_seqs.end(), seq) - _cache_seqs.begin();
+
+  for (; idx < _cache_keys.size(); idx++) {
+    events.push_back(_cache_data[_cache_keys[idx]].data);
+  }
+
+  return events;
+}
+
 deque<string> Memory::GetAllEvents() {
+  boost::mutex::scoped_lock lock(_lock);
   deque<string> events;
 
-	BOOST_FOREACH(const string& key, _cache_keys) {
-		events.push_back(_cache_data[key]);
-	}
+  Evict(GetTimestamp());
+
+  BOOST_FOREACH(const string& key, _cache_keys) {
+    events.push_back(_cache_data[key].data);
+  }
 
   return events;
 }
 
 size_t Memory::GetSizeOfCachedEvents() {
-    return _cache_keys.size();
+  boost::mutex::scoped_lock lock(_lock);
+  return _cache_keys.size();
+}
+
+/**
+ Get the total size of the events currently stored in the cache.
+**/
+size_t Memory::GetSizeOfCachedBytes() {
+  boost::mutex::scoped_lock lock(_lock);
+  return _cache_bytes;
 }
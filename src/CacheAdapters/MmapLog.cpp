@@ -0,0 +1,555 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <boost/foreach.hpp>
+#include "Common.h"
+#include "CacheAdapters/MmapLog.h"
+#include "SSEConfig.h"
+#include "SSEEvent.h"
+
+using namespace std;
+
+#define SEGMENT_HEADER(seg) (reinterpret_cast<MmapLogSegmentHeader*>((seg).map))
+#define RECORD_HEADER(seg, offset) (reinterpret_cast<MmapLogRecordHeader*>((seg).map + (offset)))
+
+static size_t Align(size_t len) {
+  return (len + MMAPLOG_ALIGN - 1) & ~((size_t)MMAPLOG_ALIGN - 1);
+}
+
+/*
+ Escape a channel id so it can be used as a directory name.
+*/
+static string EscapePath(const string& id) {
+  string escaped;
+  char hex[4];
+
+  for (size_t i = 0; i < id.size(); i++) {
+    unsigned char c = id[i];
+    if (isalnum(c) || c == '-' || c == '_' || (c == '.' && i > 0)) {
+      escaped.push_back(c);
+    } else {
+      snprintf(hex, sizeof(hex), "%%%02X", c);
+      escaped.append(hex);
+    }
+  }
+
+  return escaped;
+}
+
+/*
+ Create a directory and all its parents.
+*/
+static bool MakeDirs(const string& path) {
+  for (size_t pos = 1; pos != string::npos; pos++) {
+    pos = path.find('/', pos);
+    const string dir = path.substr(0, pos);
+    if (mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST) return false;
+    if (pos == string::npos) break;
+  }
+
+  return true;
+}
+
+/**
+  Constructor.
+  @param config SSEChannelConfig.
+**/
+MmapLog::MmapLog(const ChannelConfig& config) : _config(config) {
+  _dir = _config.server->GetValue("mmap.storageDir") + "/ssehub-" +
+    _config.server->GetValue("server.workerId") + "/" + EscapePath(_config.id);
+  _spare = _dir + "/spare";
+  _segment_size = Align(_config.server->GetValueInt("mmap.segmentSize"));
+  _head = 0;
+  _head_offset = sizeof(MmapLogSegmentHeader);
+  _next = 0;
+  _bytes = 0;
+
+  if (_segment_size < sizeof(MmapLogSegmentHeader) + sizeof(MmapLogRecordHeader)) {
+    _segment_size = 4194304;
+  }
+
+  LOG_IF(FATAL, !MakeDirs(_dir)) << "Could not create mmap storage directory " << _dir << ": " << strerror(errno);
+  LOG(INFO) << "Mmap log storage directory: " << _dir;
+
+  Recover();
+}
+
+/**
+ Destructor.
+*/
+MmapLog::~MmapLog() {
+  BOOST_FOREACH(MmapLogSegment& segment, _segments) {
+    munmap(segment.map, segment.size);
+  }
+}
+
+/**
+ Map a existing segment file.
+ @param path Path to segment file.
+ @param segment Segment to initialize.
+**/
+bool MmapLog::MapSegment(const string& path, MmapLogSegment& segment) {
+  struct stat st;
+  int fd = open(path.c_str(), O_RDWR);
+
+  segment.map = NULL;
+
+  if (fd == -1) return false;
+
+  if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(MmapLogSegmentHeader)) {
+    close(fd);
+    return false;
+  }
+
+  void* map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (map == MAP_FAILED) return false;
+
+  segment.path = path;
+  segment.map = static_cast<char*>(map);
+  segment.size = st.st_size;
+
+  MmapLogSegmentHeader* hdr = SEGMENT_HEADER(segment);
+  if (memcmp(hdr->magic, MMAPLOG_MAGIC, sizeof(hdr->magic)) != 0 || hdr->size != segment.size ||
+      hdr->used < sizeof(MmapLogSegmentHeader) || hdr->used > segment.size) {
+    munmap(segment.map, segment.size);
+    segment.map = NULL;
+    return false;
+  }
+
+  segment.base_seq = hdr->base_seq;
+  return true;
+}
+
+/**
+ Build the sparse seq index for a segment by walking the record headers.
+ @param segment Segment to index.
+**/
+void MmapLog::IndexSegment(MmapLogSegment& segment) {
+  MmapLogSegmentHeader* hdr = SEGMENT_HEADER(segment);
+  size_t offset = sizeof(MmapLogSegmentHeader);
+  uint64_t n = 0;
+
+  segment.index.clear();
+
+  while (offset + sizeof(MmapLogRecordHeader) <= hdr->used) {
+    MmapLogRecordHeader* rec = RECORD_HEADER(segment, offset);
+    if (rec->length < sizeof(MmapLogRecordHeader) || offset + rec->length > hdr->used) break;
+
+    if (n % MMAPLOG_INDEX_INTERVAL == 0) {
+      segment.index.push_back(make_pair(rec->seq, offset));
+    }
+
+    _ids[string(segment.map + offset + sizeof(MmapLogRecordHeader), rec->id_len)] = rec->seq;
+    _next = rec->seq + 1;
+    _bytes += rec->data_len;
+    offset += rec->length;
+    n++;
+  }
+
+  // Drop anything after the last valid record.
+  hdr->used = offset;
+  hdr->count = n;
+}
+
+/**
+ Load segments stored on disk and rebuild the index.
+**/
+void MmapLog::Recover() {
+  vector<pair<uint64_t, string> > files;
+  DIR* dir = opendir(_dir.c_str());
+  struct dirent* entry;
+
+  if (dir == NULL) return;
+
+  while ((entry = readdir(dir)) != NULL) {
+    const string name = entry->d_name;
+    if (name.size() != 20 || name.compare(16, 4, ".seg") != 0) continue;
+    files.push_back(make_pair(strtoull(name.substr(0, 16).c_str(), NULL, 16), _dir + "/" + name));
+  }
+
+  closedir(dir);
+  sort(files.begin(), files.end());
+
+  for (size_t i = 0; i < files.size(); i++) {
+    MmapLogSegment segment;
+
+    if (!MapSegment(files[i].second, segment) || segment.base_seq < _next) {
+      LOG(WARNING) << "Removing invalid mmap log segment " << files[i].second;
+      if (segment.map) munmap(segment.map, segment.size);
+      unlink(files[i].second.c_str());
+      continue;
+    }
+
+    _segments.push_back(segment);
+    IndexSegment(_segments.back());
+    if (_next < segment.base_seq) _next = segment.base_seq;
+  }
+
+  if (!_segments.empty()) {
+    _head = _segments.front().base_seq;
+    _head_offset = sizeof(MmapLogSegmentHeader);
+  }
+
+  Evict(GetTimestamp());
+
+  LOG(INFO) << "Mmap log " << _config.id << ": Recovered " << _ids.size() <<
+    " events in " << _segments.size() << " segments.";
+}
+
+/**
+ Add a new segment to the end of the log.
+ @param recordSize Size of the record that needs to fit in the segment.
+**/
+bool MmapLog::AddSegment(size_t recordSize) {
+  MmapLogSegment segment;
+  char name[32];
+  size_t size = _segment_size;
+  int fd;
+
+  if (recordSize + sizeof(MmapLogSegmentHeader) > size) {
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    size = ((recordSize + sizeof(MmapLogSegmentHeader) + pagesize - 1) / pagesize) * pagesize;
+  }
+
+  snprintf(name, sizeof(name), "/%016llx.seg", (unsigned long long)_next);
+  const string path = _dir + name;
+
+  // Reuse a recycled segment file if we have one.
+  if (size == _segment_size && rename(_spare.c_str(), path.c_str()) == 0) {
+    fd = open(path.c_str(), O_RDWR);
+  } else {
+    fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  }
+
+  if (fd != -1 && ftruncate(fd, size) == -1) {
+    close(fd);
+    fd = -1;
+  }
+
+  if (fd == -1) {
+    LOG(ERROR) << "Failed to create mmap log segment " << path << ": " << strerror(errno);
+    return false;
+  }
+
+  void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (map == MAP_FAILED) {
+    LOG(ERROR) << "Failed to map mmap log segment " << path << ": " << strerror(errno);
+    unlink(path.c_str());
+    return false;
+  }
+
+  segment.path = path;
+  segment.map = static_cast<char*>(map);
+  segment.size = size;
+  segment.base_seq = _next;
+
+  MmapLogSegmentHeader* hdr = SEGMENT_HEADER(segment);
+  memset(hdr, 0, sizeof(MmapLogSegmentHeader));
+  memcpy(hdr->magic, MMAPLOG_MAGIC, sizeof(hdr->magic));
+  hdr->base_seq = _next;
+  hdr->size = size;
+  hdr->used = sizeof(MmapLogSegmentHeader);
+
+  if (_segments.empty()) {
+    _head = _next;
+    _head_offset = sizeof(MmapLogSegmentHeader);
+  }
+
+  _segments.push_back(segment);
+  return true;
+}
+
+/**
+ Unmap a segment and keep the file around for reuse if it has the default size.
+ @param segment Segment to recycle.
+**/
+void MmapLog::RecycleSegment(MmapLogSegment& segment) {
+  munmap(segment.map, segment.size);
+
+  if (segment.size != _segment_size || rename(segment.path.c_str(), _spare.c_str()) != 0) {
+    unlink(segment.path.c_str());
+  }
+}
+
+/**
+ Drop events outside cacheLength, cacheMaxBytes or cacheMaxAge and recycle segments
+ that no longer hold any events. cacheLength counts the live events in _ids, superseded
+ records are dropped once they reach the head and the whole log is capped at
+ MMAPLOG_MAX_RECORDS_FACTOR times cacheLength records.
+ @param now Current time in microseconds.
+**/
+void MmapLog::Evict(int64_t now) {
+  const uint64_t maxRecords = (uint64_t)_config.cacheLength * MMAPLOG_MAX_RECORDS_FACTOR;
+
+  while (!_segments.empty()) {
+    MmapLogSegment& front = _segments.front();
+
+    if (_head_offset >= SEGMENT_HEADER(front)->used) {
+      if (_segments.size() == 1) break;
+
+      RecycleSegment(front);
+      _segments.pop_front();
+      _head_offset = sizeof(MmapLogSegmentHeader);
+      continue;
+    }
+
+    MmapLogRecordHeader* rec = RECORD_HEADER(front, _head_offset);
+    map<string, uint64_t>::iterator it = _ids.find(string(front.map + _head_offset + sizeof(MmapLogRecordHeader), rec->id_len));
+    bool live = (it != _ids.end() && it->second == rec->seq);
+
+    if (live && _ids.size() <= _config.cacheLength && _next - _head <= maxRecords &&
+        !ExceedsRetention(_config, _bytes, rec->timestamp, now)) break;
+
+    if (live) _ids.erase(it);
+
+    _head_offset += rec->length;
+    _head = rec->seq + 1;
+    _bytes -= rec->data_len;
+  }
+
+  // Recycle the first segment as soon as all its events are evicted.
+  if (_segments.size() > 1 && _head_offset >= SEGMENT_HEADER(_segments.front())->used) {
+    RecycleSegment(_segments.front());
+    _segments.pop_front();
+    _head_offset = sizeof(MmapLogSegmentHeader);
+  }
+}
+
+/**
+ Add event to cache.
+ @param event Event to cache.
+**/
+void MmapLog::CacheEvent(SSEEvent& event) {
+  boost::mutex::scoped_lock lock(_lock);
+  const string id = event.getid();
+  const string data = event.get();
+  const int64_t now = GetTimestamp();
+  size_t recordSize = Align(sizeof(MmapLogRecordHeader) + id.size() + data.size());
+
+  if (_segments.empty() || SEGMENT_HEADER(_segments.back())->used + recordSize > _segments.back().size) {
+    if (!AddSegment(recordSize)) return;
+  }
+
+  MmapLogSegment& segment = _segments.back();
+  MmapLogSegmentHeader* hdr = SEGMENT_HEADER(segment);
+  MmapLogRecordHeader* rec = RECORD_HEADER(segment, hdr->used);
+  char* dst = segment.map + hdr->used + sizeof(MmapLogRecordHeader);
+
+  rec->length = recordSize;
+  rec->id_len = id.size();
+  rec->data_len = data.size();
+  rec->reserved = 0;
+  rec->seq = _next;
+  rec->timestamp = now;
+  rec->event_seq = event.getseq();
+  memcpy(dst, id.data(), id.size());
+  memcpy(dst + id.size(), data.data(), data.size());
+
+  if (hdr->count % MMAPLOG_INDEX_INTERVAL == 0) {
+    segment.index.push_back(make_pair(_next, (size_t)hdr->used));
+  }
+
+  // Commit the record.
+  hdr->used += recordSize;
+  hdr->count++;
+
+  // Updated events are moved to the end of the log, the old record is skipped on reads.
+  _ids[id] = _next;
+  _next++;
+  _bytes += data.size();
+
+  Evict(now);
+}
+
+/**
+ Find the segment and offset of a record.
+ @param seq Sequence number of record to find.
+ @param segmentIdx Set to the index of the segment holding the record.
+ @param offset Set to the offset of the record within the segment.
+**/
+bool MmapLog::Locate(uint64_t seq, size_t& segmentIdx, size_t& offset) {
+  if (seq < _head || seq >= _next || _segments.empty()) return false;
+
+  // Find the last segment starting at or before seq.
+  size_t lo = 0, hi = _segments.size();
+  while (hi - lo > 1) {
+    size_t mid = (lo + hi) / 2;
+    if (_segments[mid].base_seq <= seq) lo = mid; else hi = mid;
+  }
+
+  MmapLogSegment& segment = _segments[lo];
+  vector<pair<uint64_t, size_t> >::iterator it;
+  it = upper_bound(segment.index.begin(), segment.index.end(), make_pair(seq, (size_t)-1));
+  if (it == segment.index.begin()) return false;
+  --it;
+
+  // Walk from the closest sparse index entry.
+  size_t pos = it->second;
+  size_t used = SEGMENT_HEADER(segment)->used;
+
+  while (pos < used) {
+    MmapLogRecordHeader* rec = RECORD_HEADER(segment, pos);
+
+    if (rec->seq == seq) {
+      segmentIdx = lo;
+      offset = pos;
+      return true;
+    }
+
+    if (rec->seq > seq) break;
+    pos += rec->length;
+  }
+
+  return false;
+}
+
+/**
+ Find the first record with a channel sequence number higher than eventSeq.
+ Records are appended in channel sequence order so we binary search the segments
+ and their sparse index before walking the remaining records.
+ @param eventSeq Channel sequence number.
+ @param segmentIdx Set to the index of the segment holding the record.
+ @param offset Set to the offset of the record within the segment.
+**/
+void MmapLog::LocateAfterEventSeq(uint64_t eventSeq, size_t& segmentIdx, size_t& offset) {
+  size_t lo = 0, hi = _segments.size();
+
+  // Find the last segment with a first record at or before eventSeq.
+  while (hi - lo > 1) {
+    size_t mid = (lo + hi) / 2;
+    MmapLogSegment& segment = _segments[mid];
+
+    if (!segment.index.empty() && RECORD_HEADER(segment, segment.index[0].second)->event_seq <= eventSeq) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+
+  MmapLogSegment& segment = _segments[lo];
+  size_t used = SEGMENT_HEADER(segment)->used;
+  size_t pos = (lo == 0) ? _head_offset : sizeof(MmapLogSegmentHeader);
+  size_t ilo = 0, ihi = segment.index.size();
+
+  // Find the last sparse index entry at or before eventSeq.
+  while (ihi - ilo > 1) {
+    size_t mid = (ilo + ihi) / 2;
+    if (RECORD_HEADER(segment, segment.index[mid].second)->event_seq <= eventSeq) ilo = mid; else ihi = mid;
+  }
+
+  if (ilo < segment.index.size() && segment.index[ilo].second > pos) {
+    pos = segment.index[ilo].second;
+  }
+
+  while (pos < used && RECORD_HEADER(segment, pos)->event_seq <= eventSeq) {
+    pos += RECORD_HEADER(segment, pos)->length;
+  }
+
+  segmentIdx = lo;
+  offset = pos;
+}
+
+/**
+ Copy all live events from a position in the log.
+ @param segmentIdx Index of first segment.
+ @param offset Offset of the first record in the segment.
+**/
+deque<string> MmapLog::ReadFrom(size_t segmentIdx, size_t offset) {
+  deque<string> events;
+
+  for (size_t i = segmentIdx; i < _segments.size(); i++) {
+    MmapLogSegment& segment = _segments[i];
+    size_t used = SEGMENT_HEADER(segment)->used;
+
+    for (size_t pos = offset; pos < used; ) {
+      MmapLogRecordHeader* rec = RECORD_HEADER(segment, pos);
+      const char* id = segment.map + pos + sizeof(MmapLogRecordHeader);
+      map<string, uint64_t>::iterator it = _ids.find(string(id, rec->id_len));
+
+      // Skip records that have been superseded by a update.
+      if (rec->seq >= _head && it != _ids.end() && it->second == rec->seq) {
+        events.push_back(string(id + rec->id_len, rec->data_len));
+      }
+
+      pos += rec->length;
+    }
+
+    offset = sizeof(MmapLogSegmentHeader);
+  }
+
+  return events;
+}
+
+/**
+ Get a list of all events since a givend ID.
+ @param lastId ID of first event.
+**/
+deque<string> MmapLog::GetEventsSinceId(string lastId) {
+  boost::mutex::scoped_lock lock(_lock);
+  map<string, uint64_t>::iterator it;
+  size_t segmentIdx, offset;
+
+  Evict(GetTimestamp());
+  it = _ids.find(lastId);
+
+  if (it == _ids.end() || !Locate(it->second, segmentIdx, offset)) {
+    return deque<string>();
+  }
+
+  return ReadFrom(segmentIdx, offset);
+}
+
+/**
+ Get a list of all events with a channel sequence number higher than seq.
+ @param seq Sequence number of the last event seen by the client.
+**/
+deque<string> MmapLog::GetEventsAfterSeq(uint64_t seq) {
+  boost::mutex::scoped_lock lock(_lock);
+  size_t segmentIdx, offset;
+
+  Evict(GetTimestamp());
+  if (_segments.empty()) return deque<string>();
+
+  LocateAfterEventSeq(seq, segmentIdx, offset);
+
+  return ReadFrom(segmentIdx, offset);
+}
+
+/**
+ Get a list of all events stored in the cache.
+**/
+deque<string> MmapLog::GetAllEvents() {
+  boost::mutex::scoped_lock lock(_lock);
+
+  Evict(GetTimestamp());
+  if (_segments.empty()) return deque<string>();
+
+  return ReadFrom(0, _head_offset);
+}
+
+/**
+ Get number of events currently stored in the cache, not counting superseded records.
+**/
+size_t MmapLog::GetSizeOfCachedEvents() {
+  boost::mutex::scoped_lock lock(_lock);
+  return _ids.size();
+}
+
+/**
+ Get the total size of the events currently stored in the cache.
+**/
+size_t MmapLog::GetSizeOfCachedBytes() {
+  boost::mutex::scoped_lock lock(_lock);
+  return _bytes;
+}
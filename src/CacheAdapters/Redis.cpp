@@ -4,19 +4,89 @@
 #include "SSEEvent.h"
 #include <string>
 #include <vector>
+#include <list>
+#include <stdlib.h>
 #include <iostream>
 #include <boost/asio/io_service.hpp>
 #include <boost/asio/ip/address.hpp>
 #include <boost/foreach.hpp>
+#include <boost/lexical_cast.hpp>
 
 using namespace std;
-extern int stop;
+
+/*
+ Events are stored in a hash keyed by event id. The insertion order is kept in a
+ sorted set scored by the channel sequence number or the time the event was first
+ cached in microseconds and the total size of the cached events in a counter.
+ Sequence numbers follow the clock so both can be used for cacheMaxAge. Both scripts run atomically on the
+ server so several instances can share the same cache.
+ With keep set a event already cached under the same id is left as it is.
+
+ KEYS: hash, order, bytes
+ ARGV: id, data, now, cacheLength, cacheMaxBytes, cacheMaxAge, score, keep
+*/
+static const char* cache_script =
+  "local hash, order, bytes = KEYS[1], KEYS[2], KEYS[3]\n"
+  "local now = tonumber(ARGV[3])\n"
+  "local maxlen, maxbytes, maxage = tonumber(ARGV[4]), tonumber(ARGV[5]), tonumber(ARGV[6])\n"
+  "if redis.call('EXISTS', order) == 0 then\n"
+  "  local all = redis.call('HGETALL', hash)\n"
+  "  local size = 0\n"
+  "  for i = 1, #all, 2 do\n"
+  "    redis.call('ZADD', order, ARGV[7], all[i])\n"
+  "    size = size + string.len(all[i + 1])\n"
+  "  end\n"
+  "  redis.call('SET', bytes, size)\n"
+  "end\n"
+  "local old = redis.call('HGET', hash, ARGV[1])\n"
+  "if old and ARGV[8] == '1' then return end\n"
+  "if old then\n"
+  "  redis.call('INCRBY', bytes, string.len(ARGV[2]) - string.len(old))\n"
+  "else\n"
+  "  redis.call('ZADD', order, ARGV[7], ARGV[1])\n"
+  "  redis.call('INCRBY', bytes, string.len(ARGV[2]))\n"
+  "end\n"
+  "redis.call('HSET', hash, ARGV[1], ARGV[2])\n"
+  "while true do\n"
+  "  local oldest = redis.call('ZRANGE', order, 0, 0, 'WITHSCORES')\n"
+  "  if #oldest == 0 then break end\n"
+  "  local size = tonumber(redis.call('GET', bytes) or '0')\n"
+  "  if redis.call('ZCARD', order) <= maxlen and (maxbytes == 0 or size <= maxbytes) and\n"
+  "     (maxage == 0 or tonumber(oldest[2]) + maxage >= now) then break end\n"
+  "  local val = redis.call('HGET', hash, oldest[1])\n"
+  "  if val then redis.call('DECRBY', bytes, string.len(val)) end\n"
+  "  redis.call('HDEL', hash, oldest[1])\n"
+  "  redis.call('ZREM', order, oldest[1])\n"
+  "end\n";
+
+/*
+ KEYS: hash, order
+ ARGV: first id or empty to use the minimum score, minimum score
+*/
+static const char* read_script =
+  "local score = ARGV[2]\n"
+  "if ARGV[1] ~= '' then\n"
+  "  score = redis.call('ZSCORE', KEYS[2], ARGV[1])\n"
+  "  if not score then return {} end\n"
+  "  if ARGV[2] ~= '-inf' and tonumber(score) < tonumber(ARGV[2]) then return {} end\n"
+  "end\n"
+  "local ids = redis.call('ZRANGEBYSCORE', KEYS[2], score, '+inf')\n"
+  "local events = {}\n"
+  "for i = 1, #ids, 1000 do\n"
+  "  local vals = redis.call('HMGET', KEYS[1], unpack(ids, i, math.min(i + 999, #ids)))\n"
+  "  for j = 1, #vals do\n"
+  "    if vals[j] then events[#events + 1] = vals[j] end\n"
+  "  end\n"
+  "end\n"
+  "return events\n";
 
 
 Redis::Redis(const string key, const ChannelConfig& config) : _config(config) {
   _host = Lookup(_config.server->GetValue("redis.host"));
   _port = _config.server->GetValueInt("redis.port");
   _key = _config.server->GetValue("redis.prefix") + "_" + key;
+  _order_key = _key + ":order";
+  _bytes_key = _key + ":bytes";
 
 
   if (_host.empty()) {
@@ -46,73 +116,142 @@ void Redis::CacheEvent(SSEEvent& event) {
   RedisValue result;
   boost::asio::io_service ioService;
   RedisSyncClient client(ioService);
+  list<string> args;
+  const int64_t now = GetTimestamp();
+  // Every worker numbers the events it broadcasts itself, so with sequence ids the event is
+  // stored under the id it was published with and the first worker to cache it wins.
+  const bool byPubId = event.getseq() && !event.getpubid().empty();
 
   if (!InitClient(client)) {
     return;
   }
 
-  try {
-    result = client.command("HSET", _key, event.getid(), event.get());
-    if (result.isError()) {
-      LOG(ERROR) << "SET error: " << result.toString();
-    }
+  args.push_back("3");
+  args.push_back(_key);
+  args.push_back(_order_key);
+  args.push_back(_bytes_key);
+  args.push_back(byPubId ? event.getpubid() : event.getid());
+  args.push_back(event.get());
+  args.push_back(boost::lexical_cast<string>(now));
+  args.push_back(boost::lexical_cast<string>(_config.cacheLength));
+  args.push_back(boost::lexical_cast<string>(_config.cacheMaxBytes));
+  args.push_back(boost::lexical_cast<string>((int64_t)_config.cacheMaxAge * 1000000));
+  args.push_back(boost::lexical_cast<string>(event.getseq() ? (int64_t)event.getseq() : now));
+  args.push_back(byPubId ? "1" : "0");
 
-    result = client.command("HLEN", _key);
+  try {
+    result = EvalScript(client, cache_script, _cache_sha, args);
     if (result.isError()) {
-      LOG(ERROR) << "HLEN error" << result.toString();
-    }
-    if (result.isOk()) {
-      if ((size_t)result.toInt() > _config.cacheLength) {
-        result = client.command("HKEYS", _key);
-        if (result.isError()) {
-          LOG(ERROR) << "HKEYS error: " << result.toString();
-        }
-        if (result.isOk()) {
-          client.command("HDEL", _key, result.toArray().front().toString());
-        }
-      }
+      LOG(ERROR) << "EVALSHA error: " << result.toString();
     }
   } catch (const runtime_error& error) {
     LOG(ERROR) << "Redis::CacheEvent: " << error.what();
   }
 }
 
-deque<string> Redis::GetEventsSinceId(string lastId) {
+/**
+ Load a script into the script cache of the server.
+ @param script Lua source.
+ @param sha Set to the SHA1 digest to call the script by.
+ @return false if the server did not accept the script.
+**/
+bool Redis::LoadScript(RedisSyncClient& client, const char* script, string& sha) {
+  list<string> args;
+
+  args.push_back("LOAD");
+  args.push_back(script);
+
+  RedisValue result = client.command("SCRIPT", args);
+  if (!result.isOk() || !result.isString()) {
+    LOG(ERROR) << "SCRIPT LOAD error: " << result.toString();
+    return false;
+  }
+
+  boost::mutex::scoped_lock lock(_sha_lock);
+  sha = result.toString();
+
+  return true;
+}
+
+/**
+ Run a script by its digest so the source is only sent when the server does not have it yet.
+ The script is loaded on first use and again if the server answers NOSCRIPT, for example after a restart.
+ @param script Lua source.
+ @param sha Digest of the script, empty until it has been loaded.
+ @param args Number of keys followed by the keys and arguments.
+**/
+RedisValue Redis::EvalScript(RedisSyncClient& client, const char* script, string& sha, const list<string>& args) {
+  boost::mutex::scoped_lock lock(_sha_lock);
+  string digest = sha;
+  lock.unlock();
+
+  if (digest.empty()) {
+    if (!LoadScript(client, script, sha)) return RedisValue();
+
+    lock.lock();
+    digest = sha;
+    lock.unlock();
+  }
+
+  list<string> evalArgs(args);
+  evalArgs.push_front(digest);
+
+  RedisValue result = client.command("EVALSHA", evalArgs);
+  if (!result.isError() || result.toString().compare(0, 8, "NOSCRIPT") != 0) return result;
+
+  if (!LoadScript(client, script, sha)) return result;
+
+  return client.command("EVALSHA", evalArgs);
+}
+
+/**
+ Fetch cached events in insertion order.
+ @param lastId ID of first event, empty to get all events.
+ @param afterScore Only return events with a score higher than this if not zero.
+**/
+deque<string> Redis::GetEvents(const string& lastId, int64_t afterScore) {
   deque<string> events;
   RedisValue result;
   boost::asio::io_service ioService;
   RedisSyncClient client(ioService);
+  list<string> args;
+  string minScore = "-inf";
 
   if (!InitClient(client)) {
     return events;
   }
 
+  if (_config.cacheMaxAge > 0) {
+    int64_t oldest = GetTimestamp() - (int64_t)_config.cacheMaxAge * 1000000;
+    if (oldest > afterScore) minScore = boost::lexical_cast<string>(oldest);
+  }
+
+  if (afterScore > 0 && minScore == "-inf") {
+    minScore = "(" + boost::lexical_cast<string>(afterScore);
+  }
+
+  args.push_back("2");
+  args.push_back(_key);
+  args.push_back(_order_key);
+  args.push_back(lastId);
+  args.push_back(minScore);
+
   try {
-    result = client.command("HGETALL", _key);
+    result = EvalScript(client, read_script, _read_sha, args);
   } catch (const runtime_error& error) {
-    LOG(ERROR) << "Redis::GetEventsSinceId: " << error.what();
+    LOG(ERROR) << "Redis::GetEvents: " << error.what();
   }
 
   if (result.isError()) {
-    LOG(ERROR) << "GET error: " << result.toString();
+    LOG(ERROR) << "EVALSHA error: " << result.toString();
   }
 
   if (result.isOk() && result.isArray()) {
     std::vector<RedisValue> resultArray = result.toArray();
 
-    bool isId = true;
-    bool ignoreEvent = true;
     BOOST_FOREACH(const RedisValue& value, resultArray) {
       if (value.isString() && value.toString().length() > 0) {
-        if (isId) {
-          if (value.toString().compare(lastId) == 0) {
-            ignoreEvent = false;
-          }
-        } else if (!ignoreEvent){
-          events.push_back(value.toString());
-        }
-
-        isId = !isId;
+        events.push_back(value.toString());
       }
     }
   }
@@ -120,46 +259,54 @@ deque<string> Redis::GetEventsSinceId(string lastId) {
   return events;
 }
 
+deque<string> Redis::GetEventsSinceId(string lastId) {
+  if (lastId.empty()) return deque<string>();
+  return GetEvents(lastId, 0);
+}
+
+/**
+ Get a list of all events with a channel sequence number higher than seq.
+ @param seq Sequence number of the last event seen by the client.
+**/
+deque<string> Redis::GetEventsAfterSeq(uint64_t seq) {
+  return GetEvents("", seq);
+}
+
 deque<string> Redis::GetAllEvents() {
+  return GetEvents("", 0);
+}
+
+size_t Redis::GetSizeOfCachedEvents() {
+  size_t size = 0;
   RedisValue result;
-  deque<string> events;
   boost::asio::io_service ioService;
   RedisSyncClient client(ioService);
 
   if (!InitClient(client)) {
-    return events;
+    return size;
   }
 
   try {
-    result = client.command("HGETALL", _key);
+    result = client.command("ZCARD", _order_key);
   } catch (const runtime_error& error) {
-    LOG(ERROR) << "Redis::GetEventsSinceId: " << error.what();
+    LOG(ERROR) << "Redis::GetSizeOfCachedEvents: " << error.what();
   }
 
   if (result.isError()) {
-    LOG(ERROR) << "GET error: " << result.toString();
+    LOG(ERROR) << "ZCARD error: " << result.toString();
   }
 
-  if (result.isOk() && result.isArray()) {
-    std::vector<RedisValue> resultArray = result.toArray();
-
-    bool isId = true;
-    BOOST_FOREACH(const RedisValue& value, resultArray) {
-      if (value.isString() && value.toString().length() > 0) {
-        if (!isId) {
-          string data = value.toString();
-          events.push_back(data);
-        }
-
-        isId = !isId;
-      }
-    }
+  if (result.isOk()) {
+    size = result.toInt();
   }
 
-  return events;
+  return size;
 }
 
-size_t Redis::GetSizeOfCachedEvents() {
+/**
+ Get the total size of the events currently stored in the cache.
+**/
+size_t Redis::GetSizeOfCachedBytes() {
   size_t size = 0;
   RedisValue result;
   boost::asio::io_service ioService;
@@ -170,17 +317,17 @@ size_t Redis::GetSizeOfCachedEvents() {
   }
 
   try {
-    result = client.command("HLEN", _key);
+    result = client.command("GET", _bytes_key);
   } catch (const runtime_error& error) {
-    LOG(ERROR) << "Redis::GetEventsSinceId: " << error.what();
+    LOG(ERROR) << "Redis::GetSizeOfCachedBytes: " << error.what();
   }
 
   if (result.isError()) {
     LOG(ERROR) << "GET error: " << result.toString();
   }
 
-  if (result.isOk()) {
-    size = result.toInt();
+  if (result.isOk() && result.isString()) {
+    size = strtoull(result.toString().c_str(), NULL, 10);
   }
 
   return size;
@@ -0,0 +1,96 @@
+#include <string.h>
+#include <endian.h>
+#include <arpa/inet.h>
+#include "EventCapture.h"
+
+static char* PutU16(char* p, uint16_t v) {
+  v = htons(v);
+  memcpy(p, &v, sizeof(v));
+  return p + sizeof(v);
+}
+
+static char* PutU32(char* p, uint32_t v) {
+  v = htonl(v);
+  memcpy(p, &v, sizeof(v));
+  return p + sizeof(v);
+}
+
+static char* PutU64(char* p, uint64_t v) {
+  v = htobe64(v);
+  memcpy(p, &v, sizeof(v));
+  return p + sizeof(v);
+}
+
+/**
+ Size of a record including its length prefix.
+*/
+size_t CaptureRecordSize(const string& channel, const string& event) {
+  return sizeof(uint32_t) + CAPTURE_RECORD_HEADER_LEN + channel.size() + event.size();
+}
+
+/**
+ Write a record to memory.
+ @param p Where to write, must have room for CaptureRecordSize() bytes.
+ @param timestamp Time the event was received in microseconds.
+ @param channel Channel the event was published to.
+ @param event Compiled event.
+ @return Pointer past the record.
+*/
+char* WriteCaptureRecord(char* p, uint64_t timestamp, const string& channel, const string& event) {
+  p = PutU32(p, CAPTURE_RECORD_HEADER_LEN + channel.size() + event.size());
+  p = PutU64(p, timestamp);
+  p = PutU16(p, channel.size());
+  memcpy(p, channel.data(), channel.size());
+  p += channel.size();
+  memcpy(p, event.data(), event.size());
+
+  return p + event.size();
+}
+
+/**
+ Append a record to a capture buffer.
+*/
+void AppendCaptureRecord(string& buf, uint64_t timestamp, const string& channel, const string& event) {
+  size_t used = buf.size();
+
+  buf.resize(used + CaptureRecordSize(channel, event));
+  WriteCaptureRecord(&buf[used], timestamp, channel, event);
+}
+
+/**
+ Read the record at the start of a buffer.
+ @param buf Buffer holding records.
+ @param len Length of buffer.
+ @param used Set to the length of the record including its length prefix.
+ @param record Filled with the record.
+ @return CAPTURE_RECORD if a record was read, CAPTURE_INCOMPLETE if more data is needed
+   or CAPTURE_INVALID if the buffer does not start with a valid record.
+*/
+CaptureReadStatus ReadCaptureRecord(const char* buf, size_t len, size_t& used, CaptureRecord& record) {
+  uint32_t recordLen;
+  uint64_t timestamp;
+  uint16_t channelLen;
+
+  if (len < sizeof(recordLen)) return CAPTURE_INCOMPLETE;
+
+  memcpy(&recordLen, buf, sizeof(recordLen));
+  recordLen = ntohl(recordLen);
+
+  if (recordLen < CAPTURE_RECORD_HEADER_LEN || recordLen > CAPTURE_MAX_RECORD) return CAPTURE_INVALID;
+  if (len - sizeof(recordLen) < recordLen) return CAPTURE_INCOMPLETE;
+
+  const char* p = buf + sizeof(recordLen);
+  memcpy(&timestamp, p, sizeof(timestamp));
+  memcpy(&channelLen, p + sizeof(timestamp), sizeof(channelLen));
+  channelLen = ntohs(channelLen);
+
+  if (CAPTURE_RECORD_HEADER_LEN + (size_t)channelLen > recordLen) return CAPTURE_INVALID;
+
+  p += CAPTURE_RECORD_HEADER_LEN;
+  record.timestamp = be64toh(timestamp);
+  record.channel.assign(p, channelLen);
+  record.event.assign(p + channelLen, recordLen - CAPTURE_RECORD_HEADER_LEN - channelLen);
+  used = sizeof(recordLen) + recordLen;
+
+  return CAPTURE_RECORD;
+}
@@ -0,0 +1,209 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <boost/bind.hpp>
+#include "Common.h"
+#include "SSEEvent.h"
+#include "EventCapture.h"
+#include "EventRecorder.h"
+
+/*
+ Current time in microseconds.
+*/
+static uint64_t NowMicros() {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/*
+ Round up to a multiple of 8 so slot headers stay aligned.
+*/
+static size_t Align8(size_t len) {
+  return (len + 7) & ~(size_t)7;
+}
+
+EventRecorder::EventRecorder() {
+  _fd = -1;
+  _buf = NULL;
+  _capacity = 0;
+  _head = 0;
+  _tail = 0;
+  _stopping = false;
+  _recorded = 0;
+  _dropped = 0;
+  _bytes = 0;
+}
+
+EventRecorder::~EventRecorder() {
+  Stop();
+  free(_buf);
+  if (_fd != -1) close(_fd);
+}
+
+/**
+ Open the capture file and start the writer thread.
+ @param path File to append to, the capture header is written if it is empty.
+ @param capacity Size of the buffer between publishers and the writer in bytes.
+ @return false if the file could not be opened.
+*/
+bool EventRecorder::Start(const string& path, size_t capacity) {
+  struct stat st;
+
+  _path = path;
+  _fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+
+  if (_fd == -1) {
+    LOG(ERROR) << "Could not open capture file " << path << ": " << strerror(errno);
+    return false;
+  }
+
+  if (fstat(_fd, &st) == 0 && st.st_size == 0) {
+    Write(string(CAPTURE_MAGIC, CAPTURE_MAGIC_LEN));
+  }
+
+  // Slots are zeroed again by the writer once consumed, a zero length means not written yet.
+  _capacity = Align8(capacity);
+  _buf = static_cast<char*>(calloc(_capacity, 1));
+  LOG_IF(FATAL, _buf == NULL) << "Could not allocate " << _capacity << " bytes for the event recorder.";
+
+  _writer = boost::thread(boost::bind(&EventRecorder::WriterMain, this));
+  LOG(INFO) << "Recording events to " << path << ".";
+
+  return true;
+}
+
+/**
+ Write out all recorded events and stop the writer thread.
+ Must only be called once nothing calls Record() anymore.
+*/
+void EventRecorder::Stop() {
+  if (!_writer.joinable()) return;
+
+  _stopping = true;
+  _writer.join();
+}
+
+/**
+ Add a event to the capture, called from any thread before the event is broadcast.
+ @param channel Channel the event is published to.
+ @param event Event as it was received.
+*/
+void EventRecorder::Record(const string& channel, SSEEvent& event) {
+  const string data = event.get();
+  uint32_t len = CaptureRecordSize(channel, data);
+  uint64_t need = RECORDER_SLOT_HEADER + Align8(len);
+  uint64_t pos, skip;
+
+  if (need > _capacity / 4) {
+    __sync_fetch_and_add(&_dropped, 1);
+    return;
+  }
+
+  do {
+    pos = _head;
+    size_t offset = pos % _capacity;
+    skip = (offset + need > _capacity) ? _capacity - offset : 0;
+
+    if (pos + skip + need - _tail > _capacity) {
+      __sync_fetch_and_add(&_dropped, 1);
+      return;
+    }
+  } while (!__sync_bool_compare_and_swap(&_head, pos, pos + skip + need));
+
+  char* slot = _buf + pos % _capacity;
+
+  if (skip > 0) {
+    *reinterpret_cast<volatile uint32_t*>(slot) = RECORDER_WRAP;
+    slot = _buf;
+  }
+
+  WriteCaptureRecord(slot + RECORDER_SLOT_HEADER, NowMicros(), channel, data);
+
+  // Publish the record to the writer by setting its length last.
+  __sync_synchronize();
+  *reinterpret_cast<volatile uint32_t*>(slot) = len;
+
+  __sync_fetch_and_add(&_recorded, 1);
+}
+
+/**
+ Writer thread, moves completed records from the buffer to the file.
+*/
+void EventRecorder::WriterMain() {
+  string out;
+
+  while (true) {
+    bool stopping = _stopping;
+
+    Drain(out);
+
+    if (!out.empty()) {
+      Write(out);
+      out.clear();
+      continue;
+    }
+
+    if (stopping) break;
+    usleep(RECORDER_FLUSH_INTERVAL * 1000);
+  }
+}
+
+/**
+ Copy completed records in order until one is still being written or out is full.
+ @param out Buffer to append the records to.
+*/
+void EventRecorder::Drain(string& out) {
+  while (out.size() < RECORDER_WRITE_SIZE) {
+    uint64_t tail = _tail;
+
+    if (tail == _head) break;
+
+    size_t offset = tail % _capacity;
+    uint32_t len = *reinterpret_cast<volatile uint32_t*>(_buf + offset);
+
+    if (len == 0) break;
+    __sync_synchronize();
+
+    size_t used;
+    if (len == RECORDER_WRAP) {
+      used = _capacity - offset;
+    } else {
+      out.append(_buf + offset + RECORDER_SLOT_HEADER, len);
+      used = RECORDER_SLOT_HEADER + Align8(len);
+    }
+
+    memset(_buf + offset, 0, used);
+    __sync_synchronize();
+    _tail = tail + used;
+  }
+}
+
+void EventRecorder::Write(const string& out) {
+  size_t pos = 0;
+
+  while (pos < out.size()) {
+    ssize_t len = write(_fd, out.data() + pos, out.size() - pos);
+
+    if (len == -1) {
+      if (errno == EINTR) continue;
+      LOG(ERROR) << "Error writing capture file " << _path << ": " << strerror(errno);
+      return;
+    }
+
+    pos += len;
+  }
+
+  _bytes += out.size();
+}
+
+void EventRecorder::GetStats(boost::property_tree::ptree& pt) {
+  pt.put("recorder.recorded", _recorded);
+  pt.put("recorder.dropped", _dropped);
+  pt.put("recorder.bytes", _bytes);
+}
@@ -1,31 +1,69 @@
 #include "Common.h"
 #include <string.h>
 #include <iostream>
-#include <boost/algorithm/string.hpp>
+#include <vector>
+#include <algorithm>
 #include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
 #include "../lib/picohttpparser/picohttpparser.h"
 #include "Common.h"
 #include "HTTPRequest.h"
 
+static boost::mutex buffer_pool_lock;
+static vector<HTTPRequestBuffer*> buffer_pool;
+
+/*
+ Get a request buffer from the pool or allocate a new one if the pool is empty.
+*/
+static HTTPRequestBuffer* AcquireBuffer() {
+  boost::mutex::scoped_lock lock(buffer_pool_lock);
+
+  if (buffer_pool.empty()) return new HTTPRequestBuffer;
+
+  HTTPRequestBuffer* buf = buffer_pool.back();
+  buffer_pool.pop_back();
+  return buf;
+}
+
+/*
+ Return a request buffer to the pool.
+*/
+static void ReleaseBuffer(HTTPRequestBuffer* buf) {
+  boost::mutex::scoped_lock lock(buffer_pool_lock);
+
+  if (buffer_pool.size() >= HTTPREQ_POOL_MAX) {
+    delete buf;
+    return;
+  }
+
+  buffer_pool.push_back(buf);
+}
+
 /**
   Constructor.
 **/
 HTTPRequest::HTTPRequest() {
+  httpReq_buf = NULL;
   httpReq_bytesRead = 0;
   httpReq_bytesReadPrev = 0;
   httpReq_post_expected_size = 0;
   httpReq_post_bytesRead = 0;
+  httpReq_pipelined_offset = 0;
   httpReq_isComplete = false;
   httpReq_isPost = false;
   post_data = "";
   error_message = "";
   b_success = false;
+  num_headers = 0;
+  num_query_parameters = 0;
 }
 
 /**
   Destructor.
 **/
-HTTPRequest::~HTTPRequest() {}
+HTTPRequest::~HTTPRequest() {
+  if (httpReq_buf) ReleaseBuffer(httpReq_buf);
+}
 
 /**
   Parse the request.
@@ -36,22 +74,12 @@ HttpReqStatus HTTPRequest::Parse(const char *data, int len) {
   int pret;
 
   if (httpReq_isPost) {
-    httpReq_post_bytesRead += len;
-
-    if (httpReq_post_bytesRead > HTTP_POST_MAX) {
-      DLOG(ERROR) << "HTTP_REQ_POST_TOO_LARGE " << "POST data is bigger than " << HTTP_POST_MAX;
-      error_message = "HTTP_REQ_POST_TOO_LARGE: POST data is to large.";
-      post_data.clear();
-      return HTTP_REQ_POST_TOO_LARGE;
-    }
+    size_t avail;
+    char* dst = GetPostDataBuffer(avail);
+    size_t n = ((size_t)len < avail) ? len : avail;
 
-    post_data.append(data);
-
-    if (httpReq_post_bytesRead < httpReq_post_expected_size) {
-      return HTTP_REQ_POST_INCOMPLETE;
-    }
-
-    return HTTP_REQ_POST_OK;
+    memcpy(dst, data, n);
+    return PostDataRead(n);
   }
 
   if (httpReq_isComplete) return HTTP_REQ_OK;
@@ -63,13 +91,15 @@ HttpReqStatus HTTPRequest::Parse(const char *data, int len) {
     return HTTP_REQ_TO_BIG;
   }
 
+  if (httpReq_buf == NULL) httpReq_buf = AcquireBuffer();
+
+  memcpy(httpReq_buf->data + httpReq_bytesRead, data, len);
   httpReq_bytesRead += len;
-  httpReq_buf.append(data, len);
 
-  phr_num_headers = sizeof(phr_headers) / sizeof(phr_headers[0]);
+  phr_num_headers = HTTP_REQUEST_MAX_HEADERS;
 
-  pret = phr_parse_request(httpReq_buf.c_str(), httpReq_bytesRead, &phr_method, &phr_method_len, &phr_path,
-      &phr_path_len, &phr_minor_version, phr_headers, &phr_num_headers, httpReq_bytesReadPrev);
+  pret = phr_parse_request(httpReq_buf->data, httpReq_bytesRead, &phr_method, &phr_method_len, &phr_path,
+      &phr_path_len, &phr_minor_version, httpReq_buf->headers, &phr_num_headers, httpReq_bytesReadPrev);
 
   // Parse error.
   if (pret == -1) {
@@ -84,39 +114,30 @@ HttpReqStatus HTTPRequest::Parse(const char *data, int len) {
     return HTTP_REQ_INCOMPLETE;
   }
 
-  if (phr_method_len > 0)
-    method.insert(0, phr_method, phr_method_len);
+  // Method, path, headers and query parameters all reference the request buffer.
+  method = StringRef(phr_method, phr_method_len);
 
   if (phr_path_len > 0) {
-    string rawPath;
-    rawPath.insert(0, phr_path, phr_path_len);
+    StringRef rawPath(phr_path, phr_path_len);
 
-    size_t qsPos = rawPath.find_first_of('?', 0);
-    if (qsPos != string::npos) {
-      string qStr;
-      qStr = rawPath.substr(qsPos+1, string::npos);
+    size_t qsPos = rawPath.find('?');
+    if (qsPos != StringRef::npos) {
       path = rawPath.substr(0, qsPos);
-      ParseQueryString(qStr);
+      ParseQueryString(rawPath.substr(qsPos + 1));
     } else {
-      path = rawPath.substr(0, rawPath.find_last_of(' ', 0));
+      path = rawPath;
     }
   }
 
-  for (int i = 0; i < (int)phr_num_headers; i++) {
-    string name, value;
-    name.insert(0, phr_headers[i].name, phr_headers[i].name_len);
-    value.insert(0, phr_headers[i].value, phr_headers[i].value_len);
-    boost::to_lower(name);
-    headers[name] = value;
-  }
+  num_headers = phr_num_headers;
 
-  if (GetMethod().compare("POST") == 0) {
+  if (GetMethod() == "POST") {
     if (GetHeader("Content-Length").empty()) {
       error_message = "HTTP_REQ_POST_INVALID_LENGTH: No Content-Length header set.";
       return HTTP_REQ_POST_INVALID_LENGTH;
     } else {
       try  {
-        httpReq_post_expected_size = boost::lexical_cast<int>(GetHeader("Content-Length"));
+        httpReq_post_expected_size = boost::lexical_cast<int>(GetHeader("Content-Length").str());
       } catch(...) {
         error_message = "HTTP_REQ_POST_INVALID_LENGTH: Invalid format.";
         return HTTP_REQ_POST_INVALID_LENGTH;
@@ -128,20 +149,35 @@ HttpReqStatus HTTPRequest::Parse(const char *data, int len) {
       return HTTP_REQ_POST_INVALID_LENGTH;
     }
 
+    if (httpReq_post_expected_size > HTTP_POST_MAX) {
+      DLOG(ERROR) << "HTTP_REQ_POST_TOO_LARGE " << "POST data is bigger than " << HTTP_POST_MAX;
+      error_message = "HTTP_REQ_POST_TOO_LARGE: POST data is to large.";
+      return HTTP_REQ_POST_TOO_LARGE;
+    }
+
+    // Allocate the whole body up front so it can be read straight into place.
+    post_data.resize(httpReq_post_expected_size);
     httpReq_isPost = true;
 
-    // If we have post data in the initial request run Parse on it to take correct action.
-    if (len > pret) {
-      string tmp;
-      tmp.insert(0, data, pret, len-pret);
-      return Parse(tmp.c_str(), tmp.length());
+    // Copy any body data we got together with the headers.
+    if (httpReq_bytesRead > pret) {
+      size_t avail;
+      char* dst = GetPostDataBuffer(avail);
+      size_t n = min((size_t)(httpReq_bytesRead - pret), avail);
+
+      memcpy(dst, httpReq_buf->data + pret, n);
+
+      // Anything after the body is the start of the next pipelined request.
+      httpReq_pipelined_offset = pret + n;
+
+      return PostDataRead(n);
     }
 
     return HTTP_REQ_POST_START;
  }
 
   httpReq_isComplete = true;
-  httpReq_buf[httpReq_bytesRead] = '\0';
+  httpReq_buf->data[httpReq_bytesRead] = '\0';
   DLOG(INFO) << "HTTP_REQ_OK"; 
 
   return HTTP_REQ_OK;
@@ -150,33 +186,32 @@ HttpReqStatus HTTPRequest::Parse(const char *data, int len) {
 /**
   Get the HTTP request path.
 **/
-const string& HTTPRequest::GetPath() {
+StringRef HTTPRequest::GetPath() {
   return path;
 }
 
 /**
   Get the HTTP request method.
 **/
-const string& HTTPRequest::GetMethod() {
+StringRef HTTPRequest::GetMethod() {
   return method;
 }
 
 /**
   Get a spesific header.
+  Header names are compared case-insensitive, the last occurrence wins.
   @param header Header to get.
 **/
-const string HTTPRequest::GetHeader(string header) {
-  boost::to_lower(header);
+StringRef HTTPRequest::GetHeader(const StringRef& header) {
+  for (size_t i = num_headers; i > 0; i--) {
+    const struct phr_header& h = httpReq_buf->headers[i - 1];
 
-  if (headers.find(header) != headers.end()) {
-    return headers[header];
+    if (h.name != NULL && StringRef(h.name, h.name_len).iequals(header)) {
+      return StringRef(h.value, h.value_len);
+    }
   }
 
-  return "";
-}
-
-const map<string, string>& HTTPRequest::GetHeaders() {
-  return headers;
+  return StringRef();
 }
 
 /**
@@ -190,52 +225,101 @@ bool HTTPRequest::Success() {
   Extracts query parameters from a string if they exist.
   @param buf The string to parse.
 **/
-size_t HTTPRequest::ParseQueryString(const std::string& buf) {
-  size_t prevpos = 0, eqlpos = 0;
+size_t HTTPRequest::ParseQueryString(const StringRef& buf) {
+  size_t pos = 0;
 
-  while((eqlpos = buf.find("=", prevpos)) != string::npos) {
-    string param, val;
-    size_t len;
+  while (pos < buf.size() && num_query_parameters < HTTP_REQUEST_MAX_PARAMS) {
+    size_t end = buf.find('&', pos);
+    if (end == StringRef::npos) end = buf.size();
 
-    len = buf.find("&", eqlpos);
+    StringRef kv = buf.substr(pos, end - pos);
+    size_t eqlpos = kv.find('=');
 
-    if (len != string::npos) len = (len - eqlpos);
-    else len = (buf.size() - eqlpos);
-
-    param = buf.substr(prevpos, (eqlpos - prevpos));
-
-    eqlpos++;
-    val = buf.substr(eqlpos, len-1);
-    prevpos = eqlpos+len;
-
-    if (!param.empty() && !val.empty()) {
-      boost::to_lower(param);
-      qsmap[param] = val;
+    if (eqlpos != StringRef::npos && eqlpos > 0 && eqlpos + 1 < kv.size()) {
+      HTTPQueryParam& param = httpReq_buf->params[num_query_parameters++];
+      param.name = kv.substr(0, eqlpos);
+      param.value = kv.substr(eqlpos + 1);
     }
+
+    pos = end + 1;
   }
 
-  return qsmap.size();
+  return num_query_parameters;
 }
 
 /**
   Get a spesific query string parameter.
+  Parameter names are compared case-insensitive, the last occurrence wins.
   @param param Parameter to get.
 **/
-const string HTTPRequest::GetQueryString(string param) {
-  boost::to_lower(param);
-
-  if (qsmap.find(param) != qsmap.end()) {
-    return qsmap[param];
+StringRef HTTPRequest::GetQueryString(const StringRef& param) {
+  for (size_t i = num_query_parameters; i > 0; i--) {
+    const HTTPQueryParam& p = httpReq_buf->params[i - 1];
+    if (p.name.iequals(param)) return p.value;
   }
 
-  return "";
+  return StringRef();
 }
 
 /**
   Returns number of query strings in the request.
 **/
 size_t HTTPRequest::NumQueryString() {
-  return qsmap.size();
+  return num_query_parameters;
+}
+
+/**
+  Returns true if the client wants to keep the connection open after this request.
+**/
+bool HTTPRequest::IsKeepAlive() {
+  StringRef connection = GetHeader("Connection");
+
+  if (phr_minor_version >= 1) return !connection.iequals("close");
+  return connection.iequals("keep-alive");
+}
+
+/**
+  Copy data received after the end of this request.
+  @param dst Buffer to copy the data to.
+  @param len Size of dst.
+**/
+size_t HTTPRequest::GetPipelinedData(char* dst, size_t len) {
+  if (httpReq_pipelined_offset < 1 || httpReq_pipelined_offset >= httpReq_bytesRead) return 0;
+
+  size_t n = min((size_t)(httpReq_bytesRead - httpReq_pipelined_offset), len);
+  memcpy(dst, httpReq_buf->data + httpReq_pipelined_offset, n);
+
+  return n;
+}
+
+/**
+  Returns true if the headers are parsed and we are waiting for more POST data.
+**/
+bool HTTPRequest::IsReadingPostData() {
+  return httpReq_isPost && httpReq_post_bytesRead < httpReq_post_expected_size;
+}
+
+/**
+  Get the position in the POST body where the next read should go.
+  @param avail Set to the number of body bytes still expected.
+**/
+char* HTTPRequest::GetPostDataBuffer(size_t& avail) {
+  avail = httpReq_post_expected_size - httpReq_post_bytesRead;
+  return &post_data[0] + httpReq_post_bytesRead;
+}
+
+/**
+  Account for data read into the buffer returned by GetPostDataBuffer.
+  @param len Number of bytes read.
+**/
+HttpReqStatus HTTPRequest::PostDataRead(size_t len) {
+  httpReq_post_bytesRead += len;
+
+  if (httpReq_post_bytesRead < httpReq_post_expected_size) {
+    return HTTP_REQ_POST_INCOMPLETE;
+  }
+
+  return HTTP_REQ_POST_OK;
 }
 
 const string& HTTPRequest::GetPostData() {
@@ -1,6 +1,5 @@
-#include <sstream>
+#include <stdio.h>
 #include <boost/foreach.hpp>
-#include <boost/lexical_cast.hpp>
 #include "Common.h"
 #include "HTTPResponse.h"
 
@@ -36,32 +35,37 @@ void HTTPResponse::AppendBody(const std::string& data) {
 }
 
 const std::string HTTPResponse::Get() {
-  std::stringstream ss;
-
-  try {
-    m_headers.at("Connection");
-    m_headers.at("Content-Type");
+  std::string out;
+  char num[24];
+  size_t len;
+
+  // Always send Content-Length so the connection can be reused, except for event streams.
+  HeaderList_t::const_iterator contentType = m_headers.find("Content-Type");
+  if (m_statusCode >= 200 && (contentType == m_headers.end() || contentType->second != "text/event-stream")) {
+    snprintf(num, sizeof(num), "%lu", (unsigned long)m_body.size());
+    SetHeader("Content-Length", num);
+  }
 
-    if ((m_headers["Content-Type"].compare("text/event-stream") != 0) && (m_headers["Connection"].compare("close") == 0) && m_body.size() > 0) {
-      SetHeader("Content-Length", boost::lexical_cast<std::string>(m_body.size()));
-    }
-  } catch (...) {}
+  if (contentType == m_headers.end() && m_statusCode == 200 && !m_body.empty()) {
+    SetHeader("Content-Type", "text/html");
+  }
 
-  try {
-    m_headers.at("Content-Type");
-  } catch (...) {
-    if (m_statusCode == 200 && !m_body.empty()) SetHeader("Content-Type", "text/html");
+  len = 32 + m_statusMsg.size() + m_body.size();
+  BOOST_FOREACH(const HeaderList_t::value_type& header, m_headers) {
+    len += header.first.size() + header.second.size() + 4;
   }
+  out.reserve(len);
 
-  ss << "HTTP/1.1 " << m_statusCode << " " << m_statusMsg << CRLF;
+  snprintf(num, sizeof(num), "%d", m_statusCode);
+  out.append("HTTP/1.1 ").append(num).append(" ").append(m_statusMsg).append(CRLF);
 
-  BOOST_FOREACH(HeaderList_t::value_type& header, m_headers) {
-    ss << header.first << ": " << header.second << CRLF;
+  BOOST_FOREACH(const HeaderList_t::value_type& header, m_headers) {
+    out.append(header.first).append(": ").append(header.second).append(CRLF);
   }
 
-  ss << CRLF << m_body;
+  out.append(CRLF).append(m_body);
 
-  return ss.str();
+  return out;
 }
 
 /**
@@ -78,6 +82,8 @@ const std::string HTTPResponse::GetStatusMsg(int statusCode) {
     case 404: return "Not Found";
     case 411: return "Length Required";
     case 413: return "Request Entity Too Large";
+    case 500: return "Internal Server Error";
+    case 503: return "Service Unavailable";
   }
 
   return "OK";
@@ -1,18 +1,109 @@
 #include "Common.h"
 #include <unistd.h>
+#include <sys/time.h>
+#include <stdlib.h>
+#include <string.h>
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
 #include "SSEConfig.h"
 #include "SSEEvent.h"
 #include "SSEServer.h"
+#include "ShutdownNotifier.h"
+#include "SharedEventRing.h"
 #include "InputSources/amqp/AmqpInputSource.h"
 
 using namespace std;
 
-extern int stop;
+/*
+ Current time in microseconds.
+*/
+static uint64_t NowMicros() {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static string BytesToString(const amqp_bytes_t& bytes) {
+  return string((const char*)bytes.bytes, bytes.len);
+}
+
+/*
+ Find a message header by name.
+*/
+static const amqp_field_value_t* FindHeader(const amqp_basic_properties_t& properties, const char* name) {
+  if (!(properties._flags & AMQP_BASIC_HEADERS_FLAG)) return NULL;
+
+  size_t len = strlen(name);
+  for (int i = 0; i < properties.headers.num_entries; i++) {
+    const amqp_table_entry_t& entry = properties.headers.entries[i];
+    if (entry.key.len == len && memcmp(entry.key.bytes, name, len) == 0) return &entry.value;
+  }
+
+  return NULL;
+}
+
+/*
+ Read a header as a string, empty if missing or not a string.
+*/
+static string GetStringHeader(const amqp_basic_properties_t& properties, const char* name) {
+  const amqp_field_value_t* value = FindHeader(properties, name);
+
+  if (value == NULL) return "";
+  if (value->kind != AMQP_FIELD_KIND_UTF8 && value->kind != AMQP_FIELD_KIND_BYTES) return "";
+
+  return BytesToString(value->value.bytes);
+}
+
+/*
+ Read a header as a integer, 0 if missing or not a integer or string.
+*/
+static int GetIntHeader(const amqp_basic_properties_t& properties, const char* name) {
+  const amqp_field_value_t* value = FindHeader(properties, name);
+
+  if (value == NULL) return 0;
+
+  switch (value->kind) {
+    case AMQP_FIELD_KIND_I8:   return value->value.i8;
+    case AMQP_FIELD_KIND_U8:   return value->value.u8;
+    case AMQP_FIELD_KIND_I16:  return value->value.i16;
+    case AMQP_FIELD_KIND_U16:  return value->value.u16;
+    case AMQP_FIELD_KIND_I32:  return value->value.i32;
+    case AMQP_FIELD_KIND_U32:  return value->value.u32;
+    case AMQP_FIELD_KIND_I64:  return value->value.i64;
+    case AMQP_FIELD_KIND_U64:  return value->value.u64;
+    case AMQP_FIELD_KIND_UTF8: return atoi(BytesToString(value->value.bytes).c_str());
+  }
+
+  LOG_EVERY_N(WARNING, 1000) << "Ignoring AMQP header " << name << " of unsupported kind '" << (char)value->kind << "'.";
+
+  return 0;
+}
+
+AmqpInputSource::AmqpInputSource() {
+  amqpConn = NULL;
+  amqpQueueName = amqp_empty_bytes;
+  _ring = NULL;
+  _stopping = false;
+  _nextSeq = 0;
+  _nextDispatch = 0;
+  _dispatchedTag = 0;
+  _ackedTag = 0;
+  _invalid = 0;
+  _queueWaitAvg = 0;
+  _decodeAvg = 0;
+  _dispatchWaitAvg = 0;
+}
 
 AmqpInputSource::~AmqpInputSource() {
   LOG(INFO) << "AmqpInputSource stopped.";
-  KillThread();
+  StopThread();
+  StopPipeline();
   Disconnect();
+
+  BOOST_FOREACH(string* buf, _bufferpool) {
+    delete buf;
+  }
 }
 
 void AmqpInputSource::Start() {
@@ -22,6 +113,18 @@ void AmqpInputSource::Start() {
   password = _config->GetValue("amqp.password");
   exchange = _config->GetValue("amqp.exchange");
   routingkey = _config->GetValue("amqp.routingkey");
+  prefetch = _config->GetValueInt("amqp.prefetch");
+  batchSize = _config->GetValueInt("amqp.batchSize");
+  rawFormat = (_config->GetValue("amqp.format") == "raw");
+  _ring = _server->GetEventRing();
+
+  // Every worker needs all events, so each gets its own named queue.
+  if (!_config->GetValue("amqp.queue").empty()) {
+    queue = _config->GetValue("amqp.queue") + "-" + _config->GetValue("server.workerId");
+  }
+
+  if (prefetch > AMQP_MAX_PREFETCH) prefetch = AMQP_MAX_PREFETCH;
+  if (batchSize < 1) batchSize = 1;
 
   DLOG(INFO)         << "AmqpInputSource::Start():" <<
     " host: "        << host <<
@@ -29,29 +132,46 @@ void AmqpInputSource::Start() {
     " user: "        << user <<
     " password: "    << password <<
     " exchange: "    << exchange <<
-    " routingkey: "  << routingkey;
+    " routingkey: "  << routingkey <<
+    " queue: "       << queue <<
+    " prefetch: "    << prefetch <<
+    " format: "      << _config->GetValue("amqp.format");
 
-    Connect();
-    Consume();
+  StartPipeline();
+  if (Connect()) Consume();
+
+  // Deliver what has been received and acknowledge it before disconnecting.
+  StopPipeline();
+  if (amqpConn != NULL) Ack();
 }
 
 /**
  Disconnect from AMQP server.
 */
 void AmqpInputSource::Disconnect() {
+  if (amqpConn == NULL) return;
+
+  // Delivery tags are per connection, anything not acknowledged yet is redelivered.
+  _dispatchedTag = 0;
+  _ackedTag = 0;
+
   amqp_connection_close(amqpConn, AMQP_REPLY_SUCCESS);
   amqp_destroy_connection(amqpConn);
   amqp_bytes_free(amqpQueueName);
+  amqpConn = NULL;
+  amqpQueueName = amqp_empty_bytes;
 }
 
 /**
  Reconnect AMQP server.
  @param delay Time to wait between disconnect and connect.
+ @return false if shutting down.
 */
-void AmqpInputSource::Reconnect(int delay) {
+bool AmqpInputSource::Reconnect(int delay) {
+   WaitForPipeline();
    Disconnect();
-   sleep(delay);
-   Connect();
+   if (serverShutdown.Wait(delay * 1000)) return false;
+   return Connect();
 }
 
 /**
@@ -72,7 +192,7 @@ bool AmqpInputSource::Connect() {
 
     if (ret != AMQP_STATUS_OK) {
       LOG(ERROR) << "Failed to connect to amqp server, retrying in 5 seconds.";
-      sleep(5);
+      if (serverShutdown.Wait(5000)) return false;
     }
   } while(ret != AMQP_STATUS_OK);
 
@@ -83,7 +203,7 @@ bool AmqpInputSource::Connect() {
 
     if (rpc_ret.reply_type != AMQP_RESPONSE_NORMAL) {
       LOG(ERROR) << "Failed to log into AMQP, retrying in 5 seconds.";
-      sleep(5);
+      if (serverShutdown.Wait(5000)) return false;
     }
   } while(rpc_ret.reply_type != AMQP_RESPONSE_NORMAL);
 
@@ -93,16 +213,28 @@ bool AmqpInputSource::Connect() {
 
   if (rpc_ret.reply_type != AMQP_RESPONSE_NORMAL) {
     LOG(ERROR) << "Failed to open AMQP channel, trying to reconnect in 5 seconds.";
-    Reconnect(5);
+    return Reconnect(5);
   }
 
-  // Declare queue.
-  amqp_queue_declare_ok_t *r = amqp_queue_declare(amqpConn, 1, amqp_empty_bytes, 0, 0, 0, 1,
-                                 amqp_empty_table);
+  // Limit the number of unacknowledged messages in flight.
+  if (prefetch > 0) {
+    amqp_basic_qos(amqpConn, 1, 0, prefetch, 0);
+
+    if (amqp_get_rpc_reply(amqpConn).reply_type != AMQP_RESPONSE_NORMAL) {
+      LOG(ERROR) << "Failed to set AMQP prefetch, trying to reconnect in 5 seconds.";
+      return Reconnect(5);
+    }
+  }
+
+  // Declare queue, a named queue is durable and keeps messages while we are down.
+  bool durable = !queue.empty();
+  amqp_queue_declare_ok_t *r = amqp_queue_declare(amqpConn, 1,
+                                 durable ? amqp_cstring_bytes(queue.c_str()) : amqp_empty_bytes,
+                                 0, durable, !durable, !durable, amqp_empty_table);
 
   if (amqp_get_rpc_reply(amqpConn).reply_type != AMQP_RESPONSE_NORMAL) {
     LOG(ERROR) << "Failed to declare queue, trying to reconnect in 5 seconds.";
-    Reconnect(5);
+    return Reconnect(5);
   }
 
   amqpQueueName = amqp_bytes_malloc_dup(r->queue);
@@ -116,16 +248,16 @@ bool AmqpInputSource::Connect() {
 
   if (rpc_ret.reply_type != AMQP_RESPONSE_NORMAL) {
     LOG(ERROR) << "Failed to bind to AMQP queue, trying to reconnect in 5 seconds.";
-    Reconnect(5);
+    return Reconnect(5);
   }
 
-  // Consume.
-  amqp_basic_consume(amqpConn, 1, amqpQueueName, amqp_empty_bytes, 0, 1, 0, amqp_empty_table);
+  // Consume, messages are acknowledged once they have been broadcast.
+  amqp_basic_consume(amqpConn, 1, amqpQueueName, amqp_empty_bytes, 0, 0, 0, amqp_empty_table);
   rpc_ret = amqp_get_rpc_reply(amqpConn);
 
   if (rpc_ret.reply_type != AMQP_RESPONSE_NORMAL) {
     LOG(ERROR) << "Failed to consume AMQP queue, trying to reconnect in 5 seconds.";
-    Reconnect(5);
+    return Reconnect(5);
   }
 
   LOG(INFO) << "Connected to AMQP server " << host << ":" << port << ".";
@@ -137,33 +269,313 @@ bool AmqpInputSource::Connect() {
   Start consumption from AMQP server.
 */
 void AmqpInputSource::Consume() {
-  while(!stop) {
+  while(!serverShutdown.IsStopping()) {
+    if (!ConsumeBatch()) {
+      LOG(ERROR) << "Error consuming message, retrying in 5 seconds.";
+      if (!Reconnect(5)) return;
+    }
+  }
+}
+
+/**
+  Wait for a message, then pass it and the ones already received on to the decoders
+  without blocking. Messages are acknowledged once the dispatcher has broadcast them,
+  messages not acknowledged when the connection fails are redelivered.
+  @return false on connection error.
+*/
+bool AmqpInputSource::ConsumeBatch() {
+  bool pending;
+
+  {
+    boost::mutex::scoped_lock lock(_dispatch_lock);
+    pending = _nextDispatch < _nextSeq || _dispatchedTag > _ackedTag;
+  }
+
+  // Free up memory pool.
+  amqp_maybe_release_buffers(amqpConn);
+
+  for (int i = 0; i < batchSize; i++) {
     amqp_envelope_t envelope;
     amqp_rpc_reply_t ret;
+    struct timeval timeout;
 
-    // Free up memory pool.
-    amqp_maybe_release_buffers(amqpConn);
+    if (i > 0 && !amqp_frames_enqueued(amqpConn) && !amqp_data_in_buffer(amqpConn)) break;
 
-    // Consume message.
-    ret = amqp_consume_message(amqpConn, &envelope, NULL, 0);
+    // Only the first message is waited for, waking up regularly to check for shutdown
+    // and more often while there are messages to acknowledge.
+    timeout.tv_sec  = 0;
+    timeout.tv_usec = 0;
+    if (i == 0 && pending) timeout.tv_usec = AMQP_ACK_INTERVAL;
+    if (i == 0 && !pending) timeout.tv_sec = AMQP_CONSUME_TIMEOUT;
 
-    if (ret.reply_type != AMQP_RESPONSE_NORMAL) {
-      LOG(ERROR) << "Error consuming message, retrying in 5 seconds.";
-      amqp_destroy_envelope(&envelope);
-      Reconnect(5);
+    ret = amqp_consume_message(amqpConn, &envelope, &timeout, 0);
+
+    if (ret.reply_type == AMQP_RESPONSE_LIBRARY_EXCEPTION && ret.library_error == AMQP_STATUS_TIMEOUT) {
+      break;
+    }
+
+    if (ret.reply_type != AMQP_RESPONSE_NORMAL) return false;
+
+    AmqpMessagePtr msg(new AmqpMessage);
+    msg->deliveryTag = envelope.delivery_tag;
+    msg->received = NowMicros();
+    msg->body = NULL;
+
+    // Raw messages need no decoding, they only pass through the pipeline to keep their order.
+    if (rawFormat) {
+      msg->event.reset(ParseRaw(envelope));
     } else {
-     string msg;
-     msg.insert(0, (const char*)envelope.message.body.bytes, envelope.message.body.len);
-    
-     SSEEvent event(msg);
-
-     if (event.compile()) {
-       _server->Broadcast(event);
-     } else {
-       LOG(ERROR) << "Invalid event recieved: " << msg;
-     }
+      msg->body = GetBuffer();
+      msg->body->assign((const char*)envelope.message.body.bytes, envelope.message.body.len);
     }
 
     amqp_destroy_envelope(&envelope);
+
+    {
+      boost::mutex::scoped_lock lock(_dispatch_lock);
+      msg->seq = _nextSeq++;
+    }
+
+    _decodequeue.Push(msg);
+  }
+
+  return Ack();
+}
+
+/**
+  Build a event from a message without parsing the body.
+  The channel is the routing key, the id and event type are taken from the message_id
+  and type properties or the id and event headers, retry from the retry header and
+  the body is sent as is as the event data.
+  @param envelope Received message.
+  @return Event, or NULL if the message has no routing key.
+*/
+SSEEvent* AmqpInputSource::ParseRaw(const amqp_envelope_t& envelope) {
+  const amqp_basic_properties_t& properties = envelope.message.properties;
+
+  if (envelope.routing_key.len == 0) {
+    LOG(ERROR) << "Discarding raw event without routing key.";
+    return NULL;
+  }
+
+  SSEEvent* event = new SSEEvent();
+
+  event->setpath(BytesToString(envelope.routing_key));
+
+  if (properties._flags & AMQP_BASIC_MESSAGE_ID_FLAG) {
+    event->setid(BytesToString(properties.message_id));
+  } else {
+    event->setid(GetStringHeader(properties, "id"));
+  }
+
+  if (properties._flags & AMQP_BASIC_TYPE_FLAG) {
+    event->setevent(BytesToString(properties.type));
+  } else {
+    event->setevent(GetStringHeader(properties, "event"));
+  }
+
+  event->setretry(GetIntHeader(properties, "retry"));
+  event->setdata((const char*)envelope.message.body.bytes, envelope.message.body.len);
+
+  return event;
+}
+
+/**
+  Acknowledge all messages broadcast by the dispatcher so far.
+  @return false on connection error.
+*/
+bool AmqpInputSource::Ack() {
+  uint64_t tag;
+
+  {
+    boost::mutex::scoped_lock lock(_dispatch_lock);
+    tag = _dispatchedTag;
+  }
+
+  if (tag <= _ackedTag) return true;
+
+  if (amqp_basic_ack(amqpConn, 1, tag, 1) != AMQP_STATUS_OK) {
+    LOG(ERROR) << "Failed to acknowledge AMQP messages.";
+    return false;
+  }
+
+  _ackedTag = tag;
+
+  return true;
+}
+
+/**
+  Start the decode threads and the dispatcher.
+*/
+void AmqpInputSource::StartPipeline() {
+  int threads = _config->GetValueInt("amqp.decodeThreads");
+
+  if (threads < 1) threads = 1;
+
+  for (int i = 0; i < threads; i++) {
+    _decoders.create_thread(boost::bind(&AmqpInputSource::DecodeMain, this));
+  }
+
+  _dispatcher = boost::thread(boost::bind(&AmqpInputSource::DispatchMain, this));
+}
+
+/**
+  Stop the pipeline once every message received has been broadcast.
+*/
+void AmqpInputSource::StopPipeline() {
+  if (!_dispatcher.joinable()) return;
+
+  // Each decoder exits on the empty message after the ones already queued.
+  for (size_t i = 0; i < _decoders.size(); i++) {
+    _decodequeue.Push(AmqpMessagePtr());
+  }
+  _decoders.join_all();
+
+  {
+    boost::mutex::scoped_lock lock(_dispatch_lock);
+    _stopping = true;
+  }
+  _decoded_cond.notify_one();
+  _dispatcher.join();
+}
+
+/**
+  Wait until every message received has been broadcast.
+*/
+void AmqpInputSource::WaitForPipeline() {
+  boost::mutex::scoped_lock lock(_dispatch_lock);
+
+  while (_nextDispatch < _nextSeq && _dispatcher.joinable()) {
+    _dispatched_cond.wait(lock);
+  }
+}
+
+/**
+  Decode thread, compiles events in parallel and hands them to the dispatcher.
+*/
+void AmqpInputSource::DecodeMain() {
+  while (true) {
+    AmqpMessagePtr msg;
+    _decodequeue.WaitPop(msg);
+
+    if (!msg) break;
+
+    msg->decodeStart = NowMicros();
+
+    if (msg->body != NULL) {
+      msg->event.reset(new SSEEvent(msg->body->data(), msg->body->size()));
+
+      if (!msg->event->compile()) {
+        LOG(ERROR) << "Invalid event recieved: " << *msg->body;
+        msg->event.reset();
+      }
+
+      ReleaseBuffer(msg->body);
+      msg->body = NULL;
+    }
+
+    msg->decoded = NowMicros();
+
+    boost::mutex::scoped_lock lock(_dispatch_lock);
+    _decoded[msg->seq] = msg;
+    if (msg->seq == _nextDispatch) _decoded_cond.notify_one();
   }
 }
+
+/**
+  Dispatch thread, broadcasts decoded events in the order they were received
+  so events keep their publish order within each channel.
+*/
+void AmqpInputSource::DispatchMain() {
+  boost::mutex::scoped_lock lock(_dispatch_lock);
+  vector<AmqpMessagePtr> batch;
+  SSEEventBatch events;
+
+  while (true) {
+    // Take the messages that are next in line, up to one ack batch at a time.
+    while (!_decoded.empty() && (int)batch.size() < batchSize &&
+           _decoded.begin()->first == _nextDispatch + batch.size()) {
+      batch.push_back(_decoded.begin()->second);
+      _decoded.erase(_decoded.begin());
+    }
+
+    if (batch.empty()) {
+      if (_stopping) break;
+      _decoded_cond.wait(lock);
+      continue;
+    }
+
+    lock.unlock();
+
+    BOOST_FOREACH(const AmqpMessagePtr& msg, batch) {
+      if (msg->event) {
+        // Other workers get the event before the channel assigns its sequence number.
+        if (_ring != NULL) _ring->Publish(*msg->event);
+        events.push_back(msg->event.get());
+      } else {
+        INC_LONG(_invalid);
+        CountError();
+      }
+    }
+
+    PublishBatch(events, batch.front()->received);
+
+    uint64_t now = NowMicros();
+    BOOST_FOREACH(const AmqpMessagePtr& msg, batch) {
+      _queueWaitAvg    += AMQP_LATENCY_WEIGHT * ((double)(msg->decodeStart - msg->received) - _queueWaitAvg);
+      _decodeAvg       += AMQP_LATENCY_WEIGHT * ((double)(msg->decoded - msg->decodeStart) - _decodeAvg);
+      _dispatchWaitAvg += AMQP_LATENCY_WEIGHT * ((double)(now - msg->decoded) - _dispatchWaitAvg);
+    }
+
+    lock.lock();
+    _nextDispatch += batch.size();
+    _dispatchedTag = batch.back()->deliveryTag;
+    _dispatched_cond.notify_all();
+
+    batch.clear();
+    events.clear();
+  }
+}
+
+/**
+  Get a buffer to copy a message body into, reusing one from the pool if possible.
+*/
+string* AmqpInputSource::GetBuffer() {
+  boost::mutex::scoped_lock lock(_bufferpool_lock);
+
+  if (_bufferpool.empty()) return new string;
+
+  string* buf = _bufferpool.back();
+  _bufferpool.pop_back();
+
+  return buf;
+}
+
+void AmqpInputSource::ReleaseBuffer(string* buf) {
+  boost::mutex::scoped_lock lock(_bufferpool_lock);
+
+  if (_bufferpool.size() >= AMQP_BUFFER_POOL_SIZE) {
+    delete buf;
+    return;
+  }
+
+  _bufferpool.push_back(buf);
+}
+
+/**
+  Report queue depths and the moving average latency of each pipeline stage in microseconds.
+  @param pt Stats tree to add to.
+*/
+void AmqpInputSource::GetStats(boost::property_tree::ptree& pt) {
+  boost::mutex::scoped_lock lock(_dispatch_lock);
+
+  pt.put("amqp.received", _nextSeq);
+  pt.put("amqp.dispatched", _nextDispatch);
+  pt.put("amqp.invalid", _invalid);
+  pt.put("amqp.decode_queue", _decodequeue.Size());
+  pt.put("amqp.dispatch_queue", _decoded.size());
+  pt.put("amqp.in_flight", _nextSeq - _nextDispatch);
+  pt.put("amqp.queue_wait_us", (uint64_t)_queueWaitAvg);
+  pt.put("amqp.decode_us", (uint64_t)_decodeAvg);
+  pt.put("amqp.dispatch_wait_us", (uint64_t)_dispatchWaitAvg);
+}
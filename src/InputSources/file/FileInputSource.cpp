@@ -0,0 +1,300 @@
+#include "Common.h"
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <boost/foreach.hpp>
+#include <boost/algorithm/string.hpp>
+#include "SSEConfig.h"
+#include "SSEEvent.h"
+#include "SSEServer.h"
+#include "EventCapture.h"
+#include "ShutdownNotifier.h"
+#include "InputSources/file/FileInputSource.h"
+
+using namespace std;
+
+/*
+ Current time in microseconds.
+*/
+static uint64_t NowMicros() {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+FileInputSource::FileInputSource() {
+  _fd = -1;
+  _capture = false;
+  _follow = false;
+  _fifo = false;
+  _magicRead = false;
+  _rate = 0;
+  _speed = 0;
+  _batchSize = 1;
+  _readTime = 0;
+  _paceStart = 0;
+  _firstTimestamp = 0;
+  _paced = 0;
+  _bytesRead = 0;
+}
+
+FileInputSource::~FileInputSource() {
+  LOG(INFO) << "FileInputSource stopped.";
+  StopThread();
+
+  BOOST_FOREACH(SSEEvent* event, _batch) {
+    delete event;
+  }
+
+  if (_fd != -1) close(_fd);
+}
+
+void FileInputSource::Start() {
+  _path = boost::replace_all_copy(_config->GetValue("file.path"), "{worker}", _config->GetValue("server.workerId"));
+  _capture = (_config->GetValue("file.format") == "capture");
+  _follow = _config->GetValueBool("file.follow");
+  _rate = atof(_config->GetValue("file.rate").c_str());
+  _speed = atof(_config->GetValue("file.speed").c_str());
+  _batchSize = max(1, _config->GetValueInt("file.batchSize"));
+
+  if (!Open()) return;
+
+  LOG(INFO) << "Reading " << (_capture ? "captured" : "JSON") << " events from " << _path << ".";
+
+  while (!serverShutdown.IsStopping()) {
+    bool eof = false;
+
+    if (!Read(eof)) break;
+
+    // A last line without a newline is complete once we know no more data follows.
+    if (eof && !_follow && !_capture && !_rbuf.empty()) _rbuf += '\n';
+
+    if (!ProcessBuffer()) {
+      LOG(ERROR) << "Stopped reading " << _path << ".";
+      break;
+    }
+
+    if (!eof) continue;
+
+    Flush();
+
+    // A FIFO has nothing to read until the first writer opens it.
+    if (!_follow && !(_fifo && _bytesRead == 0)) {
+      LOG(INFO) << "Reached the end of " << _path << ".";
+      break;
+    }
+
+    serverShutdown.Wait(FILE_POLL_INTERVAL);
+  }
+
+  Flush();
+}
+
+bool FileInputSource::Open() {
+  struct stat st;
+
+  _fd = open(_path.c_str(), O_RDONLY | O_NONBLOCK);
+  if (_fd == -1) {
+    LOG(ERROR) << "Could not open " << _path << ": " << strerror(errno);
+    return false;
+  }
+
+  _fifo = (fstat(_fd, &st) == 0 && S_ISFIFO(st.st_mode));
+
+  return true;
+}
+
+/**
+ Read the next chunk of the file into the read buffer.
+ @param eof Set if there is nothing more to read for now.
+ @return false on read error.
+*/
+bool FileInputSource::Read(bool& eof) {
+  struct pollfd pfd[2];
+  struct stat st;
+
+  size_t used = _rbuf.size();
+  _rbuf.resize(used + FILE_READ_SIZE);
+
+  ssize_t len = read(_fd, &_rbuf[used], FILE_READ_SIZE);
+  _rbuf.resize(used + (len > 0 ? len : 0));
+  _readTime = NowMicros();
+
+  if (len > 0) {
+    _bytesRead += len;
+    return true;
+  }
+
+  if (len == 0) {
+    eof = true;
+
+    // Start over if the file was truncated while we followed it.
+    if (_follow && !_fifo && fstat(_fd, &st) == 0 && st.st_size < lseek(_fd, 0, SEEK_CUR)) {
+      LOG(INFO) << _path << " was truncated, reading from the start.";
+      lseek(_fd, 0, SEEK_SET);
+      _rbuf.clear();
+      _magicRead = false;
+    }
+
+    return true;
+  }
+
+  if (errno == EINTR) return true;
+
+  // A FIFO with a writer but no data, wait for it to become readable.
+  if (errno == EAGAIN || errno == EWOULDBLOCK) {
+    pfd[0].fd = _fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = serverShutdown.GetFd();
+    pfd[1].events = POLLIN;
+
+    Flush();
+    poll(pfd, 2, FILE_POLL_INTERVAL);
+    return true;
+  }
+
+  LOG(ERROR) << "Error reading " << _path << ": " << strerror(errno);
+  return false;
+}
+
+/**
+ Queue all complete events in the read buffer.
+ @return false if the input is malformed.
+*/
+bool FileInputSource::ProcessBuffer() {
+  size_t pos = 0;
+  bool ok = _capture ? ProcessRecords(pos) : ProcessLines(pos);
+
+  _rbuf.erase(0, pos);
+
+  return ok;
+}
+
+bool FileInputSource::ProcessLines(size_t& pos) {
+  while (!serverShutdown.IsStopping()) {
+    size_t end = _rbuf.find('\n', pos);
+
+    if (end == string::npos) {
+      if (_rbuf.size() - pos > FILE_MAX_LINE) {
+        LOG(ERROR) << "Line of more than " << FILE_MAX_LINE << " bytes in " << _path << ".";
+        return false;
+      }
+      break;
+    }
+
+    const char* line = _rbuf.data() + pos;
+    size_t len = end - pos;
+    pos = end + 1;
+
+    if (len == 0) continue;
+
+    SSEEvent* event = new SSEEvent(line, len);
+    if (!event->compile()) {
+      CountError();
+      LOG(ERROR) << "Invalid event in " << _path << ": " << string(line, len);
+      delete event;
+      continue;
+    }
+
+    Add(event, 0);
+  }
+
+  return true;
+}
+
+bool FileInputSource::ProcessRecords(size_t& pos) {
+  CaptureRecord record;
+  size_t used;
+
+  if (!_magicRead) {
+    if (_rbuf.size() < CAPTURE_MAGIC_LEN) return true;
+
+    if (memcmp(_rbuf.data(), CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) != 0) {
+      LOG(ERROR) << _path << " is not a capture file.";
+      return false;
+    }
+
+    pos = CAPTURE_MAGIC_LEN;
+    _magicRead = true;
+  }
+
+  while (!serverShutdown.IsStopping()) {
+    CaptureReadStatus status = ReadCaptureRecord(_rbuf.data() + pos, _rbuf.size() - pos, used, record);
+
+    if (status == CAPTURE_INCOMPLETE) break;
+
+    if (status == CAPTURE_INVALID) {
+      LOG(ERROR) << "Corrupt record at offset " << (_bytesRead - _rbuf.size() + pos) << " in " << _path << ".";
+      return false;
+    }
+
+    pos += used;
+
+    SSEEvent* event = new SSEEvent();
+    event->setpath(record.channel);
+    if (!event->parse(record.event)) {
+      CountError();
+      delete event;
+      continue;
+    }
+
+    Add(event, record.timestamp);
+  }
+
+  return true;
+}
+
+/**
+ Queue a event for broadcast, first sleeping until it is due if replay is paced.
+ @param event Compiled event, deleted once broadcast.
+ @param timestamp Time the event was recorded in microseconds, 0 if unknown.
+*/
+void FileInputSource::Add(SSEEvent* event, uint64_t timestamp) {
+  if (_rate > 0 || (_speed > 0 && timestamp > 0)) {
+    uint64_t now = NowMicros();
+
+    if (_paceStart == 0) {
+      _paceStart = now;
+      _firstTimestamp = timestamp;
+    }
+
+    uint64_t due = _paceStart;
+    if (_rate > 0) {
+      due = max(due, _paceStart + (uint64_t)(_paced * 1000000.0 / _rate));
+    }
+    if (_speed > 0 && timestamp > _firstTimestamp) {
+      due = max(due, _paceStart + (uint64_t)((timestamp - _firstTimestamp) / _speed));
+    }
+    _paced++;
+
+    // Events due within the slack go out together in one batch.
+    if (due > now + FILE_PACE_SLACK) {
+      Flush();
+      serverShutdown.Wait((due - now) / 1000);
+    }
+  }
+
+  _batch.push_back(event);
+  if (_batch.size() >= _batchSize) Flush();
+}
+
+void FileInputSource::Flush() {
+  // Paced events waited on purpose, that is not counted as lag.
+  PublishBatch(_batch, (_rate > 0 || _speed > 0) ? 0 : _readTime);
+
+  BOOST_FOREACH(SSEEvent* event, _batch) {
+    delete event;
+  }
+  _batch.clear();
+}
+
+void FileInputSource::GetStats(boost::property_tree::ptree& pt) {
+  pt.put("file.bytes_read", _bytesRead);
+}
@@ -0,0 +1,184 @@
+#include "Common.h"
+#include <unistd.h>
+#include <string.h>
+#include <algorithm>
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/algorithm/string.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/placeholders.hpp>
+#include "SSEConfig.h"
+#include "SSEEvent.h"
+#include "SSEServer.h"
+#include "ShutdownNotifier.h"
+#include "InputSources/redis/RedisInputSource.h"
+
+using namespace std;
+
+/*
+ Check if a message is already in the SSE wire format so the JSON parser can be skipped.
+ The first field is matched up to its colon like SSEEvent::parse does, so "data:x" counts.
+*/
+static bool IsSSEFramed(const char* data, size_t len) {
+  static const char* fields[] = {"data:", "id:", "event:", "retry:"};
+
+  for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+    size_t fieldLen = strlen(fields[i]);
+    if (len >= fieldLen && memcmp(data, fields[i], fieldLen) == 0) return true;
+  }
+
+  return false;
+}
+
+RedisInputSource::RedisInputSource() {
+  _port = 0;
+  _connected = false;
+  _received = 0;
+  _invalid = 0;
+  _reconnects = 0;
+}
+
+RedisInputSource::~RedisInputSource() {
+  LOG(INFO) << "RedisInputSource stopped.";
+  StopThread();
+}
+
+void RedisInputSource::Start() {
+  _host = _config->GetValue("redis.host");
+  _port = _config->GetValueInt("redis.port");
+  _prefix = _config->GetValue("redis.channelPrefix");
+
+  boost::split(_patterns, _config->GetValue("redis.pattern"), boost::is_any_of(","), boost::token_compress_on);
+  BOOST_FOREACH(string& pattern, _patterns) {
+    boost::trim(pattern);
+  }
+  _patterns.erase(remove(_patterns.begin(), _patterns.end(), ""), _patterns.end());
+
+  if (_patterns.empty()) {
+    LOG(ERROR) << "No redis.pattern configured, not subscribing to redis.";
+    return;
+  }
+
+  // Wait on a copy of the shutdown fd, the descriptor closes it when destroyed.
+  _shutdownfd.reset(new boost::asio::posix::stream_descriptor(_io, dup(serverShutdown.GetFd())));
+  _shutdownfd->async_read_some(boost::asio::null_buffers(),
+      boost::bind(&RedisInputSource::OnShutdown, this, boost::asio::placeholders::error));
+
+  _reconnecttimer.reset(new boost::asio::deadline_timer(_io));
+
+  Connect();
+  _io.run();
+
+  _client.reset();
+}
+
+/**
+ Resolve the redis host and start connecting, the subscriptions are made in OnConnect.
+*/
+void RedisInputSource::Connect() {
+  boost::asio::ip::tcp::resolver resolver(_io);
+  boost::asio::ip::tcp::resolver::query query(_host, boost::lexical_cast<string>(_port));
+  boost::system::error_code ec;
+
+  boost::asio::ip::tcp::resolver::iterator it = resolver.resolve(query, ec);
+  if (ec || it == boost::asio::ip::tcp::resolver::iterator()) {
+    LOG(ERROR) << "Failed to look up redis host " << _host << ": " << ec.message();
+    ScheduleReconnect();
+    return;
+  }
+
+  _client.reset(new RedisAsyncClient(_io));
+  _client->installErrorHandler(boost::bind(&RedisInputSource::OnError, this, _1));
+  _client->connect(*it, boost::bind(&RedisInputSource::OnConnect, this, _1, _2));
+}
+
+/**
+ Subscribe to all patterns once connected.
+ The commands are queued back to back without waiting for each reply.
+*/
+void RedisInputSource::OnConnect(bool ok, const string& errmsg) {
+  if (!ok) {
+    LOG(ERROR) << "Failed to connect to redis at " << _host << ":" << _port << ": " << errmsg;
+    ScheduleReconnect();
+    return;
+  }
+
+  _connected = true;
+
+  BOOST_FOREACH(const string& pattern, _patterns) {
+    _client->psubscribe(pattern, boost::bind(&RedisInputSource::OnMessage, this, _1, _2));
+  }
+
+  LOG(INFO) << "Subscribed to " << _patterns.size() << " pattern(s) on redis at " << _host << ":" << _port << ".";
+}
+
+/**
+ Called by the client on read, write or protocol errors, may be called more than once per connection.
+*/
+void RedisInputSource::OnError(const string& errmsg) {
+  if (!_connected) return;
+  _connected = false;
+
+  LOG(ERROR) << "Lost connection to redis: " << errmsg;
+  ScheduleReconnect();
+}
+
+/**
+ Broadcast a message published on a subscribed channel.
+ @param channel Redis channel the message was published to.
+ @param msg Message, either a SSE formatted event or a JSON event.
+*/
+void RedisInputSource::OnMessage(const string& channel, const vector<char>& msg) {
+  INC_LONG(_received);
+
+  if (msg.empty()) {
+    INC_LONG(_invalid);
+    CountError();
+    return;
+  }
+
+  const char* data = &msg[0];
+  size_t len = msg.size();
+  SSEEvent event(data, len);
+
+  if (boost::starts_with(channel, _prefix)) {
+    event.setpath(channel.substr(_prefix.size()));
+  } else {
+    event.setpath(channel);
+  }
+
+  bool valid = IsSSEFramed(data, len) ? event.parse(string(data, len)) : event.compile();
+
+  if (!valid) {
+    INC_LONG(_invalid);
+    CountError();
+    LOG(ERROR) << "Invalid event recieved on redis channel " << channel << ": " << string(data, len);
+    return;
+  }
+
+  Publish(event);
+}
+
+void RedisInputSource::OnShutdown(const boost::system::error_code& ec) {
+  if (ec == boost::asio::error::operation_aborted) return;
+  _io.stop();
+}
+
+void RedisInputSource::ScheduleReconnect() {
+  _reconnecttimer->expires_from_now(boost::posix_time::seconds(REDIS_RECONNECT_DELAY));
+  _reconnecttimer->async_wait(boost::bind(&RedisInputSource::Reconnect, this, boost::asio::placeholders::error));
+}
+
+void RedisInputSource::Reconnect(const boost::system::error_code& ec) {
+  if (ec == boost::asio::error::operation_aborted) return;
+
+  INC_LONG(_reconnects);
+  Connect();
+}
+
+void RedisInputSource::GetStats(boost::property_tree::ptree& pt) {
+  pt.put("redis.received", _received);
+  pt.put("redis.invalid", _invalid);
+  pt.put("redis.reconnects", _reconnects);
+}
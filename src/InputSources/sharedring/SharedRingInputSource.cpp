@@ -0,0 +1,51 @@
+#include "Common.h"
+#include "SSEEvent.h"
+#include "SSEServer.h"
+#include "SharedEventRing.h"
+#include "ShutdownNotifier.h"
+#include "InputSources/sharedring/SharedRingInputSource.h"
+
+using namespace std;
+
+SharedRingInputSource::SharedRingInputSource(SharedEventRing* ring) {
+  _ring = ring;
+  _received = 0;
+  _overruns = 0;
+}
+
+SharedRingInputSource::~SharedRingInputSource() {
+  LOG(INFO) << "SharedRingInputSource stopped.";
+  StopThread();
+}
+
+void SharedRingInputSource::Start() {
+  // Only events published after we started are of interest.
+  uint64_t tail = _ring->GetHead();
+
+  LOG(INFO) << "Receiving events from the shared event ring.";
+
+  while (!serverShutdown.IsStopping()) {
+    SSEEvent event;
+
+    switch (_ring->Read(tail, event)) {
+      case RING_EVENT:
+        INC_LONG(_received);
+        Publish(event);
+        break;
+
+      case RING_OVERRUN:
+        INC_LONG(_overruns);
+        LOG(WARNING) << "Fell behind on the shared event ring, events were lost.";
+        break;
+
+      case RING_EMPTY:
+        _ring->Wait(tail, SHAREDRING_WAIT_TIMEOUT);
+        break;
+    }
+  }
+}
+
+void SharedRingInputSource::GetStats(boost::property_tree::ptree& pt) {
+  pt.put("sharedring.received", _received);
+  pt.put("sharedring.overruns", _overruns);
+}
@@ -0,0 +1,364 @@
+#include "Common.h"
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <arpa/inet.h>
+#include <vector>
+#include <boost/foreach.hpp>
+#include "SSEConfig.h"
+#include "SSEEvent.h"
+#include "SSEServer.h"
+#include "ShutdownNotifier.h"
+#include "InputSources/unixsocket/UnixSocketInputSource.h"
+
+using namespace std;
+
+/*
+ Read a big endian integer from a unaligned buffer.
+*/
+static uint16_t ReadU16(const char* p) {
+  uint16_t v;
+  memcpy(&v, p, sizeof(v));
+  return ntohs(v);
+}
+
+static uint32_t ReadU32(const char* p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return ntohl(v);
+}
+
+static void AppendU32(string& buf, uint32_t v) {
+  v = htonl(v);
+  buf.append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+UnixSocketInputSource::UnixSocketInputSource() {
+  _listensocket = -1;
+  _efd = -1;
+}
+
+UnixSocketInputSource::~UnixSocketInputSource() {
+  LOG(INFO) << "UnixSocketInputSource stopped.";
+  StopThread();
+
+  map<int, UnixSocketConnection*>::iterator it;
+  for (it = _connections.begin(); it != _connections.end(); it++) {
+    close(it->first);
+    delete it->second;
+  }
+
+  if (_listensocket != -1) {
+    close(_listensocket);
+    unlink(_path.c_str());
+  }
+
+  if (_efd != -1) close(_efd);
+}
+
+void UnixSocketInputSource::Start() {
+  struct epoll_event events[UNIXSOCKET_MAX_EVENTS];
+
+  _path = _config->GetValue("unixsocket.dir") + "/ssehub-" +
+    _config->GetValue("server.workerId") + ".sock";
+
+  if (!Listen()) return;
+
+  LOG(INFO) << "Listening for events on unix socket " << _path << ".";
+
+  while (!serverShutdown.IsStopping()) {
+    int n = epoll_wait(_efd, events, UNIXSOCKET_MAX_EVENTS, -1);
+
+    for (int i = 0; i < n; i++) {
+      if (events[i].data.fd == serverShutdown.GetFd()) continue;
+
+      if (events[i].data.fd == _listensocket) {
+        Accept();
+        continue;
+      }
+
+      map<int, UnixSocketConnection*>::iterator it = _connections.find(events[i].data.fd);
+      if (it == _connections.end()) continue;
+      UnixSocketConnection* conn = it->second;
+
+      if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+        CloseConnection(conn);
+        continue;
+      }
+
+      if ((events[i].events & EPOLLOUT) && !HandleWrite(conn)) {
+        CloseConnection(conn);
+        continue;
+      }
+
+      if (events[i].events & EPOLLIN) {
+        HandleRead(conn);
+      }
+    }
+  }
+}
+
+/**
+ Create the listening socket and epoll instance.
+*/
+bool UnixSocketInputSource::Listen() {
+  struct sockaddr_un sun;
+  struct epoll_event event;
+
+  if (_path.size() >= sizeof(sun.sun_path)) {
+    LOG(ERROR) << "Unix socket path too long: " << _path;
+    return false;
+  }
+
+  _listensocket = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  LOG_IF(FATAL, _listensocket == -1) << "Error creating unix socket.";
+
+  memset(&sun, 0, sizeof(sun));
+  sun.sun_family = AF_UNIX;
+  strncpy(sun.sun_path, _path.c_str(), sizeof(sun.sun_path) - 1);
+
+  // Remove stale socket left behind by a previous process.
+  unlink(_path.c_str());
+
+  LOG_IF(FATAL, bind(_listensocket, (struct sockaddr*)&sun, sizeof(sun)) == -1) <<
+    "Could not bind unix socket to " << _path << ": " << strerror(errno);
+
+  LOG_IF(FATAL, listen(_listensocket, SOMAXCONN) == -1) << "Call to listen() failed on unix socket.";
+
+  _efd = epoll_create1(0);
+  LOG_IF(FATAL, _efd == -1) << "epoll_create1 failed.";
+
+  event.data.fd = _listensocket;
+  event.events = EPOLLIN;
+  LOG_IF(FATAL, epoll_ctl(_efd, EPOLL_CTL_ADD, _listensocket, &event) == -1) << "Could not add unix socket to epoll.";
+
+  // Wake up on shutdown.
+  event.data.fd = serverShutdown.GetFd();
+  event.events = EPOLLIN;
+  epoll_ctl(_efd, EPOLL_CTL_ADD, serverShutdown.GetFd(), &event);
+
+  return true;
+}
+
+/**
+ Accept all pending publisher connections.
+*/
+void UnixSocketInputSource::Accept() {
+  struct epoll_event event;
+
+  while (true) {
+    int fd = accept4(_listensocket, NULL, NULL, SOCK_NONBLOCK);
+
+    if (fd == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        LOG(ERROR) << "Error accepting unix socket connection: " << strerror(errno);
+      }
+      return;
+    }
+
+    UnixSocketConnection* conn = new UnixSocketConnection;
+    conn->fd = fd;
+    conn->wpos = 0;
+    conn->writing = false;
+
+    event.data.fd = fd;
+    event.events = EPOLLIN;
+    if (epoll_ctl(_efd, EPOLL_CTL_ADD, fd, &event) == -1) {
+      LOG(ERROR) << "Could not add unix socket connection to epoll.";
+      close(fd);
+      delete conn;
+      continue;
+    }
+
+    _connections[fd] = conn;
+    DLOG(INFO) << "Publisher connected on unix socket, fd " << fd << ".";
+  }
+}
+
+/**
+ Read up to UNIXSOCKET_MAX_READ bytes from a connection, the complete frames are broadcast
+ and acked after every chunk so the buffer only holds a partial frame.
+ Reading stops while acks are waiting for the socket to drain, see HandleWrite().
+ @param conn Connection to read from.
+*/
+void UnixSocketInputSource::HandleRead(UnixSocketConnection* conn) {
+  size_t total = 0;
+
+  while (total < UNIXSOCKET_MAX_READ) {
+    size_t used = conn->rbuf.size();
+    conn->rbuf.resize(used + UNIXSOCKET_READ_SIZE);
+
+    ssize_t len = read(conn->fd, &conn->rbuf[used], UNIXSOCKET_READ_SIZE);
+    conn->rbuf.resize(used + (len > 0 ? len : 0));
+
+    if (len == -1 && errno == EINTR) continue;
+
+    if (len == 0 || (len == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+      CloseConnection(conn);
+      return;
+    }
+
+    if (len == -1) break;
+
+    total += len;
+
+    if (!ProcessFrames(conn) || !HandleWrite(conn)) {
+      CloseConnection(conn);
+      return;
+    }
+
+    if (conn->writing) break;
+  }
+}
+
+/**
+ Broadcast all complete frames in the read buffer and queue a ack for them.
+ @param conn Connection to process.
+ @return false if the connection sent a malformed frame.
+*/
+bool UnixSocketInputSource::ProcessFrames(UnixSocketConnection* conn) {
+  const char* buf = conn->rbuf.data();
+  size_t avail = conn->rbuf.size();
+  size_t pos = 0;
+  bool valid = true;
+  vector<SSEEvent*> decoded;
+  SSEEventBatch events;
+  vector<bool> delivered;
+
+  while (avail - pos >= 4) {
+    uint32_t len = ReadU32(buf + pos);
+
+    if (len > UNIXSOCKET_MAX_FRAME) {
+      LOG(ERROR) << "Unix socket frame of " << len << " bytes exceeds limit, closing connection.";
+      valid = false;
+      break;
+    }
+
+    if (avail - pos - 4 < len) break;
+
+    SSEEvent* event = DecodeEvent(buf + pos + 4, len);
+    decoded.push_back(event);
+    if (event != NULL) events.push_back(event);
+    else CountError();
+
+    pos += 4 + len;
+  }
+
+  // Complete frames read before a oversized one are broadcast all the same.
+  PublishBatch(events, 0, &delivered);
+
+  string statuses;
+  size_t n = 0;
+  BOOST_FOREACH(SSEEvent* event, decoded) {
+    if (event == NULL) {
+      statuses += static_cast<char>(UNIXSOCKET_STATUS_INVALID);
+      continue;
+    }
+
+    statuses += static_cast<char>(delivered[n++] ? UNIXSOCKET_STATUS_OK : UNIXSOCKET_STATUS_REJECTED);
+    delete event;
+  }
+
+  conn->rbuf.erase(0, pos);
+
+  if (!statuses.empty()) {
+    AppendU32(conn->wbuf, 1 + 4 + statuses.size());
+    conn->wbuf += static_cast<char>(UNIXSOCKET_FRAME_ACK);
+    AppendU32(conn->wbuf, statuses.size());
+    conn->wbuf += statuses;
+  }
+
+  return valid;
+}
+
+/**
+ Decode a event frame.
+ @param frame Frame contents following the length prefix.
+ @param len Length of frame.
+ @return New event, or NULL if the frame is malformed.
+*/
+SSEEvent* UnixSocketInputSource::DecodeEvent(const char* frame, size_t len) {
+  if (len < UNIXSOCKET_EVENT_HEADER_LEN || frame[0] != UNIXSOCKET_FRAME_EVENT) {
+    return NULL;
+  }
+
+  size_t channelLen = ReadU16(frame + 2);
+  size_t idLen      = ReadU16(frame + 4);
+  size_t eventLen   = ReadU16(frame + 6);
+  uint32_t retry    = ReadU32(frame + 8);
+  size_t dataLen    = ReadU32(frame + 12);
+
+  if (UNIXSOCKET_EVENT_HEADER_LEN + channelLen + idLen + eventLen + dataLen != len ||
+      channelLen == 0 || dataLen == 0) {
+    return NULL;
+  }
+
+  const char* p = frame + UNIXSOCKET_EVENT_HEADER_LEN;
+  SSEEvent* event = new SSEEvent();
+
+  event->setpath(string(p, channelLen));
+  p += channelLen;
+  event->setid(string(p, idLen));
+  p += idLen;
+  event->setevent(string(p, eventLen));
+  p += eventLen;
+  event->setretry(retry);
+  event->setdata(p, dataLen);
+
+  return event;
+}
+
+/**
+ Flush pending acks to a connection. If the socket is full the connection only waits for
+ EPOLLOUT until the acks are written, so a publisher that does not read its acks stops
+ being read instead of growing the write buffer.
+ @param conn Connection to write to.
+ @return false on write error.
+*/
+bool UnixSocketInputSource::HandleWrite(UnixSocketConnection* conn) {
+  struct epoll_event event;
+
+  while (conn->wpos < conn->wbuf.size()) {
+    ssize_t len = write(conn->fd, conn->wbuf.data() + conn->wpos, conn->wbuf.size() - conn->wpos);
+
+    if (len == -1) {
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) return false;
+
+      if (!conn->writing) {
+        event.data.fd = conn->fd;
+        event.events = EPOLLOUT;
+        epoll_ctl(_efd, EPOLL_CTL_MOD, conn->fd, &event);
+        conn->writing = true;
+      }
+
+      return true;
+    }
+
+    conn->wpos += len;
+  }
+
+  conn->wbuf.clear();
+  conn->wpos = 0;
+
+  if (conn->writing) {
+    event.data.fd = conn->fd;
+    event.events = EPOLLIN;
+    epoll_ctl(_efd, EPOLL_CTL_MOD, conn->fd, &event);
+    conn->writing = false;
+  }
+
+  return true;
+}
+
+void UnixSocketInputSource::CloseConnection(UnixSocketConnection* conn) {
+  DLOG(INFO) << "Publisher disconnected from unix socket, fd " << conn->fd << ".";
+  epoll_ctl(_efd, EPOLL_CTL_DEL, conn->fd, NULL);
+  close(conn->fd);
+  _connections.erase(conn->fd);
+  delete conn;
+}
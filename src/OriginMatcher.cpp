@@ -0,0 +1,139 @@
+#include "OriginMatcher.h"
+
+OriginMatcher::OriginMatcher() {
+}
+
+/**
+ Check if a rule matches subdomains, "*.host" optionally prefixed by a scheme.
+ @param rule Allowed origin from the config.
+*/
+bool OriginMatcher::IsWildcard(const string& rule) const {
+  size_t pos = rule.find("*.");
+
+  if (pos == string::npos) return false;
+  return pos == 0 || (pos >= 3 && rule.compare(pos - 3, 3, "://") == 0);
+}
+
+size_t OriginMatcher::AddNode() {
+  OriginMatcherNode node;
+  node.value = ORIGIN_NO_MATCH;
+  _nodes.push_back(node);
+
+  return _nodes.size() - 1;
+}
+
+/**
+ Add a allowed origin rule.
+ If several rules match the same origin the one added first is used.
+ @param rule Allowed origin from the config.
+ @param value Value returned by Match() for origins matching this rule.
+*/
+void OriginMatcher::Add(const string& rule, int value) {
+  if (!IsWildcard(rule)) {
+    _exact.insert(make_pair(rule, value));
+    return;
+  }
+
+  size_t pos = rule.find("*.");
+  const string scheme = rule.substr(0, pos);
+  const string host = rule.substr(pos + 2);
+
+  boost::unordered_map<string, size_t>::iterator root = _schemes.find(scheme);
+  if (root == _schemes.end()) {
+    root = _schemes.insert(make_pair(scheme, AddNode())).first;
+  }
+
+  // Insert the host labels from right to left.
+  size_t node = root->second;
+  size_t end = host.size();
+
+  while (end > 0) {
+    size_t start = host.rfind('.', end - 1);
+    size_t labelStart = (start == string::npos) ? 0 : start + 1;
+    const string label = host.substr(labelStart, end - labelStart);
+
+    boost::unordered_map<string, size_t>::iterator child = _nodes[node].children.find(label);
+    if (child == _nodes[node].children.end()) {
+      size_t next = AddNode();
+      _nodes[node].children[label] = next;
+      node = next;
+    } else {
+      node = child->second;
+    }
+
+    if (start == string::npos) break;
+    end = start;
+  }
+
+  if (_nodes[node].value == ORIGIN_NO_MATCH) _nodes[node].value = value;
+}
+
+/**
+ Find the value of the rule matching a origin.
+ @param origin Origin header from the request.
+ @return Value given to Add() or ORIGIN_NO_MATCH.
+*/
+int OriginMatcher::Match(const StringRef& origin) const {
+  if (!_exact.empty()) {
+    boost::unordered_map<string, int>::const_iterator it = _exact.find(origin.str());
+    if (it != _exact.end()) return it->second;
+  }
+
+  if (_schemes.empty()) return ORIGIN_NO_MATCH;
+
+  StringRef scheme;
+  StringRef host = origin;
+
+  for (size_t i = 0; i + 2 < origin.size(); i++) {
+    if (origin[i] == ':' && origin[i + 1] == '/' && origin[i + 2] == '/') {
+      scheme = origin.substr(0, i + 3);
+      host = origin.substr(i + 3);
+      break;
+    }
+  }
+
+  boost::unordered_map<string, size_t>::const_iterator root;
+  int value;
+
+  if (!scheme.empty()) {
+    root = _schemes.find(scheme.str());
+    if (root != _schemes.end() && (value = MatchHost(root->second, host)) != ORIGIN_NO_MATCH) {
+      return value;
+    }
+  }
+
+  root = _schemes.find("");
+  if (root != _schemes.end()) return MatchHost(root->second, host);
+
+  return ORIGIN_NO_MATCH;
+}
+
+/*
+ Walk the label trie from the rightmost label of host, returning the most specific
+ wildcard that still leaves at least one subdomain label unmatched.
+*/
+int OriginMatcher::MatchHost(size_t root, const StringRef& host) const {
+  int result = ORIGIN_NO_MATCH;
+  size_t node = root;
+  size_t end = host.size();
+  string label;
+
+  while (end > 0) {
+    size_t start = end;
+    while (start > 0 && host[start - 1] != '.') start--;
+
+    label.assign(host.data() + start, end - start);
+
+    boost::unordered_map<string, size_t>::const_iterator child = _nodes[node].children.find(label);
+    if (child == _nodes[node].children.end()) break;
+    node = child->second;
+
+    // A wildcard needs a subdomain left of the matched labels.
+    if (start == 0) break;
+    if (_nodes[node].value != ORIGIN_NO_MATCH) result = _nodes[node].value;
+
+    end = start - 1;
+  }
+
+  return result;
+}
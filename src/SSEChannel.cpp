@@ -6,12 +6,26 @@
 #include "SSEConfig.h"
 #include "HTTPRequest.h"
 #include "HTTPResponse.h"
+#include "ShutdownNotifier.h"
+#include "SSEHandoff.h"
 #include <boost/foreach.hpp>
 #include <boost/bind.hpp>
 #include <boost/thread.hpp>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <unistd.h>
 
 using namespace std;
-extern int stop;
+
+/*
+ Current time in microseconds.
+*/
+static uint64_t NowMicros() {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
 
 /**
   Constructor.
@@ -25,14 +39,25 @@ SSEChannel::SSEChannel(ChannelConfig conf, string id) {
   _efd = epoll_create1(0);
   LOG_IF(FATAL, _efd == -1) << "epoll_create1 failed.";
 
+  // Wake up the cleanup thread on shutdown.
+  struct epoll_event ev;
+  ev.events   = EPOLLIN;
+  ev.data.ptr = NULL;
+  epoll_ctl(_efd, EPOLL_CTL_ADD, serverShutdown.GetFd(), &ev);
+
   // Initialize counters.
   _stats.num_clients            = 0;
   _stats.num_connects           = 0;
   _stats.num_disconnects        = 0;
   _stats.num_errors             = 0;
   _stats.num_cached_events      = 0;
+  _stats.cache_bytes            = 0;
   _stats.num_broadcasted_events = 0;
   _stats.cache_size             = _config.cacheLength;
+  _stats.ingest_queued          = 0;
+  _stats.ingest_blocked         = 0;
+  _stats.ingest_shed            = 0;
+  _stats.fanout_stalls          = 0;
 
 
   LOG(INFO) << "Initializing channel " << _config.id;
@@ -41,20 +66,26 @@ SSEChannel::SSEChannel(ChannelConfig conf, string id) {
   LOG(INFO) << "Threads per channel: " << _config.server->GetValue("server.threadsPerChannel");
 
   _allow_all_origins = (_config.allowedOrigins.size() < 1) ? true : false;
+  BOOST_FOREACH(const std::string& origin, _config.allowedOrigins) {
+    if (origin == "*") _allow_all_origins = true;
+  }
+
+  _seq = 0;
+  _seq_mode = SEQUENCE_IDS_NONE;
+  if (_config.sequenceIds == "id") _seq_mode = SEQUENCE_IDS_ID;
+  if (_config.sequenceIds == "suffix") _seq_mode = SEQUENCE_IDS_SUFFIX;
+  LOG_IF(INFO, _seq_mode != SEQUENCE_IDS_NONE) << "Sequence ids: " << _config.sequenceIds;
+
+  _ingest_stopping = false;
+  _ingest_shed = (_config.ingestOverflow == "shed");
+  LOG_IF(WARNING, !_ingest_shed && _config.ingestOverflow != "block") << "Unknown ingestOverflow " << _config.ingestOverflow << ", using block.";
+  LOG(INFO) << "Ingest queue size: " << _config.ingestQueueSize << " (" << (_ingest_shed ? "shed" : "block") << ")";
 
   BOOST_FOREACH(const std::string& origin, _config.allowedOrigins) {
     DLOG(INFO) << "Allowed origin: " << origin;
   }
 
-  // Internet Explorer has a problem receiving data when using XDomainRequest before it has received 2KB of data.
-  // The polyfills that account for this send a query parameter, evs_preamble to inform the server about this so it can respond with some initial data.
-  // Initialize a buffer containing our response for this case.
-  _evs_preamble_data[0] = ':';
-  for (int i = 1; i <= 2048; i++) { _evs_preamble_data[i] = '.'; }
-  _evs_preamble_data[2049] = '\n';
-  _evs_preamble_data[2050] = '\n';
-  _evs_preamble_data[2051] = '\0';
-
+  InitializeResponses();
   InitializeCache();
   InitializeThreads();
 }
@@ -65,6 +96,12 @@ SSEChannel::SSEChannel(ChannelConfig conf, string id) {
 SSEChannel::~SSEChannel() {
   DLOG(INFO) << "SSEChannel destructor called.";
   CleanupThreads();
+  StopDispatch();
+
+  // Handlers call back into the channel, stop them before our members go away.
+  BOOST_FOREACH(ClientHandlerPtr& handler, _clientpool) {
+    handler->Stop();
+  }
 }
 
 /*
@@ -72,17 +109,18 @@ SSEChannel::~SSEChannel() {
 */
 void SSEChannel::InitializeCache() {
   const string adapter = _config.cacheAdapter;
+  _cache_adapter = NULL;
+
   if (adapter == "redis") {
     _cache_adapter = new Redis(_config.id, _config);
   } else if (adapter == "memory") {
     _cache_adapter = new Memory(_config);
   } else if (adapter == "leveldb") {
     _cache_adapter = new LevelDB(_config);
+  } else if (adapter == "mmap") {
+    _cache_adapter = new MmapLog(_config);
   }
 
-  if (_cache_adapter) {
-    _stats.num_cached_events = _cache_adapter->GetSizeOfCachedEvents();
-  }
 }
 
 /**
@@ -95,20 +133,139 @@ void SSEChannel::InitializeThreads() {
   _cleanupthread = boost::thread(boost::bind(&SSEChannel::CleanupMain, this));
 
   for (i = 0; i < _config.server->GetValueInt("server.threadsPerChannel"); i++) {
-    _clientpool.push_back(ClientHandlerPtr(new SSEClientHandler(i)));
+    _clientpool.push_back(ClientHandlerPtr(new SSEClientHandler(i, _config.fanoutQueueSize,
+      boost::bind(&SSEChannel::FanoutDrained, this))));
   }
 
   curthread = _clientpool.begin();
   _pingthread = boost::thread(boost::bind(&SSEChannel::Ping, this));
+  _dispatchthread = boost::thread(boost::bind(&SSEChannel::DispatchMain, this));
 }
 
 /**
-  Stop and free up all running threads.
-  Called by destructor.
+  Wait for the ping and cleanup threads to exit, they stop once shutdown is notified.
+  Called by Shutdown and the destructor.
 */
 void SSEChannel::CleanupThreads() {
-  pthread_cancel(_pingthread.native_handle());
-  pthread_cancel(_cleanupthread.native_handle());
+  if (_pingthread.joinable()) _pingthread.join();
+  if (_cleanupthread.joinable()) _cleanupthread.join();
+}
+
+/**
+  Refuse new events, deliver those still in the ingest queue and wait for the dispatcher to exit.
+  Called before the client handlers are stopped.
+*/
+void SSEChannel::StopDispatch() {
+  // The flag is read under _ingest_lock by publishers and under _fanout_lock by WaitForFanout.
+  boost::mutex::scoped_lock lock(_ingest_lock);
+  boost::mutex::scoped_lock fanoutLock(_fanout_lock);
+  _ingest_stopping = true;
+  fanoutLock.unlock();
+  lock.unlock();
+
+  _ingest_ready.notify_all();
+  _ingest_space.notify_all();
+  _fanout_space.notify_all();
+
+  if (_dispatchthread.joinable()) _dispatchthread.join();
+}
+
+/**
+  Drain the channel during shutdown.
+  Queued events are delivered, then every client is told when to reconnect and
+  we keep flushing until all send buffers are empty or the deadline has passed.
+  @param deadline Time in microseconds to give up on flushing.
+*/
+void SSEChannel::Shutdown(uint64_t deadline) {
+  size_t pending = 0;
+
+  CleanupThreads();
+  StopDispatch();
+
+  BOOST_FOREACH(ClientHandlerPtr& handler, _clientpool) {
+    handler->Stop();
+  }
+
+  BOOST_FOREACH(ClientHandlerPtr& handler, _clientpool) {
+    handler->SendRetry(_config.server->GetValueInt("server.shutdownRetry"),
+      _config.server->GetValueInt("server.shutdownRetryJitter"));
+  }
+
+  while (true) {
+    pending = 0;
+
+    BOOST_FOREACH(ClientHandlerPtr& handler, _clientpool) {
+      pending += handler->Flush();
+    }
+
+    if (pending == 0 || NowMicros() >= deadline) break;
+    usleep(10000);
+  }
+
+  LOG_IF(WARNING, pending > 0) << "Channel " << _config.id << ": " << pending << " bytes not sent before shutdown timeout.";
+}
+
+/**
+  Hand the channel over to the process replacing us during a upgrade.
+  Queued events are delivered to the send buffers first, then the memory cache and,
+  if clients is set, every client connection is passed on with its unsent data.
+  @param handoff Connection to the new process.
+  @param clients Pass on the client connections, otherwise they are drained by Shutdown.
+  @return false if the connection failed.
+*/
+bool SSEChannel::Handoff(SSEHandoff& handoff, bool clients) {
+  CleanupThreads();
+  StopDispatch();
+
+  BOOST_FOREACH(ClientHandlerPtr& handler, _clientpool) {
+    handler->Stop();
+  }
+
+  if (!handoff.Send(HANDOFF_CHANNEL, _config.id)) return false;
+
+  // Other adapters are persistent or shared, the new process reads them itself.
+  if (_cache_adapter && _config.cacheAdapter == "memory") {
+    BOOST_FOREACH(const string& event, _cache_adapter->GetAllEvents()) {
+      if (!handoff.Send(HANDOFF_EVENT, event)) return false;
+    }
+  }
+
+  if (!clients) return true;
+
+  BOOST_FOREACH(ClientHandlerPtr& handler, _clientpool) {
+    if (!handler->Handoff(handoff)) return false;
+  }
+
+  LOG(INFO) << "Channel " << _config.id << ": handed off " << GetNumClients() << " clients.";
+
+  return true;
+}
+
+/**
+  Add a event received from the process we took over from to the cache.
+  @param text Event as sent to clients.
+*/
+void SSEChannel::RestoreEvent(const string& text) {
+  SSEEvent event;
+  uint64_t seq;
+
+  if (!event.parse(text)) return;
+  event.setpath(_config.id);
+
+  // Keep the sequence numbers clients already have, setseq adds the suffix back.
+  if (_seq_mode != SEQUENCE_IDS_NONE && ParseSeq(event.getid(), seq)) {
+    if (_seq_mode == SEQUENCE_IDS_SUFFIX) {
+      size_t pos = event.getid().rfind('.');
+      event.setid((pos == string::npos) ? "" : event.getid().substr(0, pos));
+    }
+
+    event.setseq(seq, _seq_mode == SEQUENCE_IDS_SUFFIX);
+
+    boost::mutex::scoped_lock lock(_ingest_lock);
+    if (seq > _seq) _seq = seq;
+  }
+
+  CacheEvent(event);
 }
 
 /**
@@ -119,35 +276,107 @@ string SSEChannel::GetId() {
 }
 
 /**
- Set correct CORS headers.
- @param req Request object.
- @param res Response object.
+ Compile the allowed origins and render the handshake and OPTIONS responses for each of them
+ up front so adding a client only has to pick one.
 */
-void SSEChannel::SetCorsHeaders(HTTPRequest* req, HTTPResponse& res) {
-  // Set allowed headers for the EventSource IE polyfill
-  res.SetHeader("Access-Control-Allow-Headers", "Accept, Cache-Control, X-Requested-With, Last-Event-ID");
+void SSEChannel::InitializeResponses() {
+  // Internet Explorer has a problem receiving data when using XDomainRequest before it has received 2KB of data.
+  // The polyfills that account for this send a query parameter, evs_preamble to inform the server about this so it can respond with some initial data.
+  _evs_preamble = ":" + string(2048, '.') + "\n\n";
+
+  // Index 0 sends no Access-Control-Allow-Origin header.
+  _cors_responses.push_back(RenderCorsResponses(""));
 
   if (_allow_all_origins) {
-    DLOG(INFO) << "All origins allowed.";
-    res.SetHeader("Access-Control-Allow-Origin", "*");
+    _cors_responses.push_back(RenderCorsResponses("*"));
     return;
   }
 
-  const string& originHeader = req->GetHeader("Origin");
+  BOOST_FOREACH(const std::string& origin, _config.allowedOrigins) {
+    if (_origin_matcher.IsWildcard(origin)) {
+      _origin_matcher.Add(origin, CORS_WILDCARD_MATCH);
+    } else {
+      _origin_matcher.Add(origin, _cors_responses.size());
+      _cors_responses.push_back(RenderCorsResponses(origin));
+    }
+  }
+}
+
+/**
+ Render the responses sent for a Access-Control-Allow-Origin value.
+ @param origin Allowed origin, empty to not send the header.
+*/
+CorsResponsesPtr SSEChannel::RenderCorsResponses(const string& origin) {
+  boost::shared_ptr<CorsResponses> responses(new CorsResponses);
+  HTTPResponse options;
+  HTTPResponse res;
+
+  responses->origin = origin;
+
+  SetCorsHeaders(origin, options);
+  responses->options = options.Get();
+
+  SetCorsHeaders(origin, res);
+  res.SetHeader("Content-Type", "text/event-stream");
+  res.SetHeader("Cache-Control", "no-cache");
+  res.SetHeader("Connection", "close");
+  res.SetBody(":ok\n\n");
+  responses->handshake = res.Get();
+
+  res.AppendBody(_evs_preamble);
+  responses->handshake_preamble = res.Get();
+
+  return responses;
+}
+
+/**
+ Find the prerendered responses matching the Origin of a request.
+ Origins matching a wildcard rule are rendered on first use and kept for later requests.
+ @param req Request object.
+*/
+CorsResponsesPtr SSEChannel::GetCorsResponses(HTTPRequest* req) {
+  if (_allow_all_origins) return _cors_responses[1];
+
+  StringRef originHeader = req->GetHeader("Origin");
 
   // If Origin header is not set in the request don't set any CORS headers.
   if (originHeader.empty()) {
     DLOG(INFO) << "No Origin header in request, not setting cors headers.";
-    return;
+    return _cors_responses[0];
   }
 
-  // If Origin matches one of the origins in the allowedOrigins array use that in the CORS header.
-  BOOST_FOREACH(const std::string& origin, _config.allowedOrigins) {
-    if (originHeader.compare(0, origin.size(), origin) == 0) {
-      res.SetHeader("Access-Control-Allow-Origin", origin);
-      DLOG(INFO) << "Referer matches origin " << origin;
-      return;
-    }
+  int match = _origin_matcher.Match(originHeader);
+
+  if (match == ORIGIN_NO_MATCH) return _cors_responses[0];
+  if (match != CORS_WILDCARD_MATCH) return _cors_responses[match];
+
+  const string origin = originHeader.str();
+  DLOG(INFO) << "Origin matches wildcard rule: " << origin;
+
+  boost::mutex::scoped_lock lock(_cors_lock);
+  boost::unordered_map<string, CorsResponsesPtr>::const_iterator it = _wildcard_cors_responses.find(origin);
+  if (it != _wildcard_cors_responses.end()) return it->second;
+
+  // Start over rather than grow without bounds when clients send many different subdomains.
+  if (_wildcard_cors_responses.size() >= CORS_MAX_CACHED_ORIGINS) _wildcard_cors_responses.clear();
+
+  CorsResponsesPtr responses = RenderCorsResponses(origin);
+  _wildcard_cors_responses[origin] = responses;
+
+  return responses;
+}
+
+/**
+ Set correct CORS headers.
+ @param origin Allowed origin, empty to not send Access-Control-Allow-Origin.
+ @param res Response object.
+*/
+void SSEChannel::SetCorsHeaders(const string& origin, HTTPResponse& res) {
+  // Set allowed headers for the EventSource IE polyfill
+  res.SetHeader("Access-Control-Allow-Headers", "Accept, Cache-Control, X-Requested-With, Last-Event-ID");
+
+  if (!origin.empty()) {
+    res.SetHeader("Access-Control-Allow-Origin", origin);
   }
 }
 
@@ -157,62 +386,63 @@ void SSEChannel::SetCorsHeaders(HTTPRequest* req, HTTPResponse& res) {
   @param client SSEClient pointer.
 */
 void SSEChannel::AddClient(SSEClient* client, HTTPRequest* req) {
-  HTTPResponse res;
-  struct epoll_event ev;
-  int ret;
-
   DLOG(INFO) << "Adding client to channel " << GetId();
 
-  // Send CORS headers.
-  SetCorsHeaders(req, res);
+  CorsResponsesPtr cors = GetCorsResponses(req);
 
    // Reply with CORS headers when we get a OPTIONS request.
-  if (req->GetMethod().compare("OPTIONS") == 0) {
-    client->Send(res.Get());
+  if (req->GetMethod() == "OPTIONS") {
+    client->Send(cors->options);
     client->Destroy();
     return;
   }
 
   // Disallow every other method than GET.
-  if (req->GetMethod().compare("GET") != 0) {
+  if (req->GetMethod() != "GET") {
+    HTTPResponse res;
     DLOG(INFO) << "Method: " << req->GetMethod();
+    SetCorsHeaders(cors->origin, res);
     res.SetStatus(405, "Method Not Allowed");
     client->Send(res.Get());
     client->Destroy();
     return;
   }
 
-  string lastEventId = req->GetHeader("Last-Event-ID");
+  StringRef lastEventId = req->GetHeader("Last-Event-ID");
   if (lastEventId.empty()) lastEventId = req->GetQueryString("evs_last_event_id");
   if (lastEventId.empty()) lastEventId = req->GetQueryString("lastEventId");
 
-  // Initial response headers, etc.
-  res.SetHeader("Content-Type", "text/event-stream");
-  res.SetHeader("Cache-Control", "no-cache");
-  res.SetHeader("Connection", "close");
-  res.SetBody(":ok\n\n");
-
-  // Preamble if polyfill require it.
-  if (!req->GetQueryString("evs_preamble").empty()) {
-    res.AppendBody(_evs_preamble_data);
-  }
-
-  // Send the response.
-  client->Send(res.Get(), SND_NO_FLUSH);
-
   // Apply filters.
-  if (!req->GetQueryString("filterid").empty()) client->Subscribe(req->GetQueryString("filterid"), SUBSCRIPTION_ID);
-  if (!req->GetQueryString("filterevent").empty()) client->Subscribe(req->GetQueryString("filterevent"), SUBSCRIPTION_EVENT_TYPE);
+  if (!req->GetQueryString("filterid").empty()) client->Subscribe(req->GetQueryString("filterid").str(), SUBSCRIPTION_ID);
+  if (!req->GetQueryString("filterevent").empty()) client->Subscribe(req->GetQueryString("filterevent").str(), SUBSCRIPTION_EVENT_TYPE);
 
-  // Send event history if requested.
+  // Fetch event history if requested.
+  deque<string> history;
   if (!lastEventId.empty()) {
-    SendEventsSince(client, lastEventId);
+    history = GetEventsSince(lastEventId.str());
   } else if (!req->GetQueryString("getcache").empty()) {
-    SendCache(client);
+    history = _cache_adapter->GetAllEvents();
   }
 
+  // Send the prerendered response, with preamble if polyfill require it, and the history in one go.
+  bool preamble = !req->GetQueryString("evs_preamble").empty();
+  client->SendBatch(preamble ? cors->handshake_preamble : cors->handshake, history);
+
   client->DeleteHttpReq();
 
+  if (AdoptClient(client)) INC_LONG(_stats.num_connects);
+}
+
+/**
+  Start delivering events to a client that has received the handshake,
+  either from AddClient or from the process we took over from.
+  @param client SSEClient pointer.
+  @return false if the client could not be added and was destroyed.
+*/
+bool SSEChannel::AdoptClient(SSEClient* client) {
+  struct epoll_event ev;
+  int ret;
+
   // Add client to epoll socket list.
   ev.events   = EPOLLET | EPOLLOUT | EPOLLIN | EPOLLHUP | EPOLLRDHUP | EPOLLERR;
   ev.data.ptr = client;
@@ -221,16 +451,16 @@ void SSEChannel::AddClient(SSEClient* client, HTTPRequest* req) {
   if (ret == -1) {
     DLOG(ERROR) << "Failed to add client " << client->GetIP() << " to epoll event list.";
     client->Destroy();
-    return;
+    return false;
   }
 
-  INC_LONG(_stats.num_connects);
-
   // Add client to handler thread in a round-robin fashion.
   (*curthread)->AddClient(client);
   curthread++;
 
   if (curthread == _clientpool.end()) curthread = _clientpool.begin();
+
+  return true;
 }
 
 /**
@@ -246,17 +476,122 @@ void SSEChannel::Broadcast(const string& data) {
 }
 
 /**
-  Broadcasts SSEvent to all connected clients.
-  @param event Event to broadcast.
+  Queue a event to be broadcast to all connected clients.
+  Events from all input sources are sequenced and delivered in the order they are queued.
+  When the ingest queue is full we wait for the dispatcher, or drop the event if ingestOverflow is "shed".
+  @param event Event to broadcast, a copy is queued.
+  @param wait Wait for room in a full queue, must be false on the router thread.
+  @return false if the event was dropped or the channel is shutting down.
 */
-void SSEChannel::BroadcastEvent(SSEEvent& event) {
-  Broadcast(event.get());
-  INC_LONG(_stats.num_broadcasted_events);
+bool SSEChannel::BroadcastEvent(SSEEvent& event, bool wait) {
+  SSEEventPtr queued(new SSEEvent(event));
+  boost::mutex::scoped_lock lock(_ingest_lock);
+
+  if (_config.ingestQueueSize > 0 && _ingest_queue.size() >= _config.ingestQueueSize && !_ingest_stopping) {
+    if (_ingest_shed || !wait) {
+      INC_LONG(_stats.ingest_shed);
+      return false;
+    }
+
+    INC_LONG(_stats.ingest_blocked);
+    while (_ingest_queue.size() >= _config.ingestQueueSize && !_ingest_stopping) {
+      _ingest_space.wait(lock);
+    }
+  }
 
-  // Add event to cache if it contains a id field.
-  if (!event.getid().empty()) {
-    CacheEvent(event);
+  if (_ingest_stopping) return false;
+
+  // Assign the sequence number under the queue lock so it follows delivery order.
+  if (_seq_mode != SEQUENCE_IDS_NONE) {
+    queued->setseq(NextSeq(), _seq_mode == SEQUENCE_IDS_SUFFIX);
   }
+
+  _ingest_queue.push_back(queued);
+  lock.unlock();
+  _ingest_ready.notify_one();
+
+  return true;
+}
+
+/**
+  Dispatcher thread, the only place events are broadcast and cached so both see them in queue order.
+*/
+void SSEChannel::DispatchMain() {
+  vector<SSEEventPtr> batch;
+
+  while (true) {
+    boost::mutex::scoped_lock lock(_ingest_lock);
+
+    while (_ingest_queue.empty() && !_ingest_stopping) {
+      _ingest_ready.wait(lock);
+    }
+
+    if (_ingest_queue.empty()) break;
+
+    size_t n = min(_ingest_queue.size(), (size_t)INGEST_DISPATCH_BATCH);
+    batch.assign(_ingest_queue.begin(), _ingest_queue.begin() + n);
+    _ingest_queue.erase(_ingest_queue.begin(), _ingest_queue.begin() + n);
+    lock.unlock();
+    _ingest_space.notify_all();
+
+    WaitForFanout();
+
+    BOOST_FOREACH(SSEEventPtr& event, batch) {
+      Broadcast(event->get());
+      INC_LONG(_stats.num_broadcasted_events);
+
+      // Add event to cache if it contains a id field, in sequence mode all events have one.
+      if (!event->getid().empty()) {
+        CacheEvent(*event);
+      }
+    }
+
+    batch.clear();
+  }
+}
+
+/**
+  Wait while a client handler has fanoutQueueSize or more messages queued,
+  the ingest queue then fills up and holds back the input sources.
+  Gives up waiting once the channel is stopping so the queued events are delivered.
+*/
+void SSEChannel::WaitForFanout() {
+  bool stalled = false;
+
+  if (_config.fanoutQueueSize == 0) return;
+
+  // Handlers signal under _fanout_lock, so a drain between the check and the wait is not missed.
+  boost::mutex::scoped_lock lock(_fanout_lock);
+
+  while (!_ingest_stopping && GetFanoutDepth() >= _config.fanoutQueueSize) {
+    if (!stalled) {
+      INC_LONG(_stats.fanout_stalls);
+      stalled = true;
+    }
+
+    _fanout_space.wait(lock);
+  }
+}
+
+/**
+  Called by a client handler when its queue drops below fanoutQueueSize.
+*/
+void SSEChannel::FanoutDrained() {
+  boost::mutex::scoped_lock lock(_fanout_lock);
+  _fanout_space.notify_all();
+}
+
+/**
+  Returns the number of messages queued on the most loaded client handler.
+*/
+size_t SSEChannel::GetFanoutDepth() {
+  size_t depth = 0;
+
+  BOOST_FOREACH(ClientHandlerPtr& handler, _clientpool) {
+    depth = max(depth, handler->GetQueueSize());
+  }
+
+  return depth;
 }
 
 /**
@@ -266,38 +601,54 @@ void SSEChannel::BroadcastEvent(SSEEvent& event) {
 void SSEChannel::CacheEvent(SSEEvent& event) {
   if (_cache_adapter) {
     _cache_adapter->CacheEvent(event);
-    _stats.num_cached_events = _cache_adapter->GetSizeOfCachedEvents();
   }
 }
 
 /**
-  Send all events since a given event id to client.
-  @param lastId Send all events since this id.
+  Get all cached events since a given event id.
+  @param lastId Get all events since this id.
 */
-void SSEChannel::SendEventsSince(SSEClient* client, string lastId) {
-  deque<string>::const_iterator it;
-  deque<string> events = _cache_adapter->GetEventsSinceId(lastId);
+deque<string> SSEChannel::GetEventsSince(const string& lastId) {
+  uint64_t seq;
 
-  BOOST_FOREACH(const string& event, events) {
-    client->Send(event, SND_NO_FLUSH);
+  if (_seq_mode != SEQUENCE_IDS_NONE && ParseSeq(lastId, seq)) {
+    return _cache_adapter->GetEventsAfterSeq(seq);
   }
 
-  client->Flush();
+  return _cache_adapter->GetEventsSinceId(lastId);
+}
+
+/**
+  Returns the next sequence number for this channel.
+  Sequence numbers follow the clock in microseconds so they keep increasing across restarts.
+  Must be called with _ingest_lock held.
+*/
+uint64_t SSEChannel::NextSeq() {
+  uint64_t now = NowMicros();
+
+  _seq = (now > _seq) ? now : _seq + 1;
+
+  return _seq;
 }
 
 /**
-  Send all cached events to client.
-  @param client SSEClient.
+  Extract the sequence number from a event id sent by a client.
+  @param lastId Last event id received by the client.
+  @param seq Set to the sequence number if found.
 */
-void SSEChannel::SendCache(SSEClient* client) {
- deque<string>::const_iterator it;
- deque<string> events = _cache_adapter->GetAllEvents();
+bool SSEChannel::ParseSeq(const string& lastId, uint64_t& seq) {
+  size_t start = 0;
 
-  BOOST_FOREACH(const string& event, events) {
-    client->Send(event, SND_NO_FLUSH);
+  if (_seq_mode == SEQUENCE_IDS_SUFFIX) {
+    size_t pos = lastId.rfind('.');
+    if (pos != string::npos) start = pos + 1;
   }
 
-  client->Flush();
+  if (start >= lastId.size()) return false;
+  if (lastId.find_first_not_of("0123456789", start) != string::npos) return false;
+
+  seq = strtoull(lastId.c_str() + start, NULL, 10);
+  return true;
 }
 
 /**
@@ -309,13 +660,16 @@ void SSEChannel::CleanupMain() {
 
   t_events = (struct epoll_event*)calloc(maxEvents, sizeof(struct epoll_event));
   
-  while(!stop) {
+  while(!serverShutdown.IsStopping()) {
     int n = epoll_wait(_efd, t_events, maxEvents, -1);
 
     for (int i = 0; i < n; i++) {
       SSEClient* client;
       client = static_cast<SSEClient*>(t_events[i].data.ptr);
 
+      // Woken up by the shutdown notifier.
+      if (client == NULL) continue;
+
       if (t_events[i].events & EPOLLIN) {
         char buf[512];
         int rcv_len = client->Read(buf, 512);
@@ -354,9 +708,9 @@ void SSEChannel::CleanupMain() {
   Sends a ping to all clients connected to this channel.
 */
 void SSEChannel::Ping() {
-  while(!stop) {
+  while(!serverShutdown.IsStopping()) {
     Broadcast(":\n\n");
-    sleep(_config.server->GetValueInt("server.pingInterval"));
+    serverShutdown.Wait(_config.server->GetValueInt("server.pingInterval") * 1000);
   }
 }
 
@@ -380,6 +734,17 @@ ulong SSEChannel::GetNumClients() {
 **/
 const SSEChannelStats& SSEChannel::GetStats() {
   _stats.num_clients = GetNumClients();
+
+  boost::mutex::scoped_lock lock(_ingest_lock);
+  _stats.ingest_queued = _ingest_queue.size();
+  lock.unlock();
+
+  // Query the cache here instead of after every event since it may be a network round trip.
+  if (_cache_adapter) {
+    _stats.num_cached_events = _cache_adapter->GetSizeOfCachedEvents();
+    _stats.cache_bytes = _cache_adapter->GetSizeOfCachedBytes();
+  }
+
   return _stats;
 }
 
@@ -2,21 +2,33 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
+#include <sys/uio.h>
 #include <boost/shared_ptr.hpp>
 #include <boost/foreach.hpp>
 #include "SSEClient.h"
 #include "HTTPRequest.h"
+#include "SSEHandoff.h"
 
 /**
  Constructor.
  @param fd Client socket file descriptor.
- @param csin Client sockaddr_in structure.
+ @param csin Client socket address.
+ @param csinLen Length of csin.
 */
-SSEClient::SSEClient(int fd, struct sockaddr_in* csin) {
+SSEClient::SSEClient(int fd, const struct sockaddr* csin, socklen_t csinLen) {
   _fd = fd;
   _dead = false;
- 
-   memcpy(&_csin, csin, sizeof(struct sockaddr_in));
+
+  memset(&_csin, 0, sizeof(_csin));
+  memcpy(&_csin, csin, std::min((size_t)csinLen, sizeof(_csin)));
+
+  // Formatted here once since GetIP() is called from several threads.
+  const void* addr = (_csin.ss_family == AF_INET6) ?
+    (const void*)&reinterpret_cast<struct sockaddr_in6*>(&_csin)->sin6_addr :
+    (const void*)&reinterpret_cast<struct sockaddr_in*>(&_csin)->sin_addr;
+
+  if (inet_ntop(_csin.ss_family, addr, _ip, sizeof(_ip)) == NULL) strcpy(_ip, "unknown");
+
   DLOG(INFO) << "Initialized client with IP: " << GetIP();
 
   m_httpReq = boost::shared_ptr<HTTPRequest>(new HTTPRequest());
@@ -90,6 +102,14 @@ int SSEClient::Flush() {
   return _write_sndbuf();
 }
 
+/*
+  Number of bytes waiting in the sendbuffer.
+*/
+size_t SSEClient::GetSendBufferSize() {
+  boost::mutex::scoped_lock lock(_sndBufLock);
+  return _sndBuf.length();
+}
+
 /**
  Sends data to client.
  @param data String buffer to send.
@@ -105,12 +125,75 @@ int SSEClient::Send(const string &data, bool flush) {
   return _sndBuf.length();
 }
 
+/**
+ Send a response followed by a list of events using as few writev() calls as possible.
+ Whatever the socket does not accept right away is queued in the send buffer and flushed on EPOLLOUT.
+ @param head Data sent first, not subject to filters.
+ @param events Events to send after head.
+*/
+int SSEClient::SendBatch(const string& head, const deque<string>& events) {
+  boost::mutex::scoped_lock lock(_sndBufLock);
+  struct iovec iov[IOVEC_SIZE];
+  vector<const string*> parts;
+  size_t i = 0;
+  size_t offset = 0;
+
+  parts.reserve(events.size() + 1);
+  parts.push_back(&head);
+
+  BOOST_FOREACH(const string& event, events) {
+    if (isFilterAcceptable(event)) parts.push_back(&event);
+  }
+
+  // Data already queued must go out first.
+  while (_sndBuf.empty() && i < parts.size()) {
+    size_t total = 0;
+    int cnt = 0;
+
+    for (size_t j = i; j < parts.size() && cnt < IOVEC_SIZE; j++, cnt++) {
+      size_t skip = (j == i) ? offset : 0;
+      iov[cnt].iov_base = const_cast<char*>(parts[j]->data() + skip);
+      iov[cnt].iov_len  = parts[j]->size() - skip;
+      total += iov[cnt].iov_len;
+    }
+
+    ssize_t ret = writev(_fd, iov, cnt);
+
+    if (ret == -1 && errno == EINTR) continue;
+    if (ret <= 0) {
+      DLOG(INFO) << GetIP() << ": writev error: " << strerror(errno);
+      break;
+    }
+
+    // Skip past what was written.
+    size_t written = ret;
+    while (i < parts.size() && written >= parts[i]->size() - offset) {
+      written -= parts[i]->size() - offset;
+      offset = 0;
+      i++;
+    }
+    offset += written;
+
+    if ((size_t)ret < total) {
+      DLOG(INFO) << GetIP() << ": Could not writev() entire batch, wrote " << ret << " of " << total << " bytes.";
+      break;
+    }
+  }
+
+  for (; i < parts.size(); i++) {
+    _sndBuf.append(*parts[i], offset, string::npos);
+    offset = 0;
+  }
+
+  return _sndBuf.length();
+}
+
 /**
  Read data from client.
  @param buf Pointer to buffer where data should be read into.
  @param len Bytes to read.
 */
-size_t SSEClient::Read(void* buf, int len) {
+ssize_t SSEClient::Read(void* buf, size_t len) {
   return read(_fd, buf, len);
 }
 
@@ -132,18 +215,15 @@ int SSEClient::Getfd() {
 /**
   Returns the client's ip address as a string.
 */
-const string SSEClient::GetIP() {
-  char ip[32];
-  inet_ntop(AF_INET, &_csin.sin_addr, (char*)&ip, 32);
-
-  return ip;
+const char* SSEClient::GetIP() {
+  return _ip;
 }
 
 /*
   Get clients sockaddr.
 */
-uint32_t SSEClient::GetSockAddr() {
-  return _csin.sin_addr.s_addr;
+const struct sockaddr* SSEClient::GetSockAddr() {
+  return reinterpret_cast<const struct sockaddr*>(&_csin);
 }
 
 /*
@@ -160,6 +240,13 @@ void SSEClient::DeleteHttpReq() {
   m_httpReq.reset();
 }
 
+/*
+  Start over with a new HTTPRequest for the next request on a persistent connection.
+*/
+void SSEClient::ResetHttpReq() {
+  m_httpReq.reset(new HTTPRequest());
+}
+
 /*
  Mark client as dead and ready for removal.
 */
@@ -255,3 +342,46 @@ bool SSEClient::isFilterAcceptable(const string& data) {
 
   return true;
 }
+
+/*
+  Serialize the subscriptions and unsent data so another process can take over the connection.
+  @param buf Buffer to append the state to.
+*/
+void SSEClient::GetState(string& buf) {
+  HandoffAppend(buf, static_cast<uint32_t>(_subscriptions.size()));
+
+  BOOST_FOREACH(const SubscriptionElement& subscription, _subscriptions) {
+    HandoffAppend(buf, static_cast<uint32_t>(subscription.type));
+    HandoffAppend(buf, subscription.key);
+  }
+
+  boost::mutex::scoped_lock lock(_sndBufLock);
+  HandoffAppend(buf, _sndBuf);
+}
+
+/*
+  Restore state serialized by GetState.
+  @param buf Serialized state.
+*/
+bool SSEClient::RestoreState(const string& buf) {
+  HandoffReader reader(buf);
+  uint32_t numSubscriptions;
+  string sndBuf;
+
+  if (!reader.Read(numSubscriptions)) return false;
+
+  for (uint32_t i = 0; i < numSubscriptions; i++) {
+    uint32_t type;
+    string key;
+
+    if (!reader.Read(type) || !reader.Read(key)) return false;
+    Subscribe(key, static_cast<SubscriptionType>(type));
+  }
+
+  if (!reader.Read(sndBuf)) return false;
+
+  boost::mutex::scoped_lock lock(_sndBufLock);
+  _sndBuf = sndBuf;
+
+  return true;
+}
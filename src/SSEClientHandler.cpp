@@ -3,24 +3,32 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <climits>
+#include <stdlib.h>
+#include <time.h>
+#include <boost/lexical_cast.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 #include <boost/bind.hpp>
+#include <boost/foreach.hpp>
 #include "Common.h"
 #include "SSEClientHandler.h"
 #include "SSEClient.h"
-
-extern int stop;
+#include "SSEHandoff.h"
 
 using namespace std;
 
 /**
   Constructor.
   @param tid unique ID to identify thread.
+  @param queueLimit Call onDrained when the queue drops below this many messages, 0 to disable.
+  @param onDrained Callback run on the processor thread.
 */
-SSEClientHandler::SSEClientHandler(int tid) {
+SSEClientHandler::SSEClientHandler(int tid, size_t queueLimit, boost::function<void()> onDrained) {
   DLOG(INFO) << "SSEClientHandler constructor called " << "id: " << tid;
   _id = tid;
+  _queue_limit = queueLimit;
+  _on_drained = onDrained;
+  _stopping = false;
   _connected_clients = 0;
 
   _processorthread = boost::thread(boost::bind(&SSEClientHandler::ProcessQueue, this));
@@ -31,7 +39,74 @@ SSEClientHandler::SSEClientHandler(int tid) {
 */
 SSEClientHandler::~SSEClientHandler() {
   DLOG(INFO) << "SSEClientHandler destructor called for " << "id: " << _id;
-  pthread_cancel(_processorthread.native_handle());
+  Stop();
+}
+
+/**
+  Stop the processor thread once it has sent the messages already queued.
+*/
+void SSEClientHandler::Stop() {
+  if (!_processorthread.joinable()) return;
+
+  _stopping = true;
+  _msgqueue.Push("");
+  _processorthread.join();
+}
+
+/**
+  Tell all clients how long to wait before reconnecting, spread out over jitterMs
+  so they do not all come back at the same time.
+  @param retryMs Minimum reconnect delay in milliseconds.
+  @param jitterMs Random delay added on top of retryMs.
+*/
+void SSEClientHandler::SendRetry(int retryMs, int jitterMs) {
+  boost::mutex::scoped_lock lock(_clientlist_lock);
+  unsigned int seed = time(NULL) ^ (getpid() << 8) ^ _id;
+
+  BOOST_FOREACH(SSEClientPtr& client, _clientlist) {
+    if (client->IsDead()) continue;
+
+    int retry = retryMs + ((jitterMs > 0) ? rand_r(&seed) % jitterMs : 0);
+    client->Send("retry: " + boost::lexical_cast<string>(retry) + "\n\n", SND_NO_FLUSH);
+  }
+}
+
+/**
+  Try to write out the send buffers of all clients.
+  @return Number of bytes still waiting to be sent.
+*/
+size_t SSEClientHandler::Flush() {
+  boost::mutex::scoped_lock lock(_clientlist_lock);
+  size_t pending = 0;
+
+  BOOST_FOREACH(SSEClientPtr& client, _clientlist) {
+    if (client->IsDead()) continue;
+
+    client->Flush();
+    pending += client->GetSendBufferSize();
+  }
+
+  return pending;
+}
+
+/**
+  Pass the connected clients on to the process replacing us.
+  Must be called after Stop() so no more data is added to the send buffers.
+  @param handoff Connection to the new process.
+  @return false if the connection failed.
+*/
+bool SSEClientHandler::Handoff(SSEHandoff& handoff) {
+  boost::mutex::scoped_lock lock(_clientlist_lock);
+
+  BOOST_FOREACH(SSEClientPtr& client, _clientlist) {
+    if (client->IsDead()) continue;
+
+    string state;
+    client->GetState(state);
+    if (!handoff.Send(HANDOFF_CLIENT, state, client->Getfd())) return false;
+  }
+
+  return true;
 }
 
 /**
@@ -52,10 +127,22 @@ void SSEClientHandler::Broadcast(const string msg) {
   _msgqueue.Push(msg);
 }
 
+/**
+  Returns the number of messages waiting to be sent to the clients.
+*/
+size_t SSEClientHandler::GetQueueSize() {
+  return _msgqueue.Size();
+}
+
 void SSEClientHandler::ProcessQueue() {
-  while(!stop) {
+  while(true) {
     std::string msg;
-    _msgqueue.WaitPop(msg);
+    size_t remaining = _msgqueue.WaitPop(msg);
+
+    if (_stopping && msg.empty()) break;
+
+    // Each pop removes one message so the queue passes exactly this size on the way down.
+    if (_queue_limit > 0 && remaining + 1 == _queue_limit && _on_drained) _on_drained();
 
     boost::mutex::scoped_lock lock(_clientlist_lock);
     for (SSEClientPtrList::iterator it = _clientlist.begin(); it != _clientlist.end(); it++) {
@@ -35,6 +35,13 @@ void SSEConfig::InitDefaults() {
  ConfigMap["server.threadsPerChannel"]        = "5";
  ConfigMap["server.allowUndefinedChannels"]   = "true";
  ConfigMap["server.enablePost"]               = "false";
+ ConfigMap["server.workerId"]                 = "0";
+ ConfigMap["server.shutdownTimeout"]          = "5";
+ ConfigMap["server.shutdownRetry"]            = "1000";
+ ConfigMap["server.shutdownRetryJitter"]      = "4000";
+ ConfigMap["server.upgrade"]                  = "false";
+ ConfigMap["server.handoffDir"]               = "";
+ ConfigMap["server.handoffClients"]           = "true";
 
  ConfigMap["amqp.enabled"]                    = "false";
  ConfigMap["amqp.host"]                       = "127.0.0.1";
@@ -42,15 +49,53 @@ void SSEConfig::InitDefaults() {
  ConfigMap["amqp.user"]                       = "guest";
  ConfigMap["amqp.password"]                   = "guest";
  ConfigMap["amqp.exchange"]                   = "amq.fanout";
+ ConfigMap["amqp.routingkey"]                 = "";
+ ConfigMap["amqp.format"]                     = "json";
+ ConfigMap["amqp.queue"]                      = "";
+ ConfigMap["amqp.prefetch"]                   = "1000";
+ ConfigMap["amqp.batchSize"]                  = "256";
+ ConfigMap["amqp.decodeThreads"]              = "2";
+ ConfigMap["amqp.shared"]                     = "false";
+ ConfigMap["amqp.sharedRingSize"]             = "64";
+
+ ConfigMap["unixsocket.enabled"]              = "false";
+ ConfigMap["unixsocket.dir"]                  = "/tmp";
+
+ ConfigMap["file.enabled"]                    = "false";
+ ConfigMap["file.path"]                       = "";
+ ConfigMap["file.format"]                     = "json";
+ ConfigMap["file.follow"]                     = "false";
+ ConfigMap["file.rate"]                       = "0";
+ ConfigMap["file.speed"]                      = "0";
+ ConfigMap["file.batchSize"]                  = "256";
+
+ ConfigMap["recorder.enabled"]                = "false";
+ ConfigMap["recorder.path"]                   = "/tmp/ssehub-{worker}.cap";
+ ConfigMap["recorder.bufferSize"]             = "16";
 
  ConfigMap["redis.host"]                      = "127.0.0.1";
  ConfigMap["redis.port"]                      = "6379";
  ConfigMap["redis.prefix"]                    = "ssehub";
+ ConfigMap["redis.subscribe"]                 = "false";
+ ConfigMap["redis.pattern"]                   = "ssehub:*";
+ ConfigMap["redis.channelPrefix"]             = "ssehub:";
 
  ConfigMap["leveldb.storageDir"]              = ".";
+ ConfigMap["leveldb.blockCacheSize"]          = "8388608";
+ ConfigMap["leveldb.writeBufferSize"]         = "4194304";
+ ConfigMap["leveldb.maxOpenFiles"]            = "256";
+
+ ConfigMap["mmap.storageDir"]                 = ".";
+ ConfigMap["mmap.segmentSize"]                = "4194304";
 
  ConfigMap["default.cacheAdapter"]            = "redis";
  ConfigMap["default.cacheLength"]             = "500";
+ ConfigMap["default.cacheMaxBytes"]           = "0";
+ ConfigMap["default.cacheMaxAge"]             = "0";
+ ConfigMap["default.sequenceIds"]             = "none";
+ ConfigMap["default.ingestQueueSize"]         = "10000";
+ ConfigMap["default.ingestOverflow"]          = "block";
+ ConfigMap["default.fanoutQueueSize"]         = "10000";
  ConfigMap["default.allowedOrigins"]          = "*";
 }
 
@@ -98,28 +143,13 @@ void SSEConfig::GetAllowedPublishers(ChannelConfig& conf, boost::property_tree::
   vector<string> RestrictPublish;
   GetArray(RestrictPublish, pt.get_child("restrictPublish"));
 
-  try {
-   BOOST_FOREACH(const std::string& range_str, RestrictPublish) {
-    struct in_addr range_in;
-    int cidr = 32;
-    iprange_t iprange;
-
-    size_t cidr_start = range_str.find("/");
-    if (cidr_start != string::npos) {
-      cidr = boost::lexical_cast<int>(range_str.substr(cidr_start+1));
-    }
-
-    iprange.mask = ntohl(((~0U) << (32-cidr)));
-    const string& range_ip = range_str.substr(0, cidr_start);
-
-    LOG_IF(FATAL, inet_aton(range_ip.c_str(), &range_in) == 0) << "restrictPublish Invalid IP " << range_ip;
-    iprange.range = range_in.s_addr;
+  boost::shared_ptr<CIDRTrie> allowedPublishers(new CIDRTrie());
 
-    conf.allowedPublishers.push_back(iprange);
-   }
-  } catch(std::exception &e) {
-    LOG(FATAL) << "Error parsing restrictPublish entry in config: " << e.what();
+  BOOST_FOREACH(const std::string& range_str, RestrictPublish) {
+    LOG_IF(FATAL, !allowedPublishers->Insert(range_str)) << "restrictPublish Invalid network " << range_str;
   }
+
+  conf.allowedPublishers = allowedPublishers;
 }
 
 /**
@@ -131,6 +161,12 @@ void SSEConfig::LoadChannels(boost::property_tree::ptree& pt) {
   DefaultChannelConfig.server = this;
   DefaultChannelConfig.cacheAdapter = GetValue("default.cacheAdapter");
   DefaultChannelConfig.cacheLength = GetValueInt("default.cacheLength");
+  DefaultChannelConfig.cacheMaxBytes = GetValueSize("default.cacheMaxBytes");
+  DefaultChannelConfig.cacheMaxAge = GetValueInt("default.cacheMaxAge");
+  DefaultChannelConfig.sequenceIds = GetValue("default.sequenceIds");
+  DefaultChannelConfig.ingestQueueSize = GetValueInt("default.ingestQueueSize");
+  DefaultChannelConfig.ingestOverflow = GetValue("default.ingestOverflow");
+  DefaultChannelConfig.fanoutQueueSize = GetValueInt("default.fanoutQueueSize");
 
   // Get default publish restrictions.
   try {
@@ -178,6 +214,12 @@ void SSEConfig::LoadChannels(boost::property_tree::ptree& pt) {
     // Optional channel parameters.
     ChannelMap[chName].cacheAdapter = child.second.get<std::string>("cacheAdapter", DefaultChannelConfig.cacheAdapter);
     ChannelMap[chName].cacheLength = child.second.get<int>("cacheLength", DefaultChannelConfig.cacheLength);
+    ChannelMap[chName].cacheMaxBytes = child.second.get<size_t>("cacheMaxBytes", DefaultChannelConfig.cacheMaxBytes);
+    ChannelMap[chName].cacheMaxAge = child.second.get<int>("cacheMaxAge", DefaultChannelConfig.cacheMaxAge);
+    ChannelMap[chName].sequenceIds = child.second.get<std::string>("sequenceIds", DefaultChannelConfig.sequenceIds);
+    ChannelMap[chName].ingestQueueSize = child.second.get<size_t>("ingestQueueSize", DefaultChannelConfig.ingestQueueSize);
+    ChannelMap[chName].ingestOverflow = child.second.get<std::string>("ingestOverflow", DefaultChannelConfig.ingestOverflow);
+    ChannelMap[chName].fanoutQueueSize = child.second.get<size_t>("fanoutQueueSize", DefaultChannelConfig.fanoutQueueSize);
    }
   } catch(...) {
     if (!GetValueBool("server.allowUndefinedChannels")) {
@@ -205,6 +247,15 @@ const string &SSEConfig::GetValue(const string& key) {
   return ConfigMap[key];
 }
 
+/**
+  Set a config attribute.
+  @param key Config attribute to set.
+  @param value Value to set.
+*/
+void SSEConfig::SetValue(const string& key, const string& value) {
+  ConfigMap[key] = value;
+}
+
 /**
   Fetch a config attribute and return as a int.
   @param key Config attribute to fetch.
@@ -217,6 +268,18 @@ int SSEConfig::GetValueInt(const string& key) {
   }
 }
 
+/**
+  Fetch a config attribute and return as a size_t, for sizes that may not fit in a int.
+  @param key Config attribute to fetch.
+*/
+size_t SSEConfig::GetValueSize(const string& key) {
+  try  {
+    return boost::lexical_cast<size_t>(ConfigMap[key]);
+  } catch(...) {
+    return 0;
+  }
+}
+
 /**
  *  Fetch a config attribute and return as a boolean.
  *  @param key Config attribute to fetch.
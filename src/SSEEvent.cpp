@@ -1,13 +1,60 @@
 #include <exception>
+#include <stdlib.h>
+#include <string.h>
 #include <boost/algorithm/string.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/iostreams/device/array.hpp>
+#include <boost/iostreams/stream.hpp>
 #include "Common.h"
 #include "SSEEvent.h"
 
 using namespace std;
 
+/**
+ Construct a empty event to be filled in with the setters instead of compile().
+**/
+SSEEvent::SSEEvent() {
+  _json_data = NULL;
+  _json_len = 0;
+  _retry = 0;
+  _seq = 0;
+}
+
 SSEEvent::SSEEvent(const string& jsondata) {
   _json_ss << jsondata;
+  _json_data = NULL;
+  _json_len = 0;
+  _retry = 0;
+  _seq = 0;
+}
+
+/**
+ Construct a event from a buffer without copying it.
+ The buffer must stay valid until compile() has been called.
+ @param jsondata Buffer holding the JSON encoded event.
+ @param len Length of buffer.
+**/
+SSEEvent::SSEEvent(const char* jsondata, size_t len) {
+  _json_data = jsondata;
+  _json_len = len;
   _retry = 0;
+  _seq = 0;
+}
+
+/**
+ Copy a compiled event, the JSON it was compiled from is not copied.
+ @param other Event to copy.
+**/
+SSEEvent::SSEEvent(const SSEEvent& other) {
+  _json_data = NULL;
+  _json_len = 0;
+  _event = other._event;
+  _path = other._path;
+  _data = other._data;
+  _id = other._id;
+  _pubid = other._pubid;
+  _retry = other._retry;
+  _seq = other._seq;
 }
 
 SSEEvent::~SSEEvent() {
@@ -19,7 +66,12 @@ bool SSEEvent::compile() {
   string indata;
 
   try {
-    boost::property_tree::read_json(_json_ss, pt);
+    if (_json_data != NULL) {
+      boost::iostreams::stream<boost::iostreams::array_source> json_is(_json_data, _json_len);
+      boost::property_tree::read_json(json_is, pt);
+    } else {
+      boost::property_tree::read_json(_json_ss, pt);
+    }
 
     if (_path.empty()) { 
       _path = pt.get<std::string>("path"); 
@@ -66,6 +118,82 @@ void SSEEvent::setpath(const string path) {
   _path = path;
 }
 
+void SSEEvent::setid(const string& id) {
+  _id = id;
+}
+
+/**
+ Read a event in the SSE wire format, like the one produced by get().
+ Follows the parsing rules of the spec: lines end in LF, CRLF or CR, the space after the
+ colon is optional, a line without a colon is a field with a empty value and lines
+ starting with a colon are comments.
+ @param text Event as sent to clients.
+**/
+bool SSEEvent::parse(const string& text) {
+  size_t pos = 0;
+
+  _data.clear();
+
+  while (pos < text.size()) {
+    size_t end = text.find_first_of("\r\n", pos);
+    if (end == string::npos) end = text.size();
+
+    const string line = text.substr(pos, end - pos);
+    pos = end + 1;
+    if (end < text.size() && text[end] == '\r' && pos < text.size() && text[pos] == '\n') pos++;
+
+    if (line.empty() || line[0] == ':') continue;
+
+    size_t colon = line.find(':');
+    const string field = line.substr(0, colon);
+    string value;
+
+    if (colon != string::npos) {
+      size_t start = colon + 1;
+      if (start < line.size() && line[start] == ' ') start++;
+      value = line.substr(start);
+    }
+
+    if (field == "id") _id = value;
+    else if (field == "event") _event = value;
+    else if (field == "retry") _retry = atoi(value.c_str());
+    else if (field == "data") _data.push_back(value);
+  }
+
+  return !_data.empty();
+}
+
+void SSEEvent::setevent(const string& event) {
+  _event = event;
+}
+
+void SSEEvent::setretry(int retry) {
+  _retry = retry;
+}
+
+/**
+ Set the event data, each line is sent as a separate data field.
+ @param data Event data.
+ @param len Length of data.
+**/
+void SSEEvent::setdata(const char* data, size_t len) {
+  const char* end = data + len;
+
+  _data.clear();
+
+  while (true) {
+    const char* nl = static_cast<const char*>(memchr(data, '\n', end - data));
+
+    if (nl == NULL) {
+      _data.push_back(string(data, end - data));
+      break;
+    }
+
+    _data.push_back(string(data, nl - data));
+    data = nl + 1;
+  }
+}
+
 const string SSEEvent::getpath() {
   return _path;
 }
@@ -73,3 +201,42 @@ const string SSEEvent::getpath() {
 const string SSEEvent::getid() {
   return _id;
 }
+
+const string SSEEvent::getevent() {
+  return _event;
+}
+
+int SSEEvent::getretry() {
+  return _retry;
+}
+
+/**
+ Returns the event data with the lines joined by newlines, as accepted by setdata().
+**/
+const string SSEEvent::getdata() {
+  return boost::algorithm::join(_data, "\n");
+}
+
+/**
+ Assign a server side sequence number to the event which is sent as the event id.
+ @param seq Sequence number.
+ @param suffix Append the sequence number to the id of the event instead of replacing it.
+**/
+void SSEEvent::setseq(uint64_t seq, bool suffix) {
+  const string seqstr = boost::lexical_cast<string>(seq);
+
+  _seq = seq;
+  _pubid = _id;
+  _id = (suffix && !_id.empty()) ? _id + "." + seqstr : seqstr;
+}
+
+uint64_t SSEEvent::getseq() {
+  return _seq;
+}
+
+/**
+ Returns the id the event was published with, before setseq() changed it.
+**/
+const string SSEEvent::getpubid() {
+  return _pubid;
+}
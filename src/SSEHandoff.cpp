@@ -0,0 +1,370 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <boost/lexical_cast.hpp>
+#include "Common.h"
+#include "SSEConfig.h"
+#include "SSEHandoff.h"
+
+/*
+ Fill in the address of the handoff socket.
+*/
+static bool GetAddress(SSEConfig* config, struct sockaddr_un& sun) {
+  const string path = SSEHandoff::GetPath(config);
+
+  if (path.size() >= sizeof(sun.sun_path)) {
+    LOG(ERROR) << "Handoff socket path too long: " << path;
+    return false;
+  }
+
+  memset(&sun, 0, sizeof(sun));
+  sun.sun_family = AF_UNIX;
+  strncpy(sun.sun_path, path.c_str(), sizeof(sun.sun_path) - 1);
+
+  return true;
+}
+
+/*
+ Create the socket directory if needed. The default directory must be private to us,
+ a configured one is only created.
+*/
+static bool PrepareDir(const string& dir, bool private_dir) {
+  struct stat st;
+
+  if (mkdir(dir.c_str(), 0700) == -1 && errno != EEXIST) {
+    LOG(ERROR) << "Could not create handoff directory " << dir << ": " << strerror(errno);
+    return false;
+  }
+
+  if (!private_dir) return true;
+
+  if (lstat(dir.c_str(), &st) == -1 || !S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077) != 0) {
+    LOG(ERROR) << "Handoff directory " << dir << " must be a directory owned by us that other users can not access.";
+    return false;
+  }
+
+  return true;
+}
+
+/*
+ Check that the process at the other end of a connection runs as our user.
+*/
+static bool IsSameUser(int fd) {
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1) return false;
+
+  return cred.uid == getuid();
+}
+
+static bool ReadAll(int fd, char* buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = read(fd, buf, len);
+
+    if (n == -1 && errno == EINTR) continue;
+    if (n <= 0) return false;
+
+    buf += n;
+    len -= n;
+  }
+
+  return true;
+}
+
+static bool WriteAll(int fd, const char* buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+
+    if (n == -1 && errno == EINTR) continue;
+    if (n <= 0) return false;
+
+    buf += n;
+    len -= n;
+  }
+
+  return true;
+}
+
+SSEHandoff::SSEHandoff(int fd) {
+  _fd = fd;
+}
+
+SSEHandoff::~SSEHandoff() {
+  close(_fd);
+}
+
+/**
+ Directory of the handoff sockets, handoffDir or if it is not set a directory only
+ we can access: ssehub in $XDG_RUNTIME_DIR, otherwise /tmp/ssehub-<uid>.
+ @param config Server configuration.
+*/
+string SSEHandoff::GetDir(SSEConfig* config) {
+  const string& dir = config->GetValue("server.handoffDir");
+  const char* runtimeDir = getenv("XDG_RUNTIME_DIR");
+
+  if (!dir.empty()) return dir;
+  if (runtimeDir != NULL && runtimeDir[0] != '\0') return string(runtimeDir) + "/ssehub";
+
+  return "/tmp/ssehub-" + boost::lexical_cast<string>(getuid());
+}
+
+/**
+ Path of the handoff socket, each worker hands off to the worker with the same id.
+ @param config Server configuration.
+*/
+string SSEHandoff::GetPath(SSEConfig* config) {
+  return GetDir(config) + "/ssehub-handoff-" + config->GetValue("server.workerId") + ".sock";
+}
+
+/**
+ Create the socket a upgraded process connects to.
+ @param config Server configuration.
+ @return Listening socket or -1 on error.
+*/
+int SSEHandoff::Listen(SSEConfig* config) {
+  struct sockaddr_un sun;
+
+  if (!PrepareDir(GetDir(config), config->GetValue("server.handoffDir").empty())) return -1;
+  if (!GetAddress(config, sun)) return -1;
+
+  // Only remove a stale socket, one a running process answers on belongs to another instance.
+  int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  LOG_IF(FATAL, probe == -1) << "Error creating handoff socket: " << strerror(errno);
+
+  int ret = connect(probe, (struct sockaddr*)&sun, sizeof(sun));
+  int err = errno;
+  close(probe);
+
+  if (ret == 0) {
+    LOG(ERROR) << "Handoff socket " << sun.sun_path << " is used by another process, this worker can not be upgraded.";
+    return -1;
+  }
+
+  if (err == ECONNREFUSED) {
+    unlink(sun.sun_path);
+  } else if (err != ENOENT) {
+    LOG(ERROR) << "Could not check handoff socket " << sun.sun_path << ": " << strerror(err);
+    return -1;
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    LOG(ERROR) << "Error creating handoff socket: " << strerror(errno);
+    return -1;
+  }
+
+  if (bind(fd, (struct sockaddr*)&sun, sizeof(sun)) == -1 || chmod(sun.sun_path, 0600) == -1 || listen(fd, 1) == -1) {
+    LOG(ERROR) << "Could not listen on handoff socket " << sun.sun_path << ": " << strerror(errno);
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+/**
+ Accept a upgraded process on the handoff socket.
+ The connection is only used if it comes from our user and starts with a handoff request,
+ so a process probing the socket does not start a handoff.
+ @param listenfd Socket returned by Listen().
+ @return Connection or NULL.
+*/
+SSEHandoff* SSEHandoff::Accept(int listenfd) {
+  struct timeval tv;
+  HandoffMessage msg;
+
+  int fd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC);
+  if (fd == -1) {
+    LOG_IF(ERROR, errno != EAGAIN && errno != EINTR) << "Error accepting handoff connection: " << strerror(errno);
+    return NULL;
+  }
+
+  if (!IsSameUser(fd)) {
+    LOG(WARNING) << "Refusing handoff to a process running as another user.";
+    close(fd);
+    return NULL;
+  }
+
+  tv.tv_sec = HANDOFF_REQUEST_TIMEOUT / 1000;
+  tv.tv_usec = (HANDOFF_REQUEST_TIMEOUT % 1000) * 1000;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+  SSEHandoff* handoff = new SSEHandoff(fd);
+  msg.fd = -1;
+
+  if (!handoff->Receive(msg) || msg.type != HANDOFF_REQUEST) {
+    DLOG(INFO) << "Handoff connection closed without a request.";
+    if (msg.fd != -1) close(msg.fd);
+    delete handoff;
+    return NULL;
+  }
+
+  return handoff;
+}
+
+/**
+ Connect to the worker we are replacing.
+ @param config Server configuration.
+ @return Connection or NULL if no worker is listening.
+*/
+SSEHandoff* SSEHandoff::Connect(SSEConfig* config) {
+  struct sockaddr_un sun;
+
+  if (!GetAddress(config, sun)) return NULL;
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  LOG_IF(FATAL, fd == -1) << "Error creating handoff socket: " << strerror(errno);
+
+  if (connect(fd, (struct sockaddr*)&sun, sizeof(sun)) == -1) {
+    LOG(WARNING) << "Could not connect to handoff socket " << sun.sun_path << ": " << strerror(errno);
+    close(fd);
+    return NULL;
+  }
+
+  if (!IsSameUser(fd)) {
+    LOG(ERROR) << "Handoff socket " << sun.sun_path << " belongs to a process running as another user.";
+    close(fd);
+    return NULL;
+  }
+
+  SSEHandoff* handoff = new SSEHandoff(fd);
+  if (!handoff->Send(HANDOFF_REQUEST, "")) {
+    delete handoff;
+    return NULL;
+  }
+
+  return handoff;
+}
+
+/**
+ Send a message.
+ @param type Message type.
+ @param payload Message payload.
+ @param fd File descriptor to pass along, or -1.
+ @return false if the connection failed.
+*/
+bool SSEHandoff::Send(uint32_t type, const string& payload, int fd) {
+  uint32_t header[2];
+  struct msghdr msg;
+  struct iovec iov;
+  char cbuf[CMSG_SPACE(sizeof(int))];
+
+  header[0] = htonl(type);
+  header[1] = htonl(payload.size());
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = header;
+  iov.iov_len = sizeof(header);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+  if (fd != -1) {
+    memset(cbuf, 0, sizeof(cbuf));
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  }
+
+  ssize_t n;
+  do {
+    n = sendmsg(_fd, &msg, MSG_NOSIGNAL);
+  } while (n == -1 && errno == EINTR);
+
+  // Unix sockets do not split a header this small.
+  if (n != sizeof(header)) {
+    LOG(ERROR) << "Handoff send failed: " << strerror(errno);
+    return false;
+  }
+
+  return WriteAll(_fd, payload.data(), payload.size());
+}
+
+/**
+ Receive the next message.
+ @param msg Filled with the message, msg.fd is -1 if no descriptor was passed.
+ @return false on EOF or error.
+*/
+bool SSEHandoff::Receive(HandoffMessage& msg) {
+  uint32_t header[2];
+  struct msghdr mh;
+  struct iovec iov;
+  char cbuf[CMSG_SPACE(sizeof(int))];
+
+  memset(&mh, 0, sizeof(mh));
+  iov.iov_base = header;
+  iov.iov_len = sizeof(header);
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = cbuf;
+  mh.msg_controllen = sizeof(cbuf);
+
+  ssize_t n;
+  do {
+    n = recvmsg(_fd, &mh, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+  } while (n == -1 && errno == EINTR);
+
+  if (n != sizeof(header)) return false;
+
+  msg.fd = -1;
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&mh);
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+    memcpy(&msg.fd, CMSG_DATA(cmsg), sizeof(int));
+  }
+
+  msg.type = ntohl(header[0]);
+  msg.payload.resize(ntohl(header[1]));
+
+  if (!msg.payload.empty() && !ReadAll(_fd, &msg.payload[0], msg.payload.size())) {
+    if (msg.fd != -1) close(msg.fd);
+    return false;
+  }
+
+  return true;
+}
+
+void HandoffAppend(string& buf, uint32_t value) {
+  value = htonl(value);
+  buf.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void HandoffAppend(string& buf, const string& value) {
+  HandoffAppend(buf, static_cast<uint32_t>(value.size()));
+  buf.append(value);
+}
+
+HandoffReader::HandoffReader(const string& buf) : _buf(buf) {
+  _pos = 0;
+}
+
+bool HandoffReader::Read(uint32_t& value) {
+  if (_buf.size() - _pos < sizeof(value)) return false;
+
+  memcpy(&value, _buf.data() + _pos, sizeof(value));
+  value = ntohl(value);
+  _pos += sizeof(value);
+
+  return true;
+}
+
+bool HandoffReader::Read(string& value) {
+  uint32_t len;
+
+  if (!Read(len) || _buf.size() - _pos < len) return false;
+
+  value.assign(_buf, _pos, len);
+  _pos += len;
+
+  return true;
+}
@@ -1,25 +1,120 @@
 #include <vector>
+#include <string.h>
+#include <sys/time.h>
 #include <boost/bind.hpp>
 #include <boost/thread.hpp>
-#include <pthread.h>
+#include "Common.h"
 #include "SSEServer.h"
 #include "SSEConfig.h"
+#include "SSEEvent.h"
 #include "SSEInputSource.h"
 
 using namespace std;
 
-SSEInputSource::SSEInputSource() {}
+/*
+ Current time in microseconds.
+*/
+static uint64_t NowMicros() {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+SSEInputSource::SSEInputSource() {
+  memset(&_ingest, 0, sizeof(_ingest));
+}
+
 SSEInputSource::~SSEInputSource() {}
 
-void SSEInputSource::Init(SSEServer* server) {
+/**
+ Attach the input source to a server before it is started.
+ @param server Server to broadcast to.
+ @param name Name the source was enabled with, used for its stats.
+*/
+void SSEInputSource::Init(SSEServer* server, const string& name) {
   _server = server;
   _config = server->GetConfig();
+  _name = name;
+  _ingest.windowStart = NowMicros();
 }
 
 void SSEInputSource::Run() {
   _thread = boost::thread(boost::bind(&SSEInputSource::Start, this));
 }
 
-void SSEInputSource::KillThread() {
-  pthread_cancel(_thread.native_handle());
+/**
+ Wait for the input source thread to exit, it stops once shutdown is notified.
+*/
+void SSEInputSource::StopThread() {
+  if (_thread.joinable()) _thread.join();
+}
+
+const string& SSEInputSource::GetName() {
+  return _name;
+}
+
+/**
+ Broadcast a single event.
+ @param event Compiled event.
+ @param received Time in microseconds the event arrived, 0 if unknown.
+ @return false if the channel does not exist or dropped the event.
+*/
+bool SSEInputSource::Publish(SSEEvent& event, uint64_t received) {
+  SSEEventBatch events(1, &event);
+  return PublishBatch(events, received) == 1;
+}
+
+/**
+ Broadcast events in order, looking up the channels for the whole batch at once.
+ @param events Compiled events.
+ @param received Time in microseconds the oldest event arrived, 0 if unknown.
+ @param delivered If not NULL filled with whether each event was broadcast.
+ @return Number of events broadcast.
+*/
+size_t SSEInputSource::PublishBatch(const SSEEventBatch& events, uint64_t received, vector<bool>* delivered) {
+  if (events.empty()) return 0;
+
+  if (received == 0) received = NowMicros();
+
+  size_t n = _server->Broadcast(events, delivered);
+  uint64_t now = NowMicros();
+
+  _ingest.events += n;
+  _ingest.rejected += events.size() - n;
+  INC_LONG(_ingest.batches);
+  _ingest.lagAvg += INPUTSOURCE_LAG_WEIGHT * ((double)(now - received) - _ingest.lagAvg);
+
+  return n;
+}
+
+/**
+ Count input that could not be turned into a event.
+*/
+void SSEInputSource::CountError() {
+  INC_LONG(_ingest.errors);
+}
+
+/**
+ Add the ingest counters to the stats.
+ The rate is that of the last completed window of INPUTSOURCE_RATE_WINDOW seconds,
+ so it does not depend on how often or by how many the stats are read.
+*/
+void SSEInputSource::GetIngestStats(boost::property_tree::ptree& pt) {
+  const string prefix = "inputs." + _name + ".";
+  uint64_t now = NowMicros();
+  uint64_t events = _ingest.events;
+
+  if (now - _ingest.windowStart >= (uint64_t)INPUTSOURCE_RATE_WINDOW * 1000000) {
+    _ingest.rate = (double)(events - _ingest.windowEvents) * 1000000 / (now - _ingest.windowStart);
+    _ingest.windowEvents = events;
+    _ingest.windowStart = now;
+  }
+
+  pt.put(prefix + "events", events);
+  pt.put(prefix + "rejected", _ingest.rejected);
+  pt.put(prefix + "errors", _ingest.errors);
+  pt.put(prefix + "batches", _ingest.batches);
+  pt.put(prefix + "rate", (uint64_t)_ingest.rate);
+  pt.put(prefix + "lag_us", (uint64_t)_ingest.lagAvg);
 }
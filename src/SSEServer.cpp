@@ -1,6 +1,11 @@
 #include <stdlib.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/time.h>
+#include <boost/algorithm/string.hpp>
 #include <boost/foreach.hpp>
 #include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
 #include "Common.h"
 #include "SSEServer.h"
 #include "SSEClient.h"
@@ -9,7 +14,13 @@
 #include "SSEEvent.h"
 #include "SSEConfig.h"
 #include "SSEChannel.h"
+#include "ShutdownNotifier.h"
+#include "EventRecorder.h"
 #include "InputSources/amqp/AmqpInputSource.h"
+#include "InputSources/unixsocket/UnixSocketInputSource.h"
+#include "InputSources/sharedring/SharedRingInputSource.h"
+#include "InputSources/redis/RedisInputSource.h"
+#include "InputSources/file/FileInputSource.h"
 
 using namespace std;
 
@@ -19,6 +30,8 @@ using namespace std;
 */
 SSEServer::SSEServer(SSEConfig *config) {
   _config = config;
+  _handoffsocket = -1;
+  _eventring = NULL;
   stats.Init(_config, this);
 }
 
@@ -28,8 +41,11 @@ SSEServer::SSEServer(SSEConfig *config) {
 SSEServer::~SSEServer() {
   DLOG(INFO) << "SSEServer destructor called.";
 
-  pthread_cancel(_routerthread.native_handle());
-  close(_serversocket);
+  if (_routerthread.joinable()) _routerthread.join();
+  BOOST_FOREACH(int fd, _serversockets) {
+    close(fd);
+  }
+  if (_handoffsocket != -1) close(_handoffsocket);
   close(_efd);
 }
 
@@ -38,18 +54,42 @@ SSEServer::~SSEServer() {
   @param event Reference to SSEEvent to broadcast.
 **/
 bool SSEServer::Broadcast(SSEEvent& event) {
-  SSEChannel* ch;
-  const string& chName = event.getpath();
+  SSEEventBatch events(1, &event);
+  return Broadcast(events) == 1;
+}
 
-  ch = GetChannel(chName, _config->GetValueBool("server.allowUndefinedChannels"));
-  if (ch == NULL) {
-    LOG(ERROR) << "Discarding event recieved on invalid channel: " << chName;
-    return false;
-  }
+/**
+  Broadcast events in order, the channel is only looked up again when it changes.
+  @param events Events to broadcast.
+  @param delivered If not NULL filled with whether each event was accepted by its channel.
+  @return Number of events accepted.
+**/
+size_t SSEServer::Broadcast(const SSEEventBatch& events, vector<bool>* delivered) {
+  const bool create = _config->GetValueBool("server.allowUndefinedChannels");
+  SSEChannel* ch = NULL;
+  string chName;
+  size_t n = 0;
 
-  ch->BroadcastEvent(event);
+  if (delivered != NULL) delivered->assign(events.size(), false);
 
-  return true;
+  for (size_t i = 0; i < events.size(); i++) {
+    const string path = events[i]->getpath();
+
+    if (i == 0 || path != chName) {
+      chName = path;
+      ch = GetChannel(chName, create);
+      LOG_IF(ERROR, ch == NULL) << "Discarding event recieved on invalid channel: " << chName;
+    }
+
+    if (ch == NULL) continue;
+
+    if (!ch->BroadcastEvent(*events[i])) continue;
+    if (_recorder) _recorder->Record(chName, *events[i]);
+    if (delivered != NULL) (*delivered)[i] = true;
+    n++;
+  }
+
+  return n;
 }
 
 /**
@@ -58,130 +98,429 @@ bool SSEServer::Broadcast(SSEEvent& event) {
   @param chConf Reference to ChannelConfig object to check against.
 **/
 bool SSEServer::IsAllowedToPublish(SSEClient* client, const ChannelConfig& chConf) {
-  if (chConf.allowedPublishers.size() < 1) return true;
-
-  BOOST_FOREACH(const iprange_t& range, chConf.allowedPublishers) {
-    if ((client->GetSockAddr() & range.mask) == (range.range & range.mask)) {
-      LOG(INFO) << "Allowing publish to " << chConf.id << " from client " << client->GetIP();
-      return true;
-    }
+  if (!chConf.allowedPublishers || chConf.allowedPublishers->Empty() || chConf.allowedPublishers->Match(client->GetSockAddr())) {
+    INC_LONG(stats.publish_allowed);
+    return true;
   }
 
+  INC_LONG(stats.publish_denied);
   DLOG(INFO) << "Dissallowing publish to " << chConf.id << " from client " << client->GetIP();
   return false;
 }
 
+/**
+ Publish a event received from a client.
+ Returns the HTTP status code to respond with.
+ @param client Pointer to SSEClient publishing the event.
+ @param event Event to publish.
+ @param validEvent Result of compiling the event.
+ **/
+int SSEServer::Publish(SSEClient* client, SSEEvent& event, bool validEvent) {
+  const string& chName = event.getpath();
+
+  // Check if channel exist.
+  SSEChannel* ch = GetChannel(chName);
+
+  if (ch == NULL) {
+    // Handle creation of new channels.
+    if (!_config->GetValueBool("server.allowUndefinedChannels")) return 404;
+    if (!IsAllowedToPublish(client, _config->GetDefaultChannelConfig())) return 403;
+    if (!validEvent) return 400;
+
+    // Create the channel.
+    ch = GetChannel(chName, true);
+    if (ch == NULL) return 500;
+  } else {
+    // Handle existing channels.
+    if (!IsAllowedToPublish(client, ch->GetConfig())) return 403;
+    if (!validEvent) return 400;
+  }
+
+  // Broacast the event, never wait for a full ingest queue on the router thread.
+  if (!ch->BroadcastEvent(event, false)) return 503;
+  if (_recorder) _recorder->Record(chName, event);
+
+  return 200;
+}
+
 /**
  Handle POST requests.
  @param client Pointer to SSEClient initiating the request.
  @param req Pointer to HTTPRequest.
  **/
 void SSEServer::PostHandler(SSEClient* client, HTTPRequest* req) {
-  SSEEvent event(req->GetPostData());
-  bool validEvent;
-  const string& chName = req->GetPath().substr(1);
+  const string& body = req->GetPostData();
+  SSEEvent event(body.data(), body.size());
 
   // Set the event path to the endpoint we recieved the POST on.
-  event.setpath(chName);
+  event.setpath(req->GetPath().substr(1).str());
 
-  // Validate the event.
-  validEvent = event.compile();
+  HTTPResponse res(Publish(client, event, event.compile()), "", !req->IsKeepAlive());
+  client->Send(res.Get());
+}
 
-  // Check if channel exist.
-  SSEChannel* ch = GetChannel(chName);
+/**
+ Handle POST requests to /batch.
+ The body holds one JSON event per line, each with the path of the channel to publish to.
+ The response holds the status code for each event on its own line in the same order.
+ @param client Pointer to SSEClient initiating the request.
+ @param req Pointer to HTTPRequest.
+ **/
+void SSEServer::BatchHandler(SSEClient* client, HTTPRequest* req) {
+  const string& body = req->GetPostData();
+  HTTPResponse res(200, "", !req->IsKeepAlive());
+  string result;
+  size_t pos = 0;
+
+  while (pos < body.size()) {
+    size_t end = body.find('\n', pos);
+    if (end == string::npos) end = body.size();
+
+    // Skip empty lines.
+    if (end > pos && !(end == pos + 1 && body[pos] == '\r')) {
+      SSEEvent event(body.data() + pos, end - pos);
+      bool validEvent = event.compile() && !event.getpath().empty();
+
+      result.append(boost::lexical_cast<string>(Publish(client, event, validEvent)));
+      result.push_back('\n');
+    }
 
-  if (ch == NULL) {
-    // Handle creation of new channels.
-    if (_config->GetValueBool("server.allowUndefinedChannels")) {
-      if (!IsAllowedToPublish(client, _config->GetDefaultChannelConfig())) {
-        HTTPResponse res(403);
-        client->Send(res.Get());
-        return;
-      }
+    pos = end + 1;
+  }
+
+  res.SetHeader("Content-Type", "text/plain");
+  res.SetBody(result);
+  client->Send(res.Get());
+}
+
+/**
+  Start the server.
+*/
+void SSEServer::Run() {
+  vector<HandoffChannel> handoffChannels;
+
+  if (_config->GetValueBool("server.upgrade")) ReceiveHandoff(handoffChannels);
+
+  InitSocket();
+  _handoffsocket = SSEHandoff::Listen(_config);
+  InitChannels();
+  RestoreHandoff(handoffChannels);
+  InitRecorder();
+  InitInputSources();
+
+  _routerthread = boost::thread(&SSEServer::ClientRouterLoop, this);
+  AcceptLoop();
+  Shutdown();
+}
 
-      if (!validEvent) {
-        HTTPResponse res(400);
-        client->Send(res.Get());
-        return;
+/**
+  Stop accepting new clients and publishers and drain the connected clients.
+  Called when AcceptLoop returns after shutdown has been notified.
+*/
+void SSEServer::Shutdown() {
+  struct timeval tv;
+  bool handoffClients = _config->GetValueBool("server.handoffClients");
+  bool handedOff = false;
+
+  LOG_IF(INFO, !_handoff) << "Shutting down, draining clients.";
+
+  BOOST_FOREACH(int fd, _serversockets) {
+    close(fd);
+  }
+  _serversockets.clear();
+
+  if (_routerthread.joinable()) _routerthread.join();
+
+  // Input sources stop and wait for their threads in the destructor.
+  _inputsources.clear();
+
+  // Nothing is published anymore, write out the rest of the capture.
+  if (_recorder) _recorder->Stop();
+
+  if (_handoff) {
+    LOG(INFO) << "Handing off to upgraded process.";
+    handedOff = true;
+
+    BOOST_FOREACH(SSEChannelPtr& ch, _channels) {
+      if (!ch->Handoff(*_handoff, handoffClients)) {
+        LOG(ERROR) << "Handoff failed, draining clients instead.";
+        handedOff = false;
+        break;
       }
+    }
+  }
 
-      // Create the channel.
-      ch = GetChannel(chName, true);
-    } else {
-      HTTPResponse res(404);
-      client->Send(res.Get());
-      return;
+  // Clients handed off are left untouched, closing our copy of the socket does not disconnect them.
+  if (!handedOff || !handoffClients) {
+    gettimeofday(&tv, NULL);
+    uint64_t deadline = ((uint64_t)tv.tv_sec + _config->GetValueInt("server.shutdownTimeout")) * 1000000 + tv.tv_usec;
+
+    BOOST_FOREACH(SSEChannelPtr& ch, _channels) {
+      ch->Shutdown(deadline);
     }
-  } else {
-    // Handle existing channels.
-    if (!IsAllowedToPublish(client, ch->GetConfig())) {
-      HTTPResponse res(403);
-      client->Send(res.Get());
-      return;
+  }
+
+  // The new process takes over once it has seen this and we have exited.
+  if (handedOff) _handoff->Send(HANDOFF_DONE, "");
+
+  LOG(INFO) << "Exiting.";
+}
+
+/**
+  Take over from the running worker with the same id when started with --upgrade.
+  Listening sockets are used instead of binding new ones, channel state is kept
+  until we know the old worker has exited and released its caches.
+  @param channels Filled with the channels and clients to restore.
+*/
+void SSEServer::ReceiveHandoff(vector<HandoffChannel>& channels) {
+  boost::shared_ptr<SSEHandoff> handoff(SSEHandoff::Connect(_config));
+  vector<int> fds;
+  HandoffMessage msg;
+  bool done = false;
+
+  if (!handoff) {
+    LOG(WARNING) << "No running worker to upgrade from, starting fresh.";
+    return;
+  }
+
+  LOG(INFO) << "Receiving handoff from running worker.";
+
+  // The old worker closes the connection when it exits.
+  while (handoff->Receive(msg)) {
+    if (msg.fd != -1) fds.push_back(msg.fd);
+
+    switch (msg.type) {
+      case HANDOFF_LISTENER:
+        if (msg.fd != -1) _serversockets.push_back(msg.fd);
+        break;
+
+      case HANDOFF_CHANNEL:
+        channels.push_back(HandoffChannel());
+        channels.back().id = msg.payload;
+        break;
+
+      case HANDOFF_EVENT:
+        if (!channels.empty()) channels.back().events.push_back(msg.payload);
+        break;
+
+      case HANDOFF_CLIENT:
+        if (!channels.empty() && msg.fd != -1) channels.back().clients.push_back(make_pair(msg.fd, msg.payload));
+        break;
+
+      case HANDOFF_DONE:
+        done = true;
+        break;
     }
+  }
 
-    if (!validEvent) {
-      HTTPResponse res(400);
-      client->Send(res.Get());
-      return;
+  // The old worker keeps serving or drains its clients itself if the handoff did not complete.
+  if (!done) {
+    LOG(ERROR) << "Handoff did not complete, starting fresh.";
+    BOOST_FOREACH(int fd, fds) {
+      close(fd);
     }
+    _serversockets.clear();
+    channels.clear();
+    return;
   }
 
-  // Broacast the event.
-  Broadcast(event);
+  LOG(INFO) << "Received " << _serversockets.size() << " listening sockets and " << channels.size() << " channels.";
+}
 
-  // Event broadcasted OK.
-  HTTPResponse res(200);
-  client->Send(res.Get());
+/**
+  Restore channel caches and clients received by ReceiveHandoff.
+  @param channels Channels to restore.
+*/
+void SSEServer::RestoreHandoff(vector<HandoffChannel>& channels) {
+  BOOST_FOREACH(HandoffChannel& hc, channels) {
+    SSEChannel* ch = GetChannel(hc.id, _config->GetValueBool("server.allowUndefinedChannels"));
+    size_t adopted = 0;
+
+    if (ch == NULL) {
+      LOG(WARNING) << "Channel " << hc.id << " no longer exists, dropping its " << hc.clients.size() << " clients.";
+      for (size_t i = 0; i < hc.clients.size(); i++) close(hc.clients[i].first);
+      continue;
+    }
+
+    BOOST_FOREACH(const string& event, hc.events) {
+      ch->RestoreEvent(event);
+    }
+
+    for (size_t i = 0; i < hc.clients.size(); i++) {
+      struct sockaddr_storage csin;
+      socklen_t clen = sizeof(csin);
+      int fd = hc.clients[i].first;
+
+      // Skip clients that disconnected during the handoff.
+      if (getpeername(fd, (struct sockaddr*)&csin, &clen) == -1) {
+        close(fd);
+        continue;
+      }
+
+      SSEClient* client = new SSEClient(fd, (struct sockaddr*)&csin, clen);
+      client->DeleteHttpReq();
+
+      if (!client->RestoreState(hc.clients[i].second)) {
+        LOG(ERROR) << "Invalid handoff state for client " << client->GetIP() << ".";
+        client->Destroy();
+        continue;
+      }
+
+      if (ch->AdoptClient(client)) adopted++;
+    }
+
+    LOG(INFO) << "Channel " << hc.id << ": restored " << hc.events.size() << " cached events and " << adopted << " clients.";
+  }
+
+  channels.clear();
 }
 
+static SSEInputSource* CreateAmqpInputSource(SSEServer* server) {
+  // With a shared event ring only the first worker consumes from AMQP and passes the events on.
+  if (server->GetEventRing() != NULL && server->GetConfig()->GetValueInt("server.workerId") != 0) {
+    return new SharedRingInputSource(server->GetEventRing());
+  }
+
+  return new AmqpInputSource();
+}
+
+static SSEInputSource* CreateUnixSocketInputSource(SSEServer* server) {
+  return new UnixSocketInputSource();
+}
+
+static SSEInputSource* CreateRedisInputSource(SSEServer* server) {
+  return new RedisInputSource();
+}
+
+static SSEInputSource* CreateFileInputSource(SSEServer* server) {
+  return new FileInputSource();
+}
+
+/*
+ Input sources that can be enabled in the config, any number of them can run at once.
+*/
+static const SSEInputSourceType inputSourceTypes[] = {
+  {"amqp",       "amqp.enabled",       CreateAmqpInputSource},
+  {"unixsocket", "unixsocket.enabled", CreateUnixSocketInputSource},
+  {"redis",      "redis.subscribe",    CreateRedisInputSource},
+  {"file",       "file.enabled",       CreateFileInputSource}
+};
+
 /**
-  Start the server.
+  Start recording ingested events if enabled, each worker writes its own capture file.
 */
-void SSEServer::Run() {
-  InitSocket();
+void SSEServer::InitRecorder() {
+  if (!_config->GetValueBool("recorder.enabled")) return;
 
-  if (_config->GetValueBool("amqp.enabled")) {
-      _datasource = boost::shared_ptr<SSEInputSource>(new AmqpInputSource());
-      _datasource->Init(this);
-      _datasource->Run();
+  const string path = boost::replace_all_copy(_config->GetValue("recorder.path"), "{worker}",
+    _config->GetValue("server.workerId"));
+
+  _recorder.reset(new EventRecorder());
+  if (!_recorder->Start(path, (size_t)_config->GetValueInt("recorder.bufferSize") * 1024 * 1024)) {
+    _recorder.reset();
   }
+}
 
-  InitChannels();
+/**
+  Start the enabled input sources, each on its own thread.
+*/
+void SSEServer::InitInputSources() {
+  for (size_t i = 0; i < sizeof(inputSourceTypes) / sizeof(inputSourceTypes[0]); i++) {
+    const SSEInputSourceType& type = inputSourceTypes[i];
 
-  _routerthread = boost::thread(&SSEServer::ClientRouterLoop, this);
-  AcceptLoop();
+    if (!_config->GetValueBool(type.enableKey)) continue;
+
+    boost::shared_ptr<SSEInputSource> source(type.create(this));
+    source->Init(this, type.name);
+    _inputsources.push_back(source);
+
+    LOG(INFO) << "Starting input source " << type.name << ".";
+  }
+
+  BOOST_FOREACH(const boost::shared_ptr<SSEInputSource>& source, _inputsources) {
+    source->Run();
+  }
 }
 
 /**
-  Initialize server socket.
+  Initialize server sockets, one for each address in server.bindip.
 */
 void SSEServer::InitSocket() {
-  int on = 1;
+  vector<string> addresses;
+  bool haveIPv4 = false;
 
   /* Ignore SIGPIPE. */
   signal(SIGPIPE, SIG_IGN);
 
+  boost::split(addresses, _config->GetValue("server.bindip"), boost::is_any_of(", "), boost::token_compress_on);
+
+  BOOST_FOREACH(const string& address, addresses) {
+    if (address.find(':') == string::npos && !address.empty()) haveIPv4 = true;
+  }
+
+  // IPv6 sockets also accept IPv4 unless we have a separate IPv4 socket for the same port.
+  // Sockets handed off by the worker we replaced are used as they are.
+  if (_serversockets.empty()) {
+    BOOST_FOREACH(const string& address, addresses) {
+      if (address.empty()) continue;
+      _serversockets.push_back(Listen(address, haveIPv4));
+    }
+  }
+
+  LOG_IF(FATAL, _serversockets.empty()) << "No addresses to listen on in server.bindip.";
+
+  _efd = epoll_create1(0);
+  LOG_IF(FATAL, _efd == -1) << "epoll_create1 failed.";
+
+  // Wake up the router thread on shutdown.
+  struct epoll_event ev;
+  ev.events   = EPOLLIN;
+  ev.data.ptr = NULL;
+  epoll_ctl(_efd, EPOLL_CTL_ADD, serverShutdown.GetFd(), &ev);
+}
+
+/**
+  Create a listening socket.
+  @param address IPv4 or IPv6 address to bind to.
+  @param v6only Only accept IPv6 connections on IPv6 sockets.
+  @return Socket file descriptor.
+*/
+int SSEServer::Listen(const string& address, bool v6only) {
+  struct addrinfo hints;
+  struct addrinfo* ai;
+  int on = 1;
+  int fd;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family   = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags    = AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV;
+
+  int ret = getaddrinfo(address.c_str(), _config->GetValue("server.port").c_str(), &hints, &ai);
+  LOG_IF(FATAL, ret != 0) << "Invalid bind address " << address << ": " << gai_strerror(ret);
+
   /* Set up listening socket. */
-  _serversocket = socket(AF_INET, SOCK_STREAM, 0);
-  LOG_IF(FATAL, _serversocket == -1) << "Error creating listening socket.";
+  fd = socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  LOG_IF(FATAL, fd == -1) << "Error creating listening socket for " << address << ": " << strerror(errno);
 
   /* Reuse port and address. */
-  setsockopt(_serversocket, SOL_SOCKET, SO_REUSEPORT, (const char*)&on, sizeof(on));
+  setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (const char*)&on, sizeof(on));
 
-  memset((char*)&_sin, '\0', sizeof(_sin));
-  _sin.sin_family  = AF_INET;
-  _sin.sin_port  = htons(_config->GetValueInt("server.port"));
+  if (ai->ai_family == AF_INET6) {
+    int only = v6only ? 1 : 0;
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, (const char*)&only, sizeof(only));
+  }
 
-  LOG_IF(FATAL, (bind(_serversocket, (struct sockaddr*)&_sin, sizeof(_sin))) == -1) <<
-    "Could not bind server socket to " << _config->GetValue("server.bindip") << ":" << _config->GetValue("server.port");
+  LOG_IF(FATAL, (bind(fd, ai->ai_addr, ai->ai_addrlen)) == -1) <<
+    "Could not bind server socket to " << address << ":" << _config->GetValue("server.port");
 
-  LOG_IF(FATAL, (listen(_serversocket, 0)) == -1) << "Call to listen() failed.";
+  freeaddrinfo(ai);
 
-  LOG(INFO) << "Listening on " << _config->GetValue("server.bindip")  << ":" << _config->GetValue("server.port");
+  LOG_IF(FATAL, (listen(fd, SOMAXCONN)) == -1) << "Call to listen() failed.";
 
-  _efd = epoll_create1(0);
-  LOG_IF(FATAL, _efd == -1) << "epoll_create1 failed.";
+  LOG(INFO) << "Listening on " << address << ":" << _config->GetValue("server.port");
+
+  return fd;
 }
 
 /**
@@ -202,6 +541,9 @@ SSEChannel* SSEServer::GetChannel(const string id, bool create) {
   SSEChannelList::iterator it;
   SSEChannel* ch = NULL;
 
+  // Input sources look up and create channels from their own threads.
+  boost::mutex::scoped_lock lock(_channels_lock);
+
   for (it = _channels.begin(); it != _channels.end(); it++) {
     SSEChannel* chan = static_cast<SSEChannel*>((*it).get());
     if (chan->GetId().compare(id) == 0) {
@@ -218,12 +560,39 @@ SSEChannel* SSEServer::GetChannel(const string id, bool create) {
 }
 
 /**
-  Returns a const reference to the channel list.
+  Returns a copy of the channel list, input sources may add channels while it is used.
 */
-const SSEChannelList& SSEServer::GetChannelList() {
+SSEChannelList SSEServer::GetChannelList() {
+  boost::mutex::scoped_lock lock(_channels_lock);
   return _channels;
 }
 
+/**
+  Returns the event recorder, or a empty pointer if recording is disabled.
+*/
+const boost::shared_ptr<EventRecorder>& SSEServer::GetRecorder() {
+  return _recorder;
+}
+
+/**
+  Returns a const reference to the running input sources.
+*/
+const SSEInputSourceList& SSEServer::GetInputSources() {
+  return _inputsources;
+}
+
+/**
+  Set the ring AMQP events are shared through between workers, created before forking.
+  @param ring Shared event ring.
+*/
+void SSEServer::SetEventRing(SharedEventRing* ring) {
+  _eventring = ring;
+}
+
+SharedEventRing* SSEServer::GetEventRing() {
+  return _eventring;
+}
+
 /**
   Returns the SSEConfig object.
 */
@@ -235,27 +604,65 @@ SSEConfig* SSEServer::GetConfig() {
   Accept new client connections.
 */
 void SSEServer::AcceptLoop() {
-  while(!stop) {
-    struct sockaddr_in csin;
+  vector<struct pollfd> pfds(_serversockets.size() + 2);
+  size_t numListeners = _serversockets.size();
+  size_t next = 0;
+
+  for (size_t i = 0; i < numListeners; i++) {
+    pfds[i].fd     = _serversockets[i];
+    pfds[i].events = POLLIN;
+  }
+
+  // Upgraded process connecting, ignored by poll if we could not create the socket.
+  pfds[numListeners].fd     = _handoffsocket;
+  pfds[numListeners].events = POLLIN;
+
+  // Last entry wakes us up on shutdown.
+  pfds[numListeners + 1].fd     = serverShutdown.GetFd();
+  pfds[numListeners + 1].events = POLLIN;
+
+  while(!serverShutdown.IsStopping()) {
+    struct sockaddr_storage csin;
     socklen_t clen;
     int tmpfd;
 
+    // Wait until one of the listening sockets has a pending connection.
+    if (next == 0) {
+      if (poll(&pfds[0], pfds.size(), -1) == -1) {
+        LOG_IF(ERROR, errno != EINTR) << "Error in poll(): " << strerror(errno);
+        continue;
+      }
+
+      if ((pfds[numListeners].revents & POLLIN) && StartHandoff()) break;
+    }
+
+    // Accept from each ready socket in turn until it is drained.
+    if (!(pfds[next].revents & POLLIN)) {
+      next = (next + 1) % numListeners;
+      continue;
+    }
+
     memset((char*)&csin, '\0', sizeof(csin));
     clen = sizeof(csin);
 
     // Accept the connection.
-    tmpfd = accept(_serversocket, (struct sockaddr*)&csin, &clen);
+    tmpfd = accept(pfds[next].fd, (struct sockaddr*)&csin, &clen);
 
     /* Got an error ? Handle it. */
     if (tmpfd == -1) {
       switch (errno) {
+        case EAGAIN:
+          pfds[next].revents = 0;
+          next = (next + 1) % numListeners;
+        break;
+
         case EMFILE:
           LOG(ERROR) << "All connections available used. Cannot accept more connections.";
           usleep(100000);
         break;
 
         default:
-          LOG_IF(ERROR, !stop) << "Error in accept(): " << strerror(errno);
+          LOG_IF(ERROR, !serverShutdown.IsStopping()) << "Error in accept(): " << strerror(errno);
       }
 
       continue; /* Try again. */
@@ -265,7 +672,7 @@ void SSEServer::AcceptLoop() {
     fcntl(tmpfd, F_SETFL, O_NONBLOCK);
 
     // Add it to our epoll eventlist.
-    SSEClient* client = new SSEClient(tmpfd, &csin);
+    SSEClient* client = new SSEClient(tmpfd, (struct sockaddr*)&csin, clen);
 
     struct epoll_event event;
     event.events = EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR;
@@ -280,6 +687,34 @@ void SSEServer::AcceptLoop() {
   }
 }
 
+/**
+  Accept a upgraded process on the handoff socket and pass it our listening sockets.
+  The channels are handed off by Shutdown once the other threads have stopped.
+  @return true if we are handing off and should stop accepting.
+*/
+bool SSEServer::StartHandoff() {
+  _handoff.reset(SSEHandoff::Accept(_handoffsocket));
+  if (!_handoff) return false;
+
+  LOG(INFO) << "Upgrade requested, handing off listening sockets.";
+
+  BOOST_FOREACH(int s, _serversockets) {
+    if (!_handoff->Send(HANDOFF_LISTENER, "", s)) {
+      LOG(ERROR) << "Handoff failed, continuing to serve.";
+      _handoff.reset();
+      return false;
+    }
+  }
+
+  // The new process replaces our socket once we are gone, it must not find us answering on it.
+  close(_handoffsocket);
+  _handoffsocket = -1;
+
+  serverShutdown.Notify();
+
+  return true;
+}
+
 /**
  Removes  socket from epoll fd set and deletes SSEClient object.
  @param client SSEClient to remove.
@@ -289,11 +724,111 @@ void SSEServer::RemoveClient(SSEClient* client) {
   client->Destroy();
 }
 
+/**
+  Act on the state of a parsed request.
+  Returns true if a POST request was handled and the connection should be kept open for the next request.
+  @param client Client that sent the request.
+  @param req The request.
+  @param reqRet Status returned by the request parser.
+*/
+bool SSEServer::ProcessRequest(SSEClient* client, HTTPRequest* req, HttpReqStatus reqRet) {
+  switch(reqRet) {
+    case HTTP_REQ_INCOMPLETE: return false;
+
+    case HTTP_REQ_FAILED:
+     RemoveClient(client);
+     stats.invalid_http_req++;
+     return false;
+
+    case HTTP_REQ_TO_BIG:
+     RemoveClient(client);
+     stats.oversized_http_req++;
+     return false;
+
+    case HTTP_REQ_OK: break;
+
+    case HTTP_REQ_POST_INVALID_LENGTH:
+      { HTTPResponse res(411, "", false); client->Send(res.Get()); }
+      RemoveClient(client);
+      return false;
+
+    case HTTP_REQ_POST_TOO_LARGE:
+      DLOG(INFO) << "Client " <<  client->GetIP() << " sent too much POST data.";
+      { HTTPResponse res(413, "", false); client->Send(res.Get()); }
+      RemoveClient(client);
+      return false;
+
+    case HTTP_REQ_POST_START:
+      if (!_config->GetValueBool("server.enablePost")) {
+        { HTTPResponse res(400, "", false); client->Send(res.Get()); }
+        RemoveClient(client);
+      } else if (req->GetHeader("Expect").iequals("100-continue")) {
+        { HTTPResponse res(100, "", false); client->Send(res.Get()); }
+      }
+      return false;
+
+    case HTTP_REQ_POST_INCOMPLETE: return false;
+
+    case HTTP_REQ_POST_OK:
+      if (!_config->GetValueBool("server.enablePost")) {
+        { HTTPResponse res(400, "", false); client->Send(res.Get()); }
+        RemoveClient(client);
+        return false;
+      }
+
+      if (req->GetPath() == "/batch") {
+        BatchHandler(client, req);
+      } else {
+        PostHandler(client, req);
+      }
+
+      // Keep the connection open for the next request if the publisher asked for it.
+      if (!req->IsKeepAlive()) {
+        RemoveClient(client);
+        return false;
+      }
+
+      return true;
+  }
+
+  if (!req->GetPath().empty()) {
+    // Handle /stats endpoint.
+    if (req->GetPath() == "/stats") {
+      stats.SendToClient(client);
+      return false;
+    } else if (req->GetPath() == "/") {
+      HTTPResponse res;
+      res.SetBody("OK\n");
+      client->Send(res.Get());
+      RemoveClient(client);
+      return false;
+    }
+
+    string chName = req->GetPath().substr(1).str();
+    SSEChannel *ch = GetChannel(chName);
+
+    DLOG(INFO) << "Channel: " << chName;
+
+    if (ch != NULL) {
+      epoll_ctl(_efd, EPOLL_CTL_DEL, client->Getfd(), NULL);
+      ch->AddClient(client, req);
+    } else {
+      HTTPResponse res;
+      res.SetStatus(404);
+      res.SetBody("Channel does not exist.\n");
+      client->Send(res.Get());
+      RemoveClient(client);
+    }
+  }
+
+  return false;
+}
+
 /**
   Read request and route client to the requested channel.
 */
 void SSEServer::ClientRouterLoop() {
-  char buf[4096];
+  char buf[HTTPREQ_BUFSIZ];
   struct epoll_event* eventList;
   int maxEvents = 1024;
   
@@ -301,13 +836,16 @@ void SSEServer::ClientRouterLoop() {
 
   LOG(INFO) << "Started client router thread.";
 
-  while(1) {
+  while(!serverShutdown.IsStopping()) {
     int n = epoll_wait(_efd, eventList, maxEvents, -1);
     
     for (int i = 0; i < n; i++) {
       SSEClient* client;
       client = static_cast<SSEClient*>(eventList[i].data.ptr);
 
+      // Woken up by the shutdown notifier.
+      if (client == NULL) continue;
+
       // Close socket if an error occurs.
       if (eventList[i].events & EPOLLERR) {
         DLOG(WARNING) << "Error occurred while reading data from client " << client->GetIP() << ".";
@@ -322,8 +860,26 @@ void SSEServer::ClientRouterLoop() {
         continue;
       }
 
-      // Read from client.
-      size_t len = client->Read(&buf, 4096);
+      HTTPRequest* req = client->GetHttpReq();
+      HttpReqStatus reqRet = HTTP_REQ_INCOMPLETE;
+      ssize_t len;
+
+      if (req->IsReadingPostData()) {
+        // Read POST data straight into the request body until we have it all or the socket is drained.
+        do {
+          size_t avail;
+          char* dst = req->GetPostDataBuffer(avail);
+          len = client->Read(dst, avail);
+          if (len <= 0) break;
+          reqRet = req->PostDataRead(len);
+        } while (reqRet == HTTP_REQ_POST_INCOMPLETE);
+
+        if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+      } else {
+        // Read from client.
+        len = client->Read(&buf, sizeof(buf));
+        if (len > 0) reqRet = req->Parse(buf, len);
+      }
 
       if (len <= 0) {
         stats.router_read_errors++;
@@ -331,88 +887,15 @@ void SSEServer::ClientRouterLoop() {
         continue;
       }
 
-      buf[len] = '\0';
+      // Handle the request and any requests pipelined after it on a persistent connection.
+      while (ProcessRequest(client, req, reqRet)) {
+        size_t pipelined = req->GetPipelinedData(buf, sizeof(buf));
 
-      // Parse the request.
-      HTTPRequest* req = client->GetHttpReq();
-      HttpReqStatus reqRet = req->Parse(buf, len);
-
-      switch(reqRet) {
-        case HTTP_REQ_INCOMPLETE: continue;
-
-        case HTTP_REQ_FAILED:
-         RemoveClient(client);
-         stats.invalid_http_req++;
-         continue;
-
-        case HTTP_REQ_TO_BIG:
-         RemoveClient(client);
-         stats.oversized_http_req++;
-         continue;
-
-        case HTTP_REQ_OK: break;
-
-        case HTTP_REQ_POST_INVALID_LENGTH:
-          { HTTPResponse res(411, "", false); client->Send(res.Get()); }
-          RemoveClient(client);
-          continue;
-
-        case HTTP_REQ_POST_TOO_LARGE:
-          DLOG(INFO) << "Client " <<  client->GetIP() << " sent too much POST data.";
-          { HTTPResponse res(413, "", false); client->Send(res.Get()); }
-          RemoveClient(client);
-          continue;
-
-        case HTTP_REQ_POST_START:
-          if (!_config->GetValueBool("server.enablePost")) {
-            { HTTPResponse res(400, "", false); client->Send(res.Get()); }
-            RemoveClient(client);
-          } else {
-            { HTTPResponse res(100, "", false); client->Send(res.Get()); }
-          }
-          continue;
-
-        case HTTP_REQ_POST_INCOMPLETE: continue;
-
-        case HTTP_REQ_POST_OK:
-          if (_config->GetValueBool("server.enablePost")) {
-            PostHandler(client, req);
-          } else {
-            { HTTPResponse res(400, "", false); client->Send(res.Get()); }
-          }
-
-          RemoveClient(client);
-          continue;
-      }
+        client->ResetHttpReq();
+        req = client->GetHttpReq();
 
-      if (!req->GetPath().empty()) {
-        // Handle /stats endpoint.
-        if (req->GetPath().compare("/stats") == 0) {
-          stats.SendToClient(client);
-          continue;
-        } else if (req->GetPath().compare("/") == 0) {
-          HTTPResponse res;
-          res.SetBody("OK\n");
-          client->Send(res.Get());
-          RemoveClient(client);
-          continue;
-        }
-
-        string chName = req->GetPath().substr(1);
-        SSEChannel *ch = GetChannel(chName);
-
-        DLOG(INFO) << "Channel: " << chName;
-
-        if (ch != NULL) {
-          epoll_ctl(_efd, EPOLL_CTL_DEL, client->Getfd(), NULL);
-          ch->AddClient(client, req);
-        } else {
-          HTTPResponse res;
-          res.SetStatus(404);
-          res.SetBody("Channel does not exist.\n");
-          client->Send(res.Get());
-          RemoveClient(client);
-        }
+        if (pipelined == 0) break;
+        reqRet = req->Parse(buf, pipelined);
       }
 
       if (n == maxEvents && maxEvents < 32768) {
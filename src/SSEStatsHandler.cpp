@@ -4,12 +4,16 @@
 #include <boost/foreach.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <unistd.h>
+#include <dirent.h>
+#include <sys/resource.h>
 #include <string>
 #include <sstream>
 #include <time.h>
 #include "Common.h"
 #include "SSEChannel.h"
 #include "SSEServer.h"
+#include "SSEInputSource.h"
+#include "EventRecorder.h"
 #include "SSEClient.h"
 #include "SSEStatsHandler.h"
 #include "HTTPResponse.h"
@@ -25,6 +29,8 @@ SSEStatsHandler::SSEStatsHandler() {
   oversized_http_req  = 0;
   invalid_events_rcv  = 0;
   router_read_errors  = 0;
+  publish_allowed     = 0;
+  publish_denied      = 0;
 }
 
 /**
@@ -44,18 +50,37 @@ void SSEStatsHandler::Init(SSEConfig* config, SSEServer* server) {
   _startTime = time(NULL);
 }
 
+/**
+ Returns the number of file descriptors open in this process.
+*/
+static long CountOpenFds() {
+  DIR* dir = opendir("/proc/self/fd");
+  long n_fds = 0;
+
+  if (dir == NULL) return -1;
+
+  while (readdir(dir) != NULL) n_fds++;
+  closedir(dir);
+
+  // Don't count ".", ".." and the fd used by opendir.
+  return n_fds - 3;
+}
+
 void SSEStatsHandler::Update() {
   ulong totalClients     = 0;
   ulong totalEvents      = 0;
   ulong totalConnects    = 0;
   ulong totalDisconnects = 0;
   ulong totalErrors      = 0;
+  ulong totalCacheBytes  = 0;
   uint  numChannels      = 0;
 
   boost::property_tree::ptree pt;
   boost::property_tree::ptree channels;
 
-  BOOST_FOREACH(const SSEChannelPtr& chan, _server->GetChannelList()) {
+  const SSEChannelList channelList = _server->GetChannelList();
+
+  BOOST_FOREACH(const SSEChannelPtr& chan, channelList) {
     boost::property_tree::ptree pt_element;
 
     const SSEChannelStats& stat = chan->GetStats();
@@ -65,6 +90,7 @@ void SSEStatsHandler::Update() {
     totalConnects    += stat.num_connects;
     totalDisconnects += stat.num_disconnects;
     totalErrors      += stat.num_errors;
+    totalCacheBytes  += stat.cache_bytes;
     numChannels++;
 
     pt_element.put("id", chan->GetId());
@@ -72,9 +98,14 @@ void SSEStatsHandler::Update() {
     pt_element.put("broadcasted_events", stat.num_broadcasted_events);
     pt_element.put("cached_events", stat.num_cached_events);
     pt_element.put("cache_size", stat.cache_size);
+    pt_element.put("cache_bytes", stat.cache_bytes);
     pt_element.put("total_connects", stat.num_connects);
     pt_element.put("total_disconnects", stat.num_disconnects);
     pt_element.put("client_errors", stat.num_errors);
+    pt_element.put("ingest_queued", stat.ingest_queued);
+    pt_element.put("ingest_blocked", stat.ingest_blocked);
+    pt_element.put("ingest_shed", stat.ingest_shed);
+    pt_element.put("fanout_stalls", stat.fanout_stalls);
 
     channels.push_back(std::make_pair("", pt_element));
   }
@@ -88,12 +119,30 @@ void SSEStatsHandler::Update() {
   pt.put("global.channel_connects", totalConnects);
   pt.put("global.channel_disconnects", totalDisconnects);
   pt.put("global.channel_client_errors", totalErrors);
+  pt.put("global.cache_bytes", totalCacheBytes);
   pt.put("global.router_read_errors", router_read_errors);
   pt.put("global.invalid_http_req", invalid_http_req);
   pt.put("global.oversized_http_req", oversized_http_req);
+  pt.put("global.publish_allowed", publish_allowed);
+  pt.put("global.publish_denied", publish_denied);
+
+  struct rlimit fdlimit;
+  pt.put("global.open_fds", CountOpenFds());
+  if (getrlimit(RLIMIT_NOFILE, &fdlimit) == 0) {
+    pt.put("global.max_fds", fdlimit.rlim_cur);
+  }
 
   pt.put("global.channels", numChannels);
 
+  if (_server->GetRecorder()) {
+    _server->GetRecorder()->GetStats(pt);
+  }
+
+  BOOST_FOREACH(const boost::shared_ptr<SSEInputSource>& source, _server->GetInputSources()) {
+    source->GetIngestStats(pt);
+    source->GetStats(pt);
+  }
+
   if (numChannels > 0) {
     pt.add_child("channels", channels);
   }
@@ -0,0 +1,223 @@
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "Common.h"
+#include "SSEEvent.h"
+#include "SharedEventRing.h"
+
+/*
+ Round up to a multiple of 8 so record headers stay aligned.
+*/
+static size_t Align8(size_t len) {
+  return (len + 7) & ~(size_t)7;
+}
+
+static char* PutField(char* p, const string& value) {
+  uint32_t len = value.size();
+
+  memcpy(p, &len, sizeof(len));
+  memcpy(p + sizeof(len), value.data(), len);
+
+  return p + sizeof(len) + len;
+}
+
+static bool GetField(const char*& p, const char* end, string& value) {
+  uint32_t len;
+
+  if ((size_t)(end - p) < sizeof(len)) return false;
+  memcpy(&len, p, sizeof(len));
+  p += sizeof(len);
+
+  if ((size_t)(end - p) < len) return false;
+  value.assign(p, len);
+  p += len;
+
+  return true;
+}
+
+/**
+ Map a ring shared with processes forked after this call.
+ @param capacity Size of the ring in bytes.
+ @return Ring, or NULL if the memory could not be mapped.
+*/
+SharedEventRing* SharedEventRing::Create(size_t capacity) {
+  size_t pageSize = sysconf(_SC_PAGESIZE);
+  capacity = Align8(capacity);
+  size_t size = pageSize + capacity;
+
+  void* mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+  if (mapping == MAP_FAILED) {
+    LOG(ERROR) << "Could not map shared event ring of " << size << " bytes: " << strerror(errno);
+    return NULL;
+  }
+
+  SharedEventRing* ring = new SharedEventRing(mapping, size);
+  ring->_hdr->capacity = capacity;
+  ring->_data = (char*)mapping + pageSize;
+
+  return ring;
+}
+
+SharedEventRing::SharedEventRing(void* mapping, size_t size) {
+  _hdr = (SharedEventRingHeader*)mapping;
+  _data = NULL;
+  _size = size;
+}
+
+SharedEventRing::~SharedEventRing() {
+  munmap(_hdr, _size);
+}
+
+/**
+ Append a event and wake up waiting readers, only one process may publish.
+ @param event Compiled event, before a sequence number has been assigned.
+ @return false if the event is too large for the ring.
+*/
+bool SharedEventRing::Publish(SSEEvent& event) {
+  const uint64_t capacity = _hdr->capacity;
+  const string path = event.getpath();
+  const string id = event.getid();
+  const string type = event.getevent();
+  const string data = event.getdata();
+  uint32_t retry = event.getretry();
+  uint32_t len = sizeof(retry) + 4 * sizeof(uint32_t) + path.size() + id.size() + type.size() + data.size();
+  size_t need = RING_RECORD_HEADER + Align8(len);
+
+  if (need > capacity / 4) {
+    LOG(ERROR) << "Event of " << len << " bytes too large for shared event ring, not passed on to other workers.";
+    return false;
+  }
+
+  uint64_t pos = _hdr->head;
+  size_t offset = pos % capacity;
+  size_t skip = (offset + need > capacity) ? capacity - offset : 0;
+
+  // Tell readers which bytes are about to be overwritten before touching them.
+  _hdr->reserve = pos + skip + need;
+  __sync_synchronize();
+
+  if (skip > 0) {
+    uint32_t wrap = RING_WRAP;
+    memcpy(_data + offset, &wrap, sizeof(wrap));
+    pos += skip;
+    offset = 0;
+  }
+
+  char* p = _data + offset + RING_RECORD_HEADER;
+  memcpy(p, &retry, sizeof(retry));
+  p = PutField(p + sizeof(retry), path);
+  p = PutField(p, id);
+  p = PutField(p, type);
+  PutField(p, data);
+  memcpy(_data + offset, &len, sizeof(len));
+
+  __sync_synchronize();
+  _hdr->head = pos + need;
+
+  __sync_fetch_and_add(&_hdr->futex, 1);
+  if (_hdr->waiters > 0) {
+    syscall(SYS_futex, &_hdr->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+  }
+
+  return true;
+}
+
+/**
+ Position of the next event to be published, where a new reader starts.
+*/
+uint64_t SharedEventRing::GetHead() {
+  return _hdr->head;
+}
+
+/**
+ Read the event at tail.
+ @param tail Read position, advanced past the event or to the head on overrun.
+ @param event Filled with the event.
+ @return RING_EVENT if a event was read, RING_EMPTY if there are no more events
+   or RING_OVERRUN if events were overwritten before we could read them.
+*/
+RingReadStatus SharedEventRing::Read(uint64_t& tail, SSEEvent& event) {
+  const uint64_t capacity = _hdr->capacity;
+  string path, id, type, data;
+  uint32_t retry;
+  uint32_t len;
+
+  while (true) {
+    uint64_t head = _hdr->head;
+    __sync_synchronize();
+
+    if (tail == head) return RING_EMPTY;
+
+    if (head - tail > capacity) {
+      tail = head;
+      return RING_OVERRUN;
+    }
+
+    size_t offset = tail % capacity;
+    memcpy(&len, _data + offset, sizeof(len));
+
+    if (len == RING_WRAP) {
+      tail += capacity - offset;
+      continue;
+    }
+
+    if (len > capacity || offset + RING_RECORD_HEADER + len > capacity) {
+      tail = head;
+      return RING_OVERRUN;
+    }
+
+    const char* p = _data + offset + RING_RECORD_HEADER;
+    const char* end = p + len;
+    bool valid = (len >= sizeof(retry));
+
+    if (valid) {
+      memcpy(&retry, p, sizeof(retry));
+      p += sizeof(retry);
+      valid = GetField(p, end, path) && GetField(p, end, id) && GetField(p, end, type) && GetField(p, end, data);
+    }
+
+    // The writer may have started overwriting the record while we copied it.
+    __sync_synchronize();
+    if (_hdr->reserve - tail > capacity || !valid) {
+      tail = _hdr->head;
+      return RING_OVERRUN;
+    }
+
+    tail += RING_RECORD_HEADER + Align8(len);
+    break;
+  }
+
+  event.setpath(path);
+  event.setid(id);
+  event.setevent(type);
+  event.setretry(retry);
+  event.setdata(data.data(), data.size());
+
+  return RING_EVENT;
+}
+
+/**
+ Sleep until a event is published after tail or the timeout expires.
+ @param tail Read position.
+ @param timeoutMs Max time to wait in milliseconds.
+*/
+void SharedEventRing::Wait(uint64_t tail, int timeoutMs) {
+  struct timespec ts;
+  int32_t val = _hdr->futex;
+
+  __sync_synchronize();
+  if (_hdr->head != tail) return;
+
+  ts.tv_sec = timeoutMs / 1000;
+  ts.tv_nsec = (timeoutMs % 1000) * 1000000;
+
+  __sync_fetch_and_add(&_hdr->waiters, 1);
+  syscall(SYS_futex, &_hdr->futex, FUTEX_WAIT, val, &ts, NULL, 0);
+  __sync_fetch_and_sub(&_hdr->waiters, 1);
+}
@@ -0,0 +1,68 @@
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include "Common.h"
+#include "ShutdownNotifier.h"
+
+ShutdownNotifier::ShutdownNotifier() {
+  _fd = -1;
+  _stopping = 0;
+}
+
+ShutdownNotifier::~ShutdownNotifier() {
+  if (_fd != -1) close(_fd);
+}
+
+/**
+ Create the eventfd, call after fork() so every worker gets its own.
+*/
+void ShutdownNotifier::Init() {
+  if (_fd != -1) close(_fd);
+
+  _fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  LOG_IF(FATAL, _fd == -1) << "eventfd failed: " << strerror(errno);
+}
+
+/**
+ Start shutting down, safe to call from a signal handler.
+*/
+void ShutdownNotifier::Notify() {
+  uint64_t one = 1;
+
+  _stopping = 1;
+
+  if (_fd != -1) {
+    // Can only fail if the counter would overflow, in which case it is readable already.
+    ssize_t ret = write(_fd, &one, sizeof(one));
+    (void)ret;
+  }
+}
+
+bool ShutdownNotifier::IsStopping() const {
+  return _stopping;
+}
+
+int ShutdownNotifier::GetFd() const {
+  return _fd;
+}
+
+/**
+ Sleep until the timeout expires or shutdown is requested.
+ @param timeoutMs Time to wait in milliseconds.
+ @return true if shutting down.
+*/
+bool ShutdownNotifier::Wait(int timeoutMs) const {
+  struct pollfd pfd;
+
+  pfd.fd = _fd;
+  pfd.events = POLLIN;
+
+  if (!_stopping && poll(&pfd, 1, timeoutMs) == -1 && errno != EINTR) {
+    LOG(ERROR) << "poll failed while waiting: " << strerror(errno);
+  }
+
+  return _stopping;
+}
@@ -1,24 +1,33 @@
 #include <iostream>
+#include <map>
 #include <signal.h>
 #include <sys/wait.h>
 #include <boost/program_options.hpp>
 #include <boost/foreach.hpp>
+#include <boost/lexical_cast.hpp>
 #include <unistd.h>
 #include "Common.h"
 #include "SSEConfig.h"
 #include "SSEServer.h"
+#include "ShutdownNotifier.h"
+#include "SharedEventRing.h"
 #define DEFAULT_CONFIG_FILE "./conf/config.json"
 
 using namespace std;
 namespace po = boost::program_options;
 
-int stop = 0;
-boost::thread_group serverThreads;
+ShutdownNotifier serverShutdown;
+vector<int> worker_pids;
 
+/*
+ Start a graceful shutdown, the master passes the signal on to its workers.
+*/
 void shutdown(int sigid) {
-  LOG(INFO) << "Exiting.";
-  stop = 1;
-  serverThreads.interrupt_all();
+  serverShutdown.Notify();
+
+  for (size_t i = 0; i < worker_pids.size(); i++) {
+    kill(worker_pids[i], SIGTERM);
+  }
 }
 
 po::variables_map parse_options(po::options_description desc, int argc, char **argv) {
@@ -30,17 +39,27 @@ po::variables_map parse_options(po::options_description desc, int argc, char **a
   return vm;
 }
 
-void StartServer(const string& conf_path) {
+void StartServer(const string& conf_path, int worker_id, const map<string, string>& overrides, SharedEventRing* ring, const sigset_t* sigmask) {
   SSEConfig conf;
+  worker_pids.clear();
+  serverShutdown.Init();
+  sigprocmask(SIG_SETMASK, sigmask, NULL);
   conf.load(conf_path.c_str());
+  conf.SetValue("server.workerId", boost::lexical_cast<string>(worker_id));
+
+  map<string, string>::const_iterator it;
+  for (it = overrides.begin(); it != overrides.end(); it++) {
+    conf.SetValue(it->first, it->second);
+  }
   SSEServer server(&conf);
+  server.SetEventRing(ring);
   server.Run();
   exit(0);
 }
 
 int main(int argc, char **argv) {
   struct sigaction sa;
-  vector<int> worker_pids;
+  sigset_t blocked, oldmask;
 
   FLAGS_logtostderr = 1;
   google::InitGoogleLogging(argv[0]);
@@ -48,7 +67,10 @@ int main(int argc, char **argv) {
   po::options_description desc("Options");
   desc.add_options()
     ("help", "produce help message")
-    ("config", po::value<std::string>()->default_value(DEFAULT_CONFIG_FILE), "specify location of config file");
+    ("config", po::value<std::string>()->default_value(DEFAULT_CONFIG_FILE), "specify location of config file")
+    ("upgrade", "take over sockets and clients from a running instance")
+    ("replay", po::value<std::string>(), "replay events from a capture file made by the recorder")
+    ("speed", po::value<std::string>()->default_value("1"), "replay speed relative to the recording, 0 for as fast as possible");
 
   po::variables_map vm = parse_options(desc, argc, argv);
 
@@ -58,18 +80,49 @@ int main(int argc, char **argv) {
   }
 
   std::string conf_path = vm["config"].as<std::string>();
+  map<string, string> overrides;
+
+  if (vm.count("upgrade")) overrides["server.upgrade"] = "true";
+
+  // Replay goes through the file input source of every worker.
+  if (vm.count("replay")) {
+    overrides["file.enabled"] = "true";
+    overrides["file.path"] = vm["replay"].as<std::string>();
+    overrides["file.format"] = "capture";
+    overrides["file.follow"] = "false";
+    overrides["file.rate"] = "0";
+    overrides["file.speed"] = vm["speed"].as<std::string>();
+    overrides["recorder.enabled"] = "false";
+  }
 
   sa.sa_handler = shutdown;
   sa.sa_flags   = 0;
 
   sigemptyset(&(sa.sa_mask));
   sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
 
   long nCPUS = sysconf(_SC_NPROCESSORS_ONLN);
   (nCPUS > 0) || (nCPUS = 1);
 
+  // Hold off shutdown signals while the list of workers is being built.
+  sigemptyset(&blocked);
+  sigaddset(&blocked, SIGINT);
+  sigaddset(&blocked, SIGTERM);
+  sigprocmask(SIG_BLOCK, &blocked, &oldmask);
+
   if (nCPUS == 1) {
-   StartServer(conf_path); 
+   StartServer(conf_path, 0, overrides, NULL, &oldmask);
+  }
+
+  // One worker consumes from AMQP and shares the events with the others through memory mapped before forking.
+  SharedEventRing* ring = NULL;
+  SSEConfig conf;
+  conf.load(conf_path.c_str());
+
+  if (conf.GetValueBool("amqp.enabled") && conf.GetValueBool("amqp.shared")) {
+    ring = SharedEventRing::Create((size_t)conf.GetValueInt("amqp.sharedRingSize") * 1024 * 1024);
+    LOG_IF(INFO, ring != NULL) << "Sharing AMQP events between workers.";
   }
 
   LOG(INFO) << "Starting " << nCPUS << " workers.";
@@ -80,16 +133,18 @@ int main(int argc, char **argv) {
       LOG(ERROR) << "Could not fork fork() worker " << i;
       abort();
     } else if (_pid == 0) {
-      StartServer(conf_path);
+      StartServer(conf_path, i, overrides, ring, &oldmask);
     }
 
     LOG(INFO) << "Started worker with PID: " << _pid;
     worker_pids.push_back(_pid);
   }
 
+  sigprocmask(SIG_SETMASK, &oldmask, NULL);
+
   BOOST_FOREACH(int worker_pid, worker_pids) {
     int status;
-    waitpid(worker_pid, &status, 0);
+    while (waitpid(worker_pid, &status, 0) == -1 && errno == EINTR);
     LOG(INFO) << "Worker with pid " << worker_pid << " exited.";
   }
 